@@ -0,0 +1,429 @@
+/*
+ *  This file is part of extfs
+ *  Copyright (c) 2017 extfs's authors
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// extfs_bench: builds synthetic trees through libextfs and reports one JSON
+// object per tree and operation on stdout:
+//
+//   {"tree":"wide","op":"echo","count":2000,"ops_per_sec":...,"p50_us":...,
+//    "p90_us":...,"p99_us":...,"max_us":...}
+//
+// The image lives in a scratch directory. The files of the mixed tree are
+// also read from several threads at once, as cat_threads_<n>, whose
+// ops_per_sec is the combined throughput.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "extfs.h"
+
+#define MAX_LINE 8192 // longest path
+#define MAX_DEPTH 256
+#define MAX_PATH 512 // mixed trees stay within MAX_DEPTH / 4 levels
+#define REPEAT 64 // runs of the cheap whole-tree operations: ls, lookups, read/write
+
+struct samples {
+    double *us;
+    size_t count, cap;
+};
+
+// one of the threads reading the mixed tree
+struct reader {
+    struct extfs *fs;
+    char (*paths)[MAX_PATH];
+    uint32_t *files;
+    uint32_t file_count, first;
+    struct samples s;
+    pthread_t thread;
+};
+
+struct extfs *fs;
+const char *tree;
+uint32_t threads;
+char content[MAX_LINE / 2];
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void add_sample(struct samples *s, double us) {
+    if (s->count == s->cap) {
+        s->cap = s->cap == 0 ? 1024 : s->cap * 2;
+        s->us = (double *) realloc(s->us, s->cap * sizeof(double));
+    }
+    s->us[s->count++] = us;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(struct samples *s, double p) {
+    size_t i = (size_t) (p * (s->count - 1) + 0.5);
+    return s->us[i];
+}
+
+// Prints the statistics of op, which ran for total_us, and empties s.
+void report_throughput(const char *op, struct samples *s, double total_us) {
+    if (s->count == 0)
+        return;
+    qsort(s->us, s->count, sizeof(double), compare_double);
+    printf("{\"tree\":\"%s\",\"op\":\"%s\",\"count\":%zu,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+           tree, op, s->count, total_us > 0 ? s->count * 1e6 / total_us : 0.0,
+           percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99), s->us[s->count - 1]);
+    s->count = 0;
+}
+
+// Prints the statistics of op and empties s.
+void report_op(const char *op, struct samples *s) {
+    double total = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        total += s->us[i];
+    }
+    report_throughput(op, s, total);
+}
+
+// Formats a path into buf, which holds MAX_LINE bytes.
+const char *format_path(char *buf, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, MAX_LINE, format, args);
+    va_end(args);
+    if (len < 0 || len >= MAX_LINE) {
+        fprintf(stderr, "Path too long.\n");
+        exit(1);
+    }
+    return buf;
+}
+
+// Adds the latency of a call that began at start to s unless s is NULL.
+void record(struct samples *s, double start, int status) {
+    double us = now_us() - start;
+    if (status != EXTFS_OK)
+        fprintf(stderr, "ERR: %s.\n", extfs_strerror(status));
+    if (s != NULL)
+        add_sample(s, us);
+}
+
+void ignore_data(void *arg, const char *data, size_t len) {
+    (void) arg;
+    (void) data;
+    (void) len;
+}
+
+void ignore_entry(void *arg, const char *name, int is_dir) {
+    (void) arg;
+    (void) name;
+    (void) is_dir;
+}
+
+void mkdir_op(struct samples *s, const char *path) {
+    double start = now_us();
+    record(s, start, extfs_mkdir(fs, path));
+}
+
+void rmdir_op(struct samples *s, const char *path) {
+    double start = now_us();
+    record(s, start, extfs_rmdir(fs, path));
+}
+
+void echo_op(struct samples *s, const char *path) {
+    double start = now_us();
+    record(s, start, extfs_create(fs, path, content, (uint32_t) strlen(content)));
+}
+
+void cat_op(struct samples *s, const char *path) {
+    double start = now_us();
+    record(s, start, extfs_read(fs, path, ignore_data, NULL));
+}
+
+void ls_op(struct samples *s, const char *path) {
+    double start = now_us();
+    record(s, start, extfs_readdir(fs, path, ignore_entry, NULL));
+}
+
+void rm_op(struct samples *s, const char *path) {
+    double start = now_us();
+    record(s, start, extfs_unlink(fs, path));
+}
+
+void set_content(size_t len) {
+    if (len >= sizeof(content))
+        len = sizeof(content) - 1;
+    for (size_t i = 0; i < len; i++) {
+        content[i] = 'a' + i % 26;
+    }
+    content[len] = '\0';
+}
+
+void persist(struct samples *s) {
+    for (int i = 0; i < REPEAT / 8; i++) {
+        double start = now_us();
+        record(s, start, extfs_sync(fs));
+    }
+    report_op("write_fs", s);
+    for (int i = 0; i < REPEAT / 8; i++) {
+        double start = now_us();
+        record(s, start, extfs_reload(fs));
+    }
+    report_op("read_fs", s);
+}
+
+// One dir holding n files.
+void bench_wide(uint32_t n, struct samples *s) {
+    char path[MAX_LINE];
+    tree = "wide";
+    mkdir_op(NULL, "/w");
+    set_content(100);
+    for (uint32_t i = 0; i < n; i++) {
+        echo_op(s, format_path(path, "/w/f%u", i));
+    }
+    report_op("echo", s);
+    for (uint32_t i = 0; i < n; i++) {
+        cat_op(s, format_path(path, "/w/f%u", i));
+    }
+    report_op("cat", s);
+    for (int i = 0; i < REPEAT; i++) {
+        ls_op(s, "/w");
+    }
+    report_op("ls", s);
+    persist(s);
+    for (uint32_t i = 0; i < n; i += 2) {
+        rm_op(s, format_path(path, "/w/f%u", i));
+    }
+    report_op("rm", s);
+    rmdir_op(s, "/w");
+    report_op("rmdir", s);
+}
+
+// A chain of depth dirs with a file in each.
+void bench_deep(uint32_t depth, struct samples *s) {
+    tree = "deep";
+    char path[MAX_LINE / 2] = "", file[MAX_LINE];
+    set_content(100);
+    for (uint32_t i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%u", i);
+        mkdir_op(s, path);
+    }
+    report_op("mkdir", s);
+    path[0] = '\0';
+    for (uint32_t i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%u", i);
+        echo_op(s, format_path(file, "%s/f", path));
+    }
+    report_op("echo", s);
+    // chdir resolves the whole path and moves back to the root right after
+    path[0] = '\0';
+    for (uint32_t i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%u", i);
+        if (((i + 1) & i) != 0 && i + 1 != depth)
+            continue;
+        for (int k = 0; k < REPEAT; k++) {
+            double start = now_us();
+            record(s, start, extfs_chdir(fs, path));
+            extfs_chdir(fs, "/");
+        }
+        char op[32];
+        sprintf(op, "lookup_depth_%u", i + 1);
+        report_op(op, s);
+        for (int k = 0; k < REPEAT; k++) {
+            cat_op(s, format_path(file, "%s/f", path));
+        }
+        sprintf(op, "cat_depth_%u", i + 1);
+        report_op(op, s);
+    }
+    persist(s);
+    rmdir_op(s, "/d0");
+    report_op("rmdir", s);
+}
+
+void *reader_main(void *arg) {
+    struct reader *r = (struct reader *) arg;
+    for (uint32_t k = 0; k < r->file_count; k++) {
+        double start = now_us();
+        record(&r->s, start, extfs_read(r->fs, r->paths[r->files[(r->first + k) % r->file_count]], ignore_data, NULL));
+    }
+    return NULL;
+}
+
+// Has count threads read all files at once, each on a handle of its own and
+// starting at a different file.
+void parallel_cat(uint32_t count, char (*paths)[MAX_PATH], uint32_t *files, uint32_t file_count,
+                  struct samples *s) {
+    struct reader *readers = (struct reader *) calloc(count, sizeof(struct reader));
+    double start = now_us();
+    for (uint32_t i = 0; i < count; i++) {
+        struct reader *r = &readers[i];
+        r->fs = extfs_dup(fs);
+        r->paths = paths;
+        r->files = files;
+        r->file_count = file_count;
+        r->first = (uint32_t) ((uint64_t) file_count * i / count);
+        pthread_create(&r->thread, NULL, reader_main, r);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        pthread_join(readers[i].thread, NULL);
+    }
+    double wall = now_us() - start;
+    for (uint32_t i = 0; i < count; i++) {
+        for (size_t k = 0; k < readers[i].s.count; k++) {
+            add_sample(s, readers[i].s.us[k]);
+        }
+        free(readers[i].s.us);
+        extfs_close(readers[i].fs);
+    }
+    free(readers);
+    char op[32];
+    sprintf(op, "cat_threads_%u", count);
+    report_throughput(op, s, wall);
+}
+
+// A random tree of n entries, about one dir in eight, with files of up
+// to 2000 bytes.
+void bench_mixed(uint32_t n, struct samples *s) {
+    tree = "mixed";
+    struct samples mkdir_s = {NULL, 0, 0};
+    uint32_t *parent = (uint32_t *) malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *depth = (uint32_t *) malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *dirs = (uint32_t *) malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *files = (uint32_t *) malloc((n + 1) * sizeof(uint32_t));
+    uint32_t dir_count = 1, file_count = 0;
+    char (*paths)[MAX_PATH] = malloc((n + 1) * sizeof(*paths));
+    srand(1);
+    strcpy(paths[0], "/m");
+    dirs[0] = 0;
+    depth[0] = 0;
+    mkdir_op(NULL, "/m");
+    for (uint32_t i = 1; i <= n; i++) {
+        uint32_t p = dirs[rand() % dir_count];
+        if (depth[p] >= MAX_DEPTH / 4)
+            p = 0;
+        parent[i] = p;
+        depth[i] = depth[p] + 1;
+        size_t len = strlen(paths[p]);
+        memcpy(paths[i], paths[p], len);
+        snprintf(paths[i] + len, MAX_PATH - len, "/e%u", i);
+        if (rand() % 8 == 0) {
+            mkdir_op(&mkdir_s, paths[i]);
+            dirs[dir_count++] = i;
+        } else {
+            set_content(1 + rand() % 2000);
+            echo_op(s, paths[i]);
+            files[file_count++] = i;
+        }
+    }
+    report_op("mkdir", &mkdir_s);
+    report_op("echo", s);
+    for (uint32_t i = 0; i < file_count; i++) {
+        cat_op(s, paths[files[i]]);
+    }
+    report_op("cat", s);
+    parallel_cat(1, paths, files, file_count, s);
+    if (threads > 1) {
+        parallel_cat(threads, paths, files, file_count, s);
+    }
+    for (uint32_t i = 0; i < dir_count; i++) {
+        ls_op(s, paths[dirs[i]]);
+    }
+    report_op("ls", s);
+    persist(s);
+    for (uint32_t i = 0; i < file_count; i += 2) {
+        rm_op(s, paths[files[i]]);
+    }
+    report_op("rm", s);
+    // top level subtrees first, each rmdir takes everything below it
+    for (uint32_t i = 1; i < dir_count; i++) {
+        if (parent[dirs[i]] == 0)
+            rmdir_op(s, paths[dirs[i]]);
+    }
+    rmdir_op(s, "/m");
+    report_op("rmdir", s);
+    free(mkdir_s.us);
+    free(paths);
+    free(files);
+    free(dirs);
+    free(depth);
+    free(parent);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    uint32_t n = 2000;
+    const char *dir = NULL;
+    int journal_policy = EXTFS_JOURNAL_OFF;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 1 ? (uint32_t) cpus : 1;
+    while ((opt = getopt(argc, argv, "n:d:j:t:")) != -1) {
+        if (opt == 'n' && (n = (uint32_t) strtoul(optarg, NULL, 10)) > 0) {
+            continue;
+        } else if (opt == 'd') {
+            dir = optarg;
+            continue;
+        } else if (opt == 'j' && (journal_policy = extfs_parse_journal_policy(optarg)) != ERROR) {
+            continue;
+        } else if (opt == 't' && (threads = (uint32_t) strtoul(optarg, NULL, 10)) > 0) {
+            continue;
+        }
+        fprintf(stderr, "usage: %s [-n entries] [-d dir] [-j off|async|group|sync] [-t threads]\n"
+                        "\t-n: entries per tree, 2000 by default.\n"
+                        "\t-d: scratch directory, a new one under /tmp by default.\n"
+                        "\t-j: journal fsync policy, off by default.\n"
+                        "\t-t: threads reading the mixed tree at once, one per CPU by default.\n", argv[0]);
+        return 1;
+    }
+    char temp[] = "/tmp/extfs_bench.XXXXXX";
+    if (dir == NULL && (dir = mkdtemp(temp)) == NULL) {
+        fprintf(stderr, "Cannot create a scratch directory.\n");
+        return 1;
+    }
+    if (chdir(dir) != 0) {
+        fprintf(stderr, "Cannot change to %s.\n", dir);
+        return 1;
+    }
+    if ((fs = extfs_open("data.dsk", journal_policy, EXTFS_QUIET)) == NULL) {
+        fprintf(stderr, "Cannot open the image.\n");
+        return 1;
+    }
+
+    struct samples s = {NULL, 0, 0};
+    uint32_t inodes = 2 * n + 1024 > 65535 ? 65535 : 2 * n + 1024;
+    record(NULL, now_us(), extfs_format(fs, inodes, 4 * n + 4096));
+    bench_wide(n, &s);
+    bench_deep(n < MAX_DEPTH ? n : MAX_DEPTH, &s);
+    bench_mixed(n, &s);
+    free(s.us);
+    extfs_close(fs);
+    if (dir == temp) {
+        const char *files[] = {"data.dsk", "data.dsk.jnl", "data.dsk.jnl.old", "data.dsk.ckpt", "data.dsk.ckpt.tmp"};
+        for (int i = 0; i < 5; i++) {
+            unlink(files[i]);
+        }
+        if (chdir("/") == 0)
+            rmdir(temp);
+    }
+    return 0;
+}
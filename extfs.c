@@ -0,0 +1,6788 @@
+/*
+ *  This file is part of extfs
+ *  Copyright (c) 2017 extfs's authors
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+#include "extfs.h"
+
+#define MAX_INODE 65535 // inode numbers are 16 bits wide and INVALID_INODE is taken
+#define DEFAULT_INODES 4096
+#define DEFAULT_BLOCKS 4096
+#define FIXED_INODES 4096 // the fixed layout used up to EXTENT_VERSION
+#define FIXED_BLOCKS 4096
+#define GROUP_BLOCKS 8192
+#define MAX_GROUPS ((BLOCK_SIZE - 64) / sizeof(struct group_desc))
+#define MAX_BLOCKS_PER_INODE 1
+#define BLOCK_SIZE 4096
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct inode))
+#define INLINE_EXTENTS 2
+#define INLINE_DATA_SIZE 128 // files up to this size share a block with the files of adjacent inodes
+#define INLINE_PER_BLOCK (BLOCK_SIZE / INLINE_DATA_SIZE)
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct extent))
+#define MAX_EXTENTS (INLINE_EXTENTS + EXTENTS_PER_BLOCK)
+#define MAX_FILENAME 252
+#define MAX_PATH 4096
+#define MAX_DIRENTRY_PER_BLOCK 16 // fixed slots of a dir block up to INLINE_VERSION
+#define RECORD_ALIGN 4 // dir records start at multiples of this, their slot is the offset over it
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_RUNS 16 // runs of blocks holding the inode tables a snapshot keeps
+#define SNAPSHOT_NAME 32
+#define SUM_BLOCKS (GROUP_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE) // blocks holding the checksums of a group
+#define CURRENT_VERSION 20261024
+#define SNAPSHOT_VERSION 20261023
+#define RECORD_VERSION 20261022
+#define INLINE_VERSION 20261021
+#define GROUP_VERSION 20261020
+#define EXTENT_VERSION 20261019
+#define PARENT_VERSION 20261018
+#define INDEXED_VERSION 20261017
+#define PACKED_BITMAP_VERSION 20261016
+#define LEGACY_VERSION 20171213
+#define INVALID_INODE UINT16_MAX
+#define ROOT_INODE 0
+#define DIRTY_CHUNK BLOCK_SIZE // saves need chunks to be blocks
+#define JOURNAL_MAGIC 0x4C4E524A
+#define CHECKPOINT_MAGIC 0x54504B43
+#define CHECKPOINT_TRUNCATE 1
+#define CHECKPOINT_HOLE (1ULL << 63) // flags the len of a range of unused blocks, stored without data
+#define PACK_MAGIC 0x4B434150
+#define PACK_LEVEL 1 // zlib level, saves are mostly small
+#define PACK_BUFFER (1 << 20)
+#define CACHE_BLOCKS 16384 // data blocks of a pack kept in memory
+#define CHECKSUM_SEED 2166136261u
+#define CRC32C_POLY 0x82F63B78u // reflected
+#define JOURNAL_GROUP_RECORDS 64
+#define JOURNAL_GROUP_MS 5
+#define JOURNAL_CHECKPOINT_BYTES (4 << 20)
+#define INDEX_ENTRIES_PER_BLOCK 512
+#define MAX_INDEX_BLOCKS 16
+#define INDEX_HEADER_ENTRIES \
+    ((sizeof(struct index_header) + sizeof(struct index_entry) - 1) / sizeof(struct index_entry))
+#define INDEX_MIN_CHAIN 2
+#define DCACHE_SIZE 4096
+#define DCACHE_LOCKS 64
+#define DIR_LOCKS 256
+#define RECLAIM_STEP 64 // dirs freed per turn of the background reclaim
+#define FSCK_THREADS 16
+#define SCAN_THREADS 16
+#define FSCK_ROUNDS 4 // passes of a repair, later ones clean up after the fixes of earlier ones
+#define SLOT_WORDS (BLOCK_SIZE / RECORD_ALIGN / 64) // words of a bitmap with a bit per record slot
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#ifdef EXTFS_STATS
+#define STAT_ADD(fs, counter, n) STORE((fs)->counters.counter, LOAD((fs)->counters.counter) + (n))
+#define STAT_BEGIN(start) uint64_t start = clock_ns()
+#define STAT_END(fs, op, start) stat_time(fs, op, start)
+#else
+// the arguments are not even evaluated
+#define STAT_ADD(fs, counter, n) ((void) 0)
+#define STAT_BEGIN(start) ((void) 0)
+#define STAT_END(fs, op, start) ((void) 0)
+#endif
+const char *JOURNAL_SUFFIX = ".jnl";
+const char *OLD_JOURNAL_SUFFIX = ".jnl.old";
+const char *CHECKPOINT_SUFFIX = ".ckpt";
+const char *CHECKPOINT_TEMP_SUFFIX = ".ckpt.tmp";
+const char *PACK_TEMP_SUFFIX = ".pack.tmp";
+
+const int MODE_DIR = 1;
+const int MODE_FILE = 2;
+const int MODE_CONT = 3;
+const int MODE_INDEX = 4;
+
+const int FILE_INLINE = 1;
+
+const int INDEX_EMPTY = 0;
+const int INDEX_LIVE = 1;
+const int INDEX_DELETED = 2;
+
+// what fsck repair does about a problem
+const int FIX_NONE = 0;
+const int FIX_DROP = 1;    // drops the entry at chain and slot of dir
+const int FIX_CUT = 2;     // ends the chain of dir at chain
+const int FIX_INDEX = 3;   // drops the index of dir
+const int FIX_COUNTS = 4;  // rewrites dir
+const int FIX_PARENT = 5;  // points the parent of target at the entry at chain and slot of dir
+const int FIX_BITMAPS = 6; // writes the claims as the bitmaps, which every repair does
+
+const uint32_t JR_FMT = 1;
+const uint32_t JR_MKDIR = 2;
+const uint32_t JR_ECHO = 3;
+const uint32_t JR_RM = 4;
+const uint32_t JR_RMDIR = 5;
+const uint32_t JR_RESIZE = 6;
+const uint32_t JR_DETACH = 7;
+const uint32_t JR_RECLAIM = 8;
+const uint32_t JR_DEFRAG = 9;
+const uint32_t JR_SNAPSHOT = 10;
+const uint32_t JR_ROLLBACK = 11;
+const uint32_t JR_DROP_SNAPSHOT = 12;
+
+// 32 bytes
+struct group_desc {
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint32_t inodes; // fewer than inodes_per_group once MAX_INODE is reached
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t sums; // first of the SUM_BLOCKS blocks holding checksums, 0 if the group has none
+    uint32_t reserved;
+};
+
+// Block 0 of the image. Block group g covers the GROUP_BLOCKS blocks from
+// g * GROUP_BLOCKS on and starts with its block bitmap, inode bitmap and inode
+// table. Inode i lives in group i / inodes_per_group.
+struct super_block {
+    uint32_t version;
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t inodes_per_group;
+    uint32_t group_count;
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t inode_hint; // where the next free search starts
+    uint32_t block_hint;
+    uint32_t snapshot_table; // block of the snapshot table, 0 if there are no snapshots
+    uint8_t reserved[64 - 10 * sizeof(uint32_t)];
+    struct group_desc groups[MAX_GROUPS];
+};
+
+// a run of contiguous blocks holding file data
+struct extent {
+    uint32_t start;
+    uint32_t len;
+};
+
+// 32 bytes
+struct inode {
+    uint16_t mode;
+    uint16_t index_inode; // for dir: first inode of its hashed index, 0 if none
+    uint32_t file_size;
+    union {
+        struct { // dir, cont and index
+            uint16_t entry_count;
+            uint16_t next_inode; // for dir whose entries do not fit in one block
+            union {
+                uint16_t bitmap; // up to INLINE_VERSION: one bit per used entry slot
+                uint16_t free_bytes; // for dir and cont: bytes of the block not taken by records
+            };
+            uint16_t parent; // for dir: the dir holding its entry, itself for the root
+            uint16_t parent_chain; // for dir: inode and slot of that entry
+            uint16_t parent_slot;
+            uint16_t max_free; // for dir and cont: the largest record that still fits in the block
+            uint8_t reserved[6];
+            uint32_t blocks[MAX_BLOCKS_PER_INODE];
+        };
+        struct { // file
+            uint16_t extent_count;
+            uint16_t file_flags;
+            union {
+                struct {
+                    struct extent extents[INLINE_EXTENTS];
+                    uint32_t extent_block; // holds the extents past INLINE_EXTENTS, 0 if none
+                };
+                uint32_t inline_block; // with FILE_INLINE: holds the contents
+            };
+        };
+    };
+};
+
+// A dir block is a list of records, each running up to the next one. Removing
+// a record adds its bytes to the one before it, or marks it free if it comes
+// first, so records stay where they are until the dir is repacked.
+struct entry {
+    uint32_t id;
+    uint16_t rec_len; // bytes up to the next record, the last one runs to the end of the block
+    uint8_t name_len;
+    uint8_t type; // mode of the inode, 0 for a free record
+    char name[]; // nul-terminated
+};
+
+// dir entry of the blocks up to INLINE_VERSION, MAX_DIRENTRY_PER_BLOCK to a block
+struct slot_entry {
+    uint32_t id;
+    char name[MAX_FILENAME];
+};
+
+struct index_entry {
+    uint32_t hash;
+    uint16_t chain; // inode and slot holding the dir entry
+    uint16_t slot : 14;
+    uint16_t state : 2;
+};
+
+// stored in the first entries of the first index block
+struct index_header {
+    uint16_t blocks;
+    uint16_t used; // live or deleted table slots
+    uint16_t live;
+    uint16_t tail; // last inode of the dir entry chain
+    uint16_t room; // at least the max_free of every inode of the chain
+    uint16_t inodes[MAX_INDEX_BLOCKS];
+};
+
+union data {
+    char data[BLOCK_SIZE];
+    struct slot_entry slots[MAX_DIRENTRY_PER_BLOCK];
+    struct index_entry index[INDEX_ENTRIES_PER_BLOCK];
+    struct extent extents[EXTENTS_PER_BLOCK];
+};
+
+// A snapshot keeps a copy of the inode bitmap and inode table of every group,
+// one after the other in its runs, and shares all blocks its inodes refer to
+// with the live tree and the other snapshots.
+struct snapshot {
+    char name[SNAPSHOT_NAME];
+    uint64_t time;
+    uint32_t groups; // group count when it was taken
+    uint32_t run_count;
+    struct extent runs[SNAPSHOT_RUNS];
+};
+
+struct snapshot_table {
+    uint32_t count;
+    uint32_t reserved;
+    struct snapshot snapshots[MAX_SNAPSHOTS];
+};
+
+// 8 kb, layout of PACKED_BITMAP_VERSION up to EXTENT_VERSION images
+struct fixed_super_block {
+    uint64_t inode_bitmap[FIXED_INODES / 64];
+    uint64_t block_bitmap[FIXED_BLOCKS / 64];
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t inode_hint;
+    uint32_t block_hint;
+    uint8_t reserved[8192 - (FIXED_INODES + FIXED_BLOCKS) / 8 - 4 * sizeof(uint32_t)];
+};
+
+struct fixed_file {
+    uint32_t version;
+    struct fixed_super_block sb;
+    struct inode nodes[FIXED_INODES];
+    union data blocks[FIXED_BLOCKS];
+};
+
+// layout of LEGACY_VERSION images
+struct legacy_file {
+    uint32_t version;
+    uint8_t inode_bitmap[FIXED_INODES];
+    uint8_t block_bitmap[FIXED_BLOCKS];
+    struct inode nodes[FIXED_INODES];
+    union data blocks[FIXED_BLOCKS];
+};
+
+// dirs whose subtrees are still to be freed
+struct dir_stack {
+    uint32_t *dirs;
+    uint32_t count, cap;
+};
+
+// Bytes of the files and number of inodes, files and dirs, below a dir and
+// the dir itself.
+struct subtree {
+    uint64_t bytes;
+    uint32_t inodes;
+    uint32_t reserved;
+};
+
+// Dentry cache, direct mapped by hash of (parent, name). child is ERROR for
+// negative entries. An entry is only valid while its epoch and the generation
+// of its parent are current: freeing an inode bumps its generation and
+// formatting or reloading bumps the epoch.
+//
+// Lookups read entries without a lock: an entry is written, under one of the
+// dcache locks, with seq odd, and a lookup that saw seq change meanwhile
+// counts as a miss.
+struct dentry {
+    uint32_t seq;
+    uint32_t parent;
+    uint32_t parent_gen;
+    uint32_t epoch;
+    uint32_t child;
+    uint32_t child_dir; // whether child is a dir
+    uint32_t hash;
+    char name[MAX_FILENAME];
+};
+
+#ifdef EXTFS_STATS
+// What the calls on a handle did, see extfs_stats. All fields are uint64_t,
+// so that handles can be added up and cleared as arrays.
+struct counters {
+    uint64_t path_components;
+    uint64_t dir_scans, records_scanned, chain_links, name_compares;
+    uint64_t inode_allocs, inode_scan_bits, inode_groups_skipped;
+    uint64_t bytes_read, bytes_written;
+    uint64_t op_calls[EXTFS_OPS], op_ns[EXTFS_OPS];
+    uint64_t op_buckets[EXTFS_OPS][EXTFS_STATS_BUCKETS];
+};
+#endif
+
+// A handle on an image. Handles made by extfs_dup share the image, but each
+// has a working dir of its own.
+struct extfs {
+    struct image *img;
+    struct extfs *next; // in the list of handles on img
+    // Calls on the handle hold it shared. Calls replacing the image or
+    // removing subtrees (format, resize, rmdir, reload) hold the locks of all
+    // handles, so readers on different handles share no lock.
+    pthread_rwlock_t lock;
+    int error; // status of the last failed operation
+    uint32_t cur_dir;
+    uint32_t temp_parent; // dir holding the last component found by find_path_inode
+    uint32_t sparse_dir; // dir the last unlink left sparse, INVALID_INODE if none
+    // counted per handle, so that lookups on different threads do not share
+    // a cache line
+    uint64_t dcache_hits, dcache_negative_hits, dcache_misses, dcache_invalidations;
+#ifdef EXTFS_STATS
+    struct counters counters;
+#endif
+};
+
+// An open image, shared by all handles on it.
+struct image {
+    // the image file, the files next to it and the dir holding them
+    char *data_file, *journal_file, *old_journal_file, *checkpoint_file, *checkpoint_temp_file;
+    char *pack_temp_file;
+    char *dir_name;
+    int quiet; // no progress messages
+
+    // Changes to the image run one at a time, from their first allocation
+    // up to their journal record, since replay needs the journal in the
+    // order inodes and blocks were allocated. Finding the dir and checking
+    // the name only take the dir's stripe, so that part runs in parallel.
+    pthread_mutex_t update_lock;
+    // Searches of a dir hold its stripe shared, the update changing it holds
+    // it exclusive. Lookups the dentry cache answers take none.
+    pthread_rwlock_t dir_locks[DIR_LOCKS];
+    pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+    pthread_mutex_t handles_lock; // guards the list of handles
+    struct extfs *handles;
+    struct extfs self; // handle of the background threads
+
+    // the image, an array of blocks_count blocks starting with the super block
+    struct super_block *fp;
+    // >= 0 when fp is a mapping of data_file, -1 when fp is malloc'd
+    int fs_fd;
+    int fs_shared;
+    // data_file is a pack, a compressed copy of the image, and fp is malloc'd
+    int packed;
+    int pack_wanted; // EXTFS_PACKED, raw images become packs when saved
+    // A pack is read lazily: only the group metadata is unpacked when it is
+    // opened, data blocks on first touch. Once more than cache_limit data
+    // blocks are in memory, clean ones are dropped again in CLOCK order.
+    int lazy;
+    int pack_fd;
+    struct pack_entry *pack_index; // an entry per block
+    uint64_t *loaded, *referenced; // a bit per block
+    uint32_t resident; // data blocks loaded
+    uint32_t cache_limit, clock_hand;
+    pthread_mutex_t cache_lock; // guards faults and pack_fd
+    size_t image_size; // bytes at fp
+    // one bit per DIRTY_CHUNK bytes of the image modified since the last save
+    uint64_t *dirty_chunks;
+    size_t dirty_chunk_count;
+
+    int journal_policy;
+    int journal_fd;
+    uint64_t journal_seq;
+    size_t journal_size; // bytes in journal_file, including buffered ones
+    char *journal_buf, *journal_spare;
+    size_t journal_len, journal_cap, journal_spare_cap;
+    uint32_t journal_pending;
+    int journal_unsynced;
+    pthread_mutex_t journal_lock;       // guards the buffer
+    pthread_mutex_t journal_flush_lock; // guards journal_fd
+    pthread_cond_t journal_cond;
+    pthread_t journal_flusher;
+    int journal_flusher_running, journal_stop;
+    pthread_t checkpoint_thread;
+    int checkpoint_running, checkpoint_failed;
+    // a journal write, checkpoint or save failed where no caller could be
+    // told, kept for extfs_check_io
+    int io_failed;
+    int replaying;
+    int format_pending; // the next checkpoint starts from an empty image
+
+    // EXTFS_LAZY_FREE: subtrees unlinked by rmdir but not freed yet, which
+    // the reclaim thread works through
+    int lazy_free;
+    struct dir_stack orphans;
+    pthread_t reclaimer;
+    int reclaimer_running, reclaim_stop, reclaim_wanted;
+    pthread_mutex_t reclaim_lock;
+    pthread_cond_t reclaim_cond;
+    // unlink and rmdir repack dirs left with fewer than this percentage of
+    // their slots used, 0 if they do not
+    uint32_t defrag_threshold;
+    // While there are snapshots, the number of trees referring to each block,
+    // the live one and the snapshots, plus 1 for the blocks of the snapshots
+    // themselves. Blocks are freed when it drops to 0, and copied before the
+    // live tree changes them while it is above 1. NULL without snapshots.
+    uint8_t *refs;
+    uint32_t bad_blocks; // blocks that failed their checksum or a read since the image was read
+    // Totals of every dir, by inode, once du first needs them. Updates keep
+    // them along the parent chain; whatever changes the tree wholesale clears
+    // subtrees_valid, and the next du walks the tree again.
+    struct subtree *subtrees;
+    int subtrees_valid;
+
+    struct dentry dcache[DCACHE_SIZE];
+    uint32_t dcache_gen[MAX_INODE];
+    uint32_t dcache_epoch;
+    // counts of the handles closed so far
+    uint64_t dcache_hits, dcache_negative_hits, dcache_misses, dcache_invalidations;
+#ifdef EXTFS_STATS
+    struct counters counters;
+#endif
+};
+
+// Block cache of lazily read packs
+void cache_touch(struct extfs *fs, uint32_t block, uint32_t len);
+void cache_mark_loaded(struct extfs *fs, uint32_t block, uint32_t len);
+void cache_load_all(struct extfs *fs);
+void cache_drop(struct extfs *fs);
+void cache_shrink(struct extfs *fs);
+
+// Prints a progress message, which EXTFS_QUIET leaves out.
+void info(struct extfs *fs, const char *format, ...) {
+    if (fs->img->quiet)
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+// Records why the current operation failed. Returns ERROR.
+uint32_t fail(struct extfs *fs, int status) {
+    fs->error = status;
+    return ERROR;
+}
+
+#ifdef EXTFS_STATS
+// Statistics
+//
+// Counters are kept per handle, like those of the dentry cache, and only
+// summed up when asked for. Without EXTFS_STATS none of this is compiled.
+
+uint64_t clock_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Counts a call of op that started at start, in bucket log2 of the
+// nanoseconds it took.
+void stat_time(struct extfs *fs, int op, uint64_t start) {
+    uint64_t ns = clock_ns() - start;
+    uint32_t k = 63 - __builtin_clzll(ns | 1);
+    STAT_ADD(fs, op_calls[op], 1);
+    STAT_ADD(fs, op_ns[op], ns);
+    STAT_ADD(fs, op_buckets[op][k < EXTFS_STATS_BUCKETS ? k : EXTFS_STATS_BUCKETS - 1], 1);
+}
+
+void add_counters(struct counters *sum, struct counters *c) {
+    uint64_t *to = (uint64_t *) sum, *from = (uint64_t *) c;
+    for (size_t i = 0; i < sizeof(struct counters) / sizeof(uint64_t); i++) {
+        to[i] += LOAD(from[i]);
+    }
+}
+
+void clear_counters(struct counters *c) {
+    uint64_t *p = (uint64_t *) c;
+    for (size_t i = 0; i < sizeof(struct counters) / sizeof(uint64_t); i++) {
+        STORE(p[i], 0);
+    }
+}
+#endif
+
+// Locking
+
+void lock_image(struct extfs *fs) {
+    pthread_rwlock_rdlock(&fs->lock);
+}
+
+void unlock_image(struct extfs *fs) {
+    pthread_rwlock_unlock(&fs->lock);
+    if (LOAD(fs->img->lazy) && LOAD(fs->img->resident) > LOAD(fs->img->cache_limit)) {
+        cache_shrink(fs);
+    }
+}
+
+// Waits for the calls on all handles, and the reclaim thread, to finish and
+// keeps new ones out.
+void lock_image_exclusive(struct extfs *fs) {
+    pthread_mutex_lock(&fs->img->handles_lock);
+    for (struct extfs *h = fs->img->handles; h != NULL; h = h->next) {
+        pthread_rwlock_wrlock(&h->lock);
+    }
+    pthread_rwlock_wrlock(&fs->img->self.lock);
+}
+
+void unlock_image_exclusive(struct extfs *fs) {
+    pthread_rwlock_unlock(&fs->img->self.lock);
+    for (struct extfs *h = fs->img->handles; h != NULL; h = h->next) {
+        pthread_rwlock_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&fs->img->handles_lock);
+}
+
+// Takes the image shared and the update lock, in that order, so that no
+// change to the image runs meanwhile.
+void begin_update(struct extfs *fs) {
+    lock_image(fs);
+    pthread_mutex_lock(&fs->img->update_lock);
+}
+
+void end_update(struct extfs *fs) {
+    pthread_mutex_unlock(&fs->img->update_lock);
+    unlock_image(fs);
+}
+
+// Takes the update lock around a change, with the image shared and the
+// changed dir's stripe exclusive already held. Nothing that holds the update
+// lock takes a stripe.
+void begin_change(struct extfs *fs) {
+    pthread_mutex_lock(&fs->img->update_lock);
+}
+
+void end_change(struct extfs *fs) {
+    pthread_mutex_unlock(&fs->img->update_lock);
+}
+
+void lock_dir(struct extfs *fs, uint32_t dir, int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&fs->img->dir_locks[dir % DIR_LOCKS]);
+    } else {
+        pthread_rwlock_rdlock(&fs->img->dir_locks[dir % DIR_LOCKS]);
+    }
+}
+
+void unlock_dir(struct extfs *fs, uint32_t dir) {
+    pthread_rwlock_unlock(&fs->img->dir_locks[dir % DIR_LOCKS]);
+}
+
+// Moves the working dir of every handle to the root, after a format or
+// reload.
+void reset_cwds(struct extfs *fs) {
+    fs->cur_dir = ROOT_INODE;
+    for (struct extfs *h = fs->img->handles; h != NULL; h = h->next) {
+        h->cur_dir = ROOT_INODE;
+    }
+}
+
+// Layout
+
+// The run of len blocks starting at start, which are adjacent in memory.
+union data *get_blocks(struct extfs *fs, uint32_t start, uint32_t len) {
+    if (fs->img->lazy) {
+        cache_touch(fs, start, len);
+    }
+    return (union data *) fs->img->fp + start;
+}
+
+union data *get_block(struct extfs *fs, uint32_t block) {
+    return get_blocks(fs, block, 1);
+}
+
+uint32_t inode_group(struct extfs *fs, uint32_t inode) {
+    return inode / fs->img->fp->inodes_per_group;
+}
+
+struct inode *get_inode(struct extfs *fs, uint32_t inode) {
+    struct group_desc *gd = &fs->img->fp->groups[inode_group(fs, inode)];
+    return (struct inode *) get_block(fs, gd->inode_table) + inode % fs->img->fp->inodes_per_group;
+}
+
+uint64_t *inode_bitmap(struct extfs *fs, uint32_t group) {
+    return (uint64_t *) get_block(fs, fs->img->fp->groups[group].inode_bitmap);
+}
+
+uint64_t *block_bitmap(struct extfs *fs, uint32_t group) {
+    return (uint64_t *) get_block(fs, fs->img->fp->groups[group].block_bitmap);
+}
+
+int inode_used(struct extfs *fs, uint32_t inode) {
+    uint32_t i = inode % fs->img->fp->inodes_per_group;
+    return (inode_bitmap(fs, inode_group(fs, inode))[i / 64] >> (i % 64)) & 1;
+}
+
+// Blocks in group, the last one may be short.
+uint32_t group_length(struct extfs *fs, uint32_t group) {
+    uint32_t left = fs->img->fp->blocks_count - group * GROUP_BLOCKS;
+    return left < GROUP_BLOCKS ? left : GROUP_BLOCKS;
+}
+
+// Dirty tracking
+void resize_dirty_chunks(struct extfs *fs, size_t size) {
+    size_t words = (fs->img->dirty_chunk_count + 63) / 64;
+    fs->img->dirty_chunk_count = (size + DIRTY_CHUNK - 1) / DIRTY_CHUNK;
+    size_t new_words = (fs->img->dirty_chunk_count + 63) / 64;
+    fs->img->dirty_chunks = (uint64_t *) realloc(fs->img->dirty_chunks, new_words * sizeof(uint64_t));
+    if (new_words > words) {
+        memset(fs->img->dirty_chunks + words, 0, (new_words - words) * sizeof(uint64_t));
+    }
+}
+
+void clear_dirty(struct extfs *fs) {
+    if (fs->img->dirty_chunks == NULL)
+        return;
+    memset(fs->img->dirty_chunks, 0, (fs->img->dirty_chunk_count + 63) / 64 * sizeof(uint64_t));
+}
+
+void mark_dirty(struct extfs *fs, const void *addr, size_t len) {
+    size_t offset = (const char *) addr - (const char *) fs->img->fp;
+    size_t first = offset / DIRTY_CHUNK, last = (offset + len - 1) / DIRTY_CHUNK;
+    for (size_t i = first; i <= last; i++) {
+        fs->img->dirty_chunks[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+void mark_all_dirty(struct extfs *fs) {
+    memset(fs->img->dirty_chunks, 0xFF, (fs->img->dirty_chunk_count + 63) / 64 * sizeof(uint64_t));
+}
+
+void mark_inode_dirty(struct extfs *fs, uint32_t inode) {
+    mark_dirty(fs, get_inode(fs, inode), sizeof(struct inode));
+}
+
+// Leaves the blocks alone, so that unused ones are not read in.
+void mark_blocks_dirty(struct extfs *fs, uint32_t start, uint32_t len) {
+    mark_dirty(fs, (union data *) fs->img->fp + start, (size_t) len * BLOCK_SIZE);
+}
+
+void mark_block_dirty(struct extfs *fs, uint32_t block) {
+    mark_blocks_dirty(fs, block, 1);
+}
+
+void mark_inode_bitmap_dirty(struct extfs *fs, uint32_t inode) {
+    uint32_t i = inode % fs->img->fp->inodes_per_group;
+    mark_dirty(fs, &inode_bitmap(fs, inode_group(fs, inode))[i / 64], sizeof(uint64_t));
+}
+
+// Marks the words of the block bitmap covering a run of blocks in one group.
+void mark_block_bitmap_dirty(struct extfs *fs, uint32_t block, uint32_t len) {
+    uint32_t first = block % GROUP_BLOCKS, last = first + len - 1;
+    mark_dirty(fs, &block_bitmap(fs, block / GROUP_BLOCKS)[first / 64], (last / 64 - first / 64 + 1) * sizeof(uint64_t));
+}
+
+void mark_counters_dirty(struct extfs *fs, uint32_t group) {
+    mark_dirty(fs, &fs->img->fp->free_inodes, 4 * sizeof(uint32_t));
+    mark_dirty(fs, &fs->img->fp->groups[group], sizeof(struct group_desc));
+}
+
+// Finds the next maximal run of dirty chunks at or after *chunk, as byte
+// offsets into the image. Returns 0 when there is none left.
+int next_dirty_range(struct extfs *fs, size_t *chunk, size_t *offset, size_t *len) {
+    size_t i = *chunk;
+    while (i < fs->img->dirty_chunk_count && (fs->img->dirty_chunks[i / 64] & (1ULL << (i % 64))) == 0) {
+        if (i % 64 == 0 && fs->img->dirty_chunks[i / 64] == 0) {
+            i += 64;
+        } else {
+            i++;
+        }
+    }
+    if (i >= fs->img->dirty_chunk_count)
+        return 0;
+    size_t first = i;
+    while (i < fs->img->dirty_chunk_count && (fs->img->dirty_chunks[i / 64] & (1ULL << (i % 64))))
+        i++;
+    size_t end = i * DIRTY_CHUNK;
+    if (end > fs->img->image_size)
+        end = fs->img->image_size;
+    *chunk = i;
+    *offset = first * DIRTY_CHUNK;
+    *len = end - *offset;
+    return 1;
+}
+
+// Bitmaps
+int test_bit(const uint64_t *bitmap, uint32_t i) {
+    return (bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+void set_bit(uint64_t *bitmap, uint32_t i) {
+    bitmap[i / 64] |= 1ULL << (i % 64);
+}
+
+void clear_bit(uint64_t *bitmap, uint32_t i) {
+    bitmap[i / 64] &= ~(1ULL << (i % 64));
+}
+
+// Clears len bits starting at i, whole words at a time.
+void clear_bits(uint64_t *bitmap, uint32_t i, uint32_t len) {
+    uint32_t end = i + len;
+    while (i < end && i % 64 != 0) clear_bit(bitmap, i++);
+    for (; i + 64 <= end; i += 64) bitmap[i / 64] = 0;
+    while (i < end) clear_bit(bitmap, i++);
+}
+
+// Finds the first zero bit at or after hint, wrapping around at count.
+uint32_t find_zero_bit(const uint64_t *bitmap, uint32_t count, uint32_t hint) {
+    uint32_t words = count / 64;
+    uint32_t start = hint < count ? hint / 64 : 0;
+    // bits below the hint in its own word are looked at last
+    uint64_t word = ~bitmap[start] & (~0ULL << (hint < count ? hint % 64 : 0));
+    for (uint32_t n = 0; n <= words; n++) {
+        uint32_t w = (start + n) % words;
+        if (n > 0) {
+            word = ~bitmap[w];
+        }
+        if (word != 0)
+            return w * 64 + __builtin_ctzll(word);
+    }
+    return ERROR;
+}
+
+uint32_t count_zero_bits(const uint64_t *bitmap, uint32_t count) {
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < count / 64; w++) {
+        used += __builtin_popcountll(bitmap[w]);
+    }
+    return count - used;
+}
+
+// Counts the zero bits starting at start, up to max.
+uint32_t zero_run_length(const uint64_t *bitmap, uint32_t count, uint32_t start, uint32_t max) {
+    uint32_t run = 0;
+    while (run < max && start + run < count) {
+        uint32_t i = start + run;
+        uint64_t word = bitmap[i / 64] >> (i % 64);
+        if (word != 0) {
+            run += __builtin_ctzll(word);
+            break;
+        }
+        run += 64 - i % 64;
+    }
+    if (run > count - start)
+        run = count - start;
+    return run < max ? run : max;
+}
+
+// Finds a run of up to want zero bits and stores its length in *len. The
+// first long enough run at or after hint wins, otherwise the longest one.
+uint32_t find_zero_run(const uint64_t *bitmap, uint32_t count, uint32_t hint, uint32_t want,
+                       uint32_t *len) {
+    uint32_t best = ERROR, best_len = 0;
+    uint32_t pos = hint < count ? hint : 0, scanned = 0;
+    while (scanned < count) {
+        uint32_t start = find_zero_bit(bitmap, count, pos);
+        if (start == ERROR)
+            break;
+        scanned += (start + count - pos) % count;
+        if (scanned >= count)
+            break;
+        uint32_t run = zero_run_length(bitmap, count, start, want);
+        if (run > best_len) {
+            best = start;
+            best_len = run;
+        }
+        if (run == want)
+            break;
+        scanned += run;
+        pos = (start + run) % count;
+    }
+    *len = best_len;
+    return best;
+}
+
+// Whether block is a data block nobody uses, so that its contents need not
+// be saved.
+int block_unused(struct extfs *fs, uint32_t block) {
+    return block < fs->img->fp->blocks_count && !test_bit(block_bitmap(fs, block / GROUP_BLOCKS), block % GROUP_BLOCKS);
+}
+
+// Like next_dirty_range, but cuts ranges where blocks start or stop being
+// used and sets *hole for a range of unused ones. Chunks are blocks.
+int next_save_range(struct extfs *fs, size_t *chunk, size_t *offset, size_t *len, int *hole) {
+    if (!next_dirty_range(fs, chunk, offset, len))
+        return 0;
+    uint32_t first = *offset / BLOCK_SIZE, n = (*len + BLOCK_SIZE - 1) / BLOCK_SIZE, i = 1;
+    *hole = block_unused(fs, first);
+    while (i < n && block_unused(fs, first + i) == *hole) i++;
+    if (i < n) {
+        // the rest is still dirty, the next call picks it up
+        *chunk = first + i;
+        *len = (size_t) i * BLOCK_SIZE;
+    }
+    return 1;
+}
+
+// Dir records
+
+// Bytes taken by the record of a name of len bytes.
+uint32_t record_size(uint32_t len) {
+    return (offsetof(struct entry, name) + len + 1 + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+struct entry *chain_entry(struct extfs *fs, uint32_t chain, int slot) {
+    return (struct entry *) (get_block(fs, get_inode(fs, chain)->blocks[0])->data + slot * RECORD_ALIGN);
+}
+
+// The slot of the first used record of chain after slot, or from the start
+// if slot is -1. Returns -1 past the last one.
+int next_record(struct extfs *fs, uint32_t chain, int slot) {
+    char *data = get_block(fs, get_inode(fs, chain)->blocks[0])->data;
+    uint32_t off = slot < 0 ? 0 : slot * RECORD_ALIGN + ((struct entry *) (data + slot * RECORD_ALIGN))->rec_len;
+    while (off < BLOCK_SIZE) {
+        struct entry *e = (struct entry *) (data + off);
+        if (e->type != 0)
+            return off / RECORD_ALIGN;
+        off += e->rec_len;
+    }
+    return -1;
+}
+
+// Recomputes the largest record that fits in the block of chain.
+void update_max_free(struct extfs *fs, uint32_t chain) {
+    char *data = get_block(fs, get_inode(fs, chain)->blocks[0])->data;
+    uint32_t best = 0;
+    for (uint32_t off = 0; off < BLOCK_SIZE;) {
+        struct entry *e = (struct entry *) (data + off);
+        uint32_t slack = e->rec_len - (e->type == 0 ? 0 : record_size(e->name_len));
+        if (slack > best) {
+            best = slack;
+        }
+        off += e->rec_len;
+    }
+    get_inode(fs, chain)->max_free = best;
+    mark_inode_dirty(fs, chain);
+}
+
+// Empties the block of a dir or cont inode.
+void init_records(struct extfs *fs, uint32_t chain) {
+    struct entry *e = chain_entry(fs, chain, 0);
+    e->rec_len = BLOCK_SIZE;
+    e->type = 0;
+    mark_dirty(fs, e, sizeof(struct entry));
+    get_inode(fs, chain)->entry_count = 0;
+    get_inode(fs, chain)->free_bytes = BLOCK_SIZE;
+    get_inode(fs, chain)->max_free = BLOCK_SIZE;
+    mark_inode_dirty(fs, chain);
+}
+
+// Utility
+uint32_t checksum(uint32_t hash, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// CRC32C of blocks, with the CRC instructions of the CPU where it has them
+// and slicing-by-8 where it does not. The implementation is picked on first use.
+uint32_t crc32c_table[8][256];
+uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t len);
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+    }
+    for (; len > 0; p++, len--) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; len > 0; p++, len--) {
+        c = _mm_crc32_u8((uint32_t) c, *p);
+    }
+    return (uint32_t) c;
+}
+#elif defined(__aarch64__)
+__attribute__((target("arch=armv8-a+crc")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; len > 0; p++, len--) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+        }
+    }
+    crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_hw;
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_update = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, (const uint8_t *) data, len);
+}
+
+// Block checksums
+//
+// Every group long enough keeps the CRC32C of each of its blocks in a run of
+// SUM_BLOCKS blocks of its own. Entries of unused blocks and of the run
+// itself are 0, and a 0 entry is never checked. Saves bring the entries of
+// the dirty blocks up to date, so entries only ever describe what was saved.
+// Blocks are checked as they are read: all at once when the image is read,
+// or on first touch when it is a lazily read pack.
+
+// Whether block holds checksums, in the image starting with sb.
+int sum_block(const struct super_block *sb, uint32_t block) {
+    uint32_t sums = sb->groups[block / GROUP_BLOCKS].sums;
+    return sums != 0 && block >= sums && block < sums + SUM_BLOCKS;
+}
+
+// The checksum kept for block in the image starting with sb, 0 if there is
+// none. Checksum blocks are always in memory.
+uint32_t stored_sum(const struct super_block *sb, uint32_t block) {
+    uint32_t sums = sb->groups[block / GROUP_BLOCKS].sums;
+    return sums == 0 ? 0 : ((const uint32_t *) ((const union data *) sb + sums))[block % GROUP_BLOCKS];
+}
+
+uint32_t *group_sums(struct extfs *fs, uint32_t group) {
+    return (uint32_t *) get_blocks(fs, fs->img->fp->groups[group].sums, SUM_BLOCKS);
+}
+
+uint32_t block_sum(struct extfs *fs, uint32_t block) {
+    return crc32c(0, get_block(fs, block), BLOCK_SIZE);
+}
+
+int block_unused(struct extfs *fs, uint32_t block);
+
+// Computes every checksum of a group from scratch.
+void fill_sums(struct extfs *fs, uint32_t group) {
+    if (fs->img->fp->groups[group].sums == 0)
+        return;
+    uint32_t *sums = group_sums(fs, group), len = group_length(fs, group);
+    for (uint32_t i = 0; i < GROUP_BLOCKS; i++) {
+        uint32_t b = group * GROUP_BLOCKS + i;
+        sums[i] = i < len && !block_unused(fs, b) && !sum_block(fs->img->fp, b) ? block_sum(fs, b) : 0;
+    }
+    mark_blocks_dirty(fs, fs->img->fp->groups[group].sums, SUM_BLOCKS);
+}
+
+// Brings the checksums of the dirty blocks up to date before they are saved.
+// Entries that change mark their block dirty in turn.
+void update_sums(struct extfs *fs) {
+    struct image *img = fs->img;
+    size_t chunk = 0, offset, len;
+    while (next_dirty_range(fs, &chunk, &offset, &len)) {
+        uint32_t end = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (uint32_t b = offset / BLOCK_SIZE; b < end; b++) {
+            uint32_t g = b / GROUP_BLOCKS, sum = 0;
+            if (img->fp->groups[g].sums == 0 || sum_block(img->fp, b))
+                continue;
+            if (!block_unused(fs, b)) {
+                // a block freed and never touched since is not read in
+                if (img->lazy && !(__atomic_load_n(&img->loaded[b / 64], __ATOMIC_ACQUIRE) & (1ULL << (b % 64))))
+                    continue;
+                sum = block_sum(fs, b);
+            }
+            uint32_t *entry = group_sums(fs, g) + b % GROUP_BLOCKS;
+            if (*entry != sum) {
+                *entry = sum;
+                mark_dirty(fs, entry, sizeof(uint32_t));
+            }
+        }
+    }
+}
+
+// Checks the blocks in memory against their checksums and counts the bad
+// ones for statfs. Blocks of a lazily read pack are checked by cache_fault
+// instead.
+void verify_sums(struct extfs *fs) {
+    struct image *img = fs->img;
+    for (uint32_t b = 0; b < img->fp->blocks_count; b++) {
+        uint32_t sum = stored_sum(img->fp, b);
+        if (sum == 0 || (img->lazy && !test_bit(img->loaded, b)))
+            continue;
+        if (block_sum(fs, b) != sum) {
+            img->bad_blocks++;
+        }
+    }
+}
+
+// Allocates a run of up to want contiguous blocks, preferably in group, and
+// stores its length in *len. Runs never cross groups. Returns ERROR if no
+// block is left.
+uint32_t allocate_blocks(struct extfs *fs, uint32_t want, uint32_t group, uint32_t *len) {
+    uint32_t best = ERROR, best_len = 0;
+    for (uint32_t n = 0; n < fs->img->fp->group_count && best_len < want; n++) {
+        uint32_t g = (group + n) % fs->img->fp->group_count, run;
+        if (fs->img->fp->groups[g].free_blocks == 0)
+            continue;
+        uint32_t hint = fs->img->fp->block_hint / GROUP_BLOCKS == g ? fs->img->fp->block_hint % GROUP_BLOCKS : 0;
+        uint32_t start = find_zero_run(block_bitmap(fs, g), GROUP_BLOCKS, hint, want, &run);
+        if (start != ERROR && run > best_len) {
+            best = g * GROUP_BLOCKS + start;
+            best_len = run;
+        }
+    }
+    if (best == ERROR)
+        return ERROR;
+    uint32_t g = best / GROUP_BLOCKS;
+    uint64_t *bitmap = block_bitmap(fs, g);
+    for (uint32_t i = best % GROUP_BLOCKS; i < best % GROUP_BLOCKS + best_len; i++) {
+        set_bit(bitmap, i);
+    }
+    if (fs->img->refs != NULL) {
+        memset(fs->img->refs + best, 1, best_len);
+    }
+    fs->img->fp->free_blocks -= best_len;
+    fs->img->fp->groups[g].free_blocks -= best_len;
+    fs->img->fp->block_hint = (best + best_len) % fs->img->fp->blocks_count;
+    mark_block_bitmap_dirty(fs, best, best_len);
+    mark_counters_dirty(fs, g);
+    if (fs->img->lazy) {
+        // whatever the pack holds for them is stale
+        cache_mark_loaded(fs, best, best_len);
+    }
+    *len = best_len;
+    return best;
+}
+
+void release_blocks(struct extfs *fs, uint32_t start, uint32_t len) {
+    uint32_t g = start / GROUP_BLOCKS;
+    clear_bits(block_bitmap(fs, g), start % GROUP_BLOCKS, len);
+    fs->img->fp->free_blocks += len;
+    fs->img->fp->groups[g].free_blocks += len;
+    mark_block_bitmap_dirty(fs, start, len);
+    mark_counters_dirty(fs, g);
+    // so that the next save punches a hole for them
+    mark_blocks_dirty(fs, start, len);
+}
+
+// Drops a reference to the blocks, freeing those no snapshot holds.
+void free_blocks(struct extfs *fs, uint32_t start, uint32_t len) {
+    if (fs->img->refs == NULL) {
+        release_blocks(fs, start, len);
+        return;
+    }
+    uint32_t run = start;
+    for (uint32_t b = start; b <= start + len; b++) {
+        if (b < start + len && --fs->img->refs[b] == 0)
+            continue;
+        if (b > run) {
+            release_blocks(fs, run, b - run);
+        }
+        run = b + 1;
+    }
+}
+
+void free_extents(struct extfs *fs, uint32_t inode);
+
+// Picks the group for a new dir: the one with the most free blocks among
+// those with at least the average number of free inodes, so that subtrees
+// spread over the disk while their files stay next to them.
+uint32_t dir_group(struct extfs *fs, uint32_t parent) {
+    uint32_t best = ERROR, average = fs->img->fp->free_inodes / fs->img->fp->group_count;
+    for (uint32_t g = 0; g < fs->img->fp->group_count; g++) {
+        struct group_desc *gd = &fs->img->fp->groups[g];
+        if (gd->free_inodes > 0 && gd->free_inodes >= average &&
+            (best == ERROR || gd->free_blocks > fs->img->fp->groups[best].free_blocks)) {
+            best = g;
+        }
+    }
+    return best == ERROR ? inode_group(fs, parent) : best;
+}
+
+// Allocates an inode, preferably in group. Every inode but a file gets one
+// block right away. File data is allocated separately, in extents.
+uint32_t allocate_inode(struct extfs *fs, uint32_t mode, uint32_t group) {
+    if (fs->img->fp->free_inodes == 0) {
+        return fail(fs, EXTFS_NO_INODE);
+    }
+    if (mode != (uint32_t)MODE_FILE && fs->img->fp->free_blocks == 0) {
+        return fail(fs, EXTFS_NO_BLOCK);
+    }
+    uint32_t g = group;
+    while (fs->img->fp->groups[g].free_inodes == 0) {
+        g = (g + 1) % fs->img->fp->group_count;
+        STAT_ADD(fs, inode_groups_skipped, 1);
+    }
+    uint32_t hint = inode_group(fs, fs->img->fp->inode_hint) == g ? fs->img->fp->inode_hint % fs->img->fp->inodes_per_group : 0;
+    uint32_t i = find_zero_bit(inode_bitmap(fs, g), fs->img->fp->inodes_per_group, hint);
+    STAT_ADD(fs, inode_allocs, 1);
+    STAT_ADD(fs, inode_scan_bits, (i + fs->img->fp->inodes_per_group - hint) % fs->img->fp->inodes_per_group);
+    set_bit(inode_bitmap(fs, g), i);
+    i += g * fs->img->fp->inodes_per_group;
+    fs->img->fp->free_inodes--;
+    fs->img->fp->groups[g].free_inodes--;
+    fs->img->fp->inode_hint = (i + 1) % fs->img->fp->inodes_count;
+    mark_inode_bitmap_dirty(fs, i);
+    mark_counters_dirty(fs, g);
+
+    memset(get_inode(fs, i), 0, sizeof(struct inode));
+    get_inode(fs, i)->mode = mode;
+    if (mode != (uint32_t)MODE_FILE) {
+        uint32_t len;
+        get_inode(fs, i)->blocks[0] = allocate_blocks(fs, 1, g, &len);
+        get_inode(fs, i)->next_inode = INVALID_INODE;
+    }
+    if (mode == (uint32_t)MODE_DIR || mode == (uint32_t)MODE_CONT) {
+        init_records(fs, i);
+    }
+    mark_inode_dirty(fs, i);
+    return i;
+}
+
+void free_inode(struct extfs *fs, uint32_t inode) {
+    if (get_inode(fs, inode)->mode == MODE_FILE) {
+        free_extents(fs, inode);
+    } else {
+        free_blocks(fs, get_inode(fs, inode)->blocks[0], 1);
+    }
+    uint32_t g = inode_group(fs, inode);
+    clear_bit(inode_bitmap(fs, g), inode % fs->img->fp->inodes_per_group);
+    fs->img->fp->free_inodes++;
+    fs->img->fp->groups[g].free_inodes++;
+    mark_inode_bitmap_dirty(fs, inode);
+    mark_counters_dirty(fs, g);
+    fs->img->dcache_gen[inode]++;
+}
+
+// File extents
+//
+// The first INLINE_EXTENTS extents of a file live in its inode, the others in
+// its extent block. Blocks are handed out in runs as long as the free space
+// allows, so most files end up with a single extent.
+//
+// Files of at most INLINE_DATA_SIZE bytes take no extents. The INLINE_PER_BLOCK
+// inodes of an aligned run share one inline block, each with a slot of that
+// size, which goes when the last of their small files does.
+
+// The inline block of the small files next to inode, or a new one. ERROR if
+// there are no blocks left.
+uint32_t inline_block(struct extfs *fs, uint32_t inode) {
+    uint32_t base = inode / INLINE_PER_BLOCK * INLINE_PER_BLOCK, len;
+    for (uint32_t i = base; i < base + INLINE_PER_BLOCK; i++) {
+        if (i != inode && inode_used(fs, i) && get_inode(fs, i)->mode == MODE_FILE &&
+            (get_inode(fs, i)->file_flags & FILE_INLINE))
+            return get_inode(fs, i)->inline_block;
+    }
+    return allocate_blocks(fs, 1, inode_group(fs, inode), &len);
+}
+
+// Gives the small files next to inode a copy of their inline block if a
+// snapshot shares it, before another file is written into it. Returns the
+// block they use now, ERROR if there is no block for the copy.
+uint32_t own_inline(struct extfs *fs, uint32_t inode, uint32_t block) {
+    if (fs->img->refs == NULL || fs->img->refs[block] <= 1)
+        return block;
+    uint32_t base = inode / INLINE_PER_BLOCK * INLINE_PER_BLOCK, len;
+    uint32_t copy = allocate_blocks(fs, 1, inode_group(fs, inode), &len);
+    if (copy == ERROR)
+        return ERROR;
+    memcpy(get_block(fs, copy), get_block(fs, block), BLOCK_SIZE);
+    mark_block_dirty(fs, copy);
+    for (uint32_t i = base; i < base + INLINE_PER_BLOCK; i++) {
+        if (i != inode && inode_used(fs, i) && get_inode(fs, i)->mode == MODE_FILE &&
+            (get_inode(fs, i)->file_flags & FILE_INLINE)) {
+            // files in other dirs may be read meanwhile, from either copy
+            STORE(get_inode(fs, i)->inline_block, copy);
+            mark_inode_dirty(fs, i);
+        }
+    }
+    free_blocks(fs, block, 1);
+    return copy;
+}
+
+// Takes a small file out of its inline block. Returns the block if no other
+// file uses it any more, so that the caller frees it, 0 otherwise.
+uint32_t release_inline(struct extfs *fs, uint32_t inode) {
+    struct inode *node = get_inode(fs, inode);
+    uint32_t block = node->inline_block, base = inode / INLINE_PER_BLOCK * INLINE_PER_BLOCK;
+    node->file_flags &= ~FILE_INLINE;
+    node->inline_block = 0;
+    mark_inode_dirty(fs, inode);
+    for (uint32_t i = base; i < base + INLINE_PER_BLOCK; i++) {
+        if (inode_used(fs, i) && get_inode(fs, i)->mode == MODE_FILE && (get_inode(fs, i)->file_flags & FILE_INLINE))
+            return 0;
+    }
+    return block;
+}
+
+char *inline_data(struct extfs *fs, uint32_t inode) {
+    return get_block(fs, LOAD(get_inode(fs, inode)->inline_block))->data + inode % INLINE_PER_BLOCK * INLINE_DATA_SIZE;
+}
+
+struct extent *file_extent(struct extfs *fs, uint32_t inode, uint32_t k) {
+    if (k < INLINE_EXTENTS)
+        return &get_inode(fs, inode)->extents[k];
+    return &get_block(fs, get_inode(fs, inode)->extent_block)->extents[k - INLINE_EXTENTS];
+}
+
+void free_extents(struct extfs *fs, uint32_t inode) {
+    struct inode *node = get_inode(fs, inode);
+    if (node->file_flags & FILE_INLINE) {
+        uint32_t block = release_inline(fs, inode);
+        if (block != 0) {
+            free_blocks(fs, block, 1);
+        }
+    }
+    for (uint32_t k = 0; k < node->extent_count; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        free_blocks(fs, e->start, e->len);
+    }
+    if (node->extent_block != 0) {
+        free_blocks(fs, node->extent_block, 1);
+    }
+    node->extent_count = 0;
+    node->extent_block = 0;
+    node->file_size = 0;
+    mark_inode_dirty(fs, inode);
+}
+
+// Gives an empty file enough blocks for size bytes. On failure the file is
+// left without any.
+uint32_t file_allocate(struct extfs *fs, uint32_t inode, uint32_t size) {
+    struct inode *node = get_inode(fs, inode);
+    uint32_t want = (size + BLOCK_SIZE - 1) / BLOCK_SIZE, len;
+    if (size > 0 && size <= INLINE_DATA_SIZE) {
+        uint32_t block = inline_block(fs, inode);
+        if (block != ERROR) {
+            block = own_inline(fs, inode, block);
+        }
+        if (block == ERROR)
+            return fail(fs, EXTFS_NO_BLOCK);
+        node->file_flags = FILE_INLINE;
+        node->inline_block = block;
+        node->file_size = size;
+        mark_inode_dirty(fs, inode);
+        return 0;
+    }
+    if (want > fs->img->fp->free_blocks) {
+        return fail(fs, EXTFS_NO_BLOCK);
+    }
+    while (want > 0) {
+        if (node->extent_count == INLINE_EXTENTS && node->extent_block == 0) {
+            node->extent_block = allocate_blocks(fs, 1, inode_group(fs, inode), &len);
+        }
+        if (node->extent_count == MAX_EXTENTS || node->extent_block == ERROR) {
+            node->extent_block = 0;
+            free_extents(fs, inode);
+            return fail(fs, EXTFS_NO_CONTIGUOUS);
+        }
+        uint32_t start = allocate_blocks(fs, want, inode_group(fs, inode), &len);
+        if (start == ERROR) {
+            free_extents(fs, inode);
+            return fail(fs, EXTFS_NO_BLOCK);
+        }
+        struct extent *e = node->extent_count > 0 ? file_extent(fs, inode, node->extent_count - 1) : NULL;
+        if (e == NULL || e->start + e->len != start) {
+            e = file_extent(fs, inode, node->extent_count++);
+            e->start = start;
+            e->len = 0;
+        }
+        e->len += len;
+        mark_dirty(fs, e, sizeof(struct extent));
+        want -= len;
+    }
+    node->file_size = size;
+    mark_inode_dirty(fs, inode);
+    return 0;
+}
+
+void file_write(struct extfs *fs, uint32_t inode, const char *data, uint32_t len) {
+    if (get_inode(fs, inode)->file_flags & FILE_INLINE) {
+        char *p = inline_data(fs, inode);
+        memcpy(p, data, len);
+        mark_dirty(fs, p, len);
+        return;
+    }
+    uint32_t pos = 0;
+    for (uint32_t k = 0; pos < len; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        // the blocks of an extent are adjacent in the image as well
+        uint32_t n = e->len * BLOCK_SIZE < len - pos ? e->len * BLOCK_SIZE : len - pos;
+        char *p = get_blocks(fs, e->start, (n + BLOCK_SIZE - 1) / BLOCK_SIZE)->data;
+        memcpy(p, data + pos, n);
+        mark_dirty(fs, p, n);
+        pos += n;
+    }
+}
+
+// Hands the contents of a file to fn straight from its blocks, one extent at
+// a time.
+void file_read(struct extfs *fs, uint32_t inode, extfs_data_fn fn, void *arg) {
+    uint32_t left = get_inode(fs, inode)->file_size;
+    if (get_inode(fs, inode)->file_flags & FILE_INLINE) {
+        fn(arg, inline_data(fs, inode), left);
+        return;
+    }
+    for (uint32_t k = 0; left > 0; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        uint32_t n = e->len * BLOCK_SIZE < left ? e->len * BLOCK_SIZE : left;
+        fn(arg, get_blocks(fs, e->start, (n + BLOCK_SIZE - 1) / BLOCK_SIZE)->data, n);
+        left -= n;
+    }
+}
+
+// Hashed directory index
+//
+// Once the entry chain of a directory grows past INDEX_MIN_CHAIN inodes, it
+// gets an open addressing hash table from name hash to (chain inode, slot),
+// spread over MODE_INDEX inodes. The chain itself stays authoritative, so a
+// directory without index_inode is simply searched linearly.
+
+uint32_t name_hash(const char *name) {
+    return checksum(CHECKSUM_SEED, name, strlen(name));
+}
+
+struct index_header *index_header(struct extfs *fs, uint32_t dir) {
+    return (struct index_header *) get_block(fs, get_inode(fs, get_inode(fs, dir)->index_inode)->blocks[0])->data;
+}
+
+uint32_t index_size(struct index_header *h) {
+    return h->blocks * INDEX_ENTRIES_PER_BLOCK - INDEX_HEADER_ENTRIES;
+}
+
+struct index_entry *index_slot(struct extfs *fs, struct index_header *h, uint32_t k) {
+    k += INDEX_HEADER_ENTRIES;
+    uint32_t block = get_inode(fs, h->inodes[k / INDEX_ENTRIES_PER_BLOCK])->blocks[0];
+    return &get_block(fs, block)->index[k % INDEX_ENTRIES_PER_BLOCK];
+}
+
+void free_index(struct extfs *fs, uint32_t dir) {
+    if (get_inode(fs, dir)->index_inode == 0)
+        return;
+    struct index_header *h = index_header(fs, dir);
+    for (int i = h->blocks - 1; i >= 0; i--) {
+        free_inode(fs, h->inodes[i]);
+    }
+    get_inode(fs, dir)->index_inode = 0;
+    mark_inode_dirty(fs, dir);
+}
+
+// Puts an entry into the table without any resizing.
+void index_put(struct extfs *fs, struct index_header *h, uint32_t hash, uint32_t chain, int slot) {
+    uint32_t size = index_size(h);
+    for (uint32_t k = hash % size;; k = (k + 1) % size) {
+        struct index_entry *e = index_slot(fs, h, k);
+        if (e->state != INDEX_LIVE) {
+            if (e->state == INDEX_EMPTY) {
+                h->used++;
+            }
+            h->live++;
+            e->hash = hash;
+            e->chain = chain;
+            e->slot = slot;
+            e->state = INDEX_LIVE;
+            mark_dirty(fs, e, sizeof(struct index_entry));
+            mark_dirty(fs, h, sizeof(struct index_header));
+            return;
+        }
+    }
+}
+
+// (Re)builds the index of dir with at least the given number of blocks, more
+// if its entries need them. Leaves dir unindexed if there is no room for it.
+void build_index(struct extfs *fs, uint32_t dir, uint32_t blocks) {
+    free_index(fs, dir);
+    uint32_t entries = 0;
+    for (uint32_t temp_inode = dir; temp_inode != INVALID_INODE; temp_inode = get_inode(fs, temp_inode)->next_inode) {
+        entries += get_inode(fs, temp_inode)->entry_count;
+    }
+    while (blocks <= MAX_INDEX_BLOCKS && entries * 4 > (blocks * INDEX_ENTRIES_PER_BLOCK - INDEX_HEADER_ENTRIES) * 3) {
+        blocks *= 2;
+    }
+    if (blocks > MAX_INDEX_BLOCKS || fs->img->fp->free_inodes < blocks || fs->img->fp->free_blocks < blocks)
+        return;
+    uint16_t inodes[MAX_INDEX_BLOCKS];
+    for (uint32_t i = 0; i < blocks; i++) {
+        inodes[i] = allocate_inode(fs, MODE_INDEX, inode_group(fs, dir));
+        uint32_t block = get_inode(fs, inodes[i])->blocks[0];
+        memset(get_block(fs, block), 0, sizeof(union data));
+        mark_block_dirty(fs, block);
+    }
+    get_inode(fs, dir)->index_inode = inodes[0];
+    mark_inode_dirty(fs, dir);
+
+    struct index_header *h = index_header(fs, dir);
+    h->blocks = blocks;
+    memcpy(h->inodes, inodes, sizeof(inodes));
+    uint32_t temp_inode = dir;
+    do {
+        for (int i = next_record(fs, temp_inode, -1); i >= 0; i = next_record(fs, temp_inode, i)) {
+            index_put(fs, h, name_hash(chain_entry(fs, temp_inode, i)->name), temp_inode, i);
+        }
+        if (get_inode(fs, temp_inode)->max_free > h->room) {
+            h->room = get_inode(fs, temp_inode)->max_free;
+        }
+        h->tail = temp_inode;
+        temp_inode = get_inode(fs, temp_inode)->next_inode;
+    } while (temp_inode != INVALID_INODE);
+    mark_dirty(fs, h, sizeof(struct index_header));
+}
+
+uint32_t index_lookup(struct extfs *fs, uint32_t dir, const char *name, uint32_t *chain, int *slot) {
+    struct index_header *h = index_header(fs, dir);
+    uint32_t size = index_size(h), hash = name_hash(name);
+    for (uint32_t k = hash % size, n = 0; n < size; k = (k + 1) % size, n++) {
+        struct index_entry *e = index_slot(fs, h, k);
+        if (e->state == INDEX_EMPTY)
+            break;
+        if (e->state == INDEX_LIVE && e->hash == hash) {
+            struct entry *entry = chain_entry(fs, e->chain, e->slot);
+            STAT_ADD(fs, name_compares, 1);
+            if (strcmp(name, entry->name) == 0) {
+                if (chain != NULL) {
+                    *chain = e->chain;
+                    *slot = e->slot;
+                }
+                return entry->id;
+            }
+        }
+    }
+    return ERROR;
+}
+
+void index_add(struct extfs *fs, uint32_t dir, uint32_t chain, int slot) {
+    struct index_header *h = index_header(fs, dir);
+    if ((h->used + 1u) * 4 > index_size(h) * 3) {
+        // grow, unless dropping deleted slots makes enough room
+        build_index(fs, dir, h->live * 2 < h->used ? h->blocks : h->blocks * 2);
+        return;
+    }
+    index_put(fs, h, name_hash(chain_entry(fs, chain, slot)->name), chain, slot);
+}
+
+void index_remove(struct extfs *fs, uint32_t dir, uint32_t chain, int slot) {
+    struct index_header *h = index_header(fs, dir);
+    uint32_t size = index_size(h), hash = name_hash(chain_entry(fs, chain, slot)->name);
+    for (uint32_t k = hash % size, n = 0; n < size; k = (k + 1) % size, n++) {
+        struct index_entry *e = index_slot(fs, h, k);
+        if (e->state == INDEX_EMPTY)
+            return;
+        if (e->state == INDEX_LIVE && e->chain == chain && e->slot == slot) {
+            e->state = INDEX_DELETED;
+            h->live--;
+            mark_dirty(fs, e, sizeof(struct index_entry));
+            mark_dirty(fs, h, sizeof(struct index_header));
+            return;
+        }
+    }
+}
+
+// Dentry cache
+
+struct dentry *dcache_slot(struct extfs *fs, uint32_t parent, uint32_t hash) {
+    return &fs->img->dcache[(hash ^ (parent * 2654435761u)) % DCACHE_SIZE];
+}
+
+int dcache_match(struct extfs *fs, struct dentry *d, uint32_t parent, uint32_t hash, const char *name) {
+    if (LOAD(d->epoch) != fs->img->dcache_epoch || LOAD(d->parent) != parent || LOAD(d->hash) != hash ||
+        LOAD(d->parent_gen) != fs->img->dcache_gen[parent])
+        return 0;
+    for (size_t i = 0; ; i++) {
+        char c = LOAD(d->name[i]);
+        if (c != name[i])
+            return 0;
+        if (c == '\0')
+            return 1;
+    }
+}
+
+// Lookups in different dirs share slots, so each slot is written under one
+// of the dcache locks.
+pthread_mutex_t *dcache_lock(struct extfs *fs, struct dentry *d) {
+    return &fs->img->dcache_locks[(d - fs->img->dcache) % DCACHE_LOCKS];
+}
+
+void dcache_write_begin(struct extfs *fs, struct dentry *d) {
+    pthread_mutex_lock(dcache_lock(fs, d));
+    STORE(d->seq, d->seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void dcache_write_end(struct extfs *fs, struct dentry *d) {
+    __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(dcache_lock(fs, d));
+}
+
+// Bumps a counter of the calling handle, which extfs_dcache_stats may read
+// meanwhile.
+void count(uint64_t *counter) {
+    STORE(*counter, LOAD(*counter) + 1);
+}
+
+// Returns 1 and sets *child on a hit (possibly to ERROR), 0 on a miss. Sets
+// *child_dir too unless it is NULL.
+int dcache_lookup(struct extfs *fs, uint32_t parent, const char *name, uint32_t hash, uint32_t *child,
+                  int *child_dir) {
+    struct dentry *d = dcache_slot(fs, parent, hash);
+    uint32_t seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+    int hit = (seq & 1) == 0 && dcache_match(fs, d, parent, hash, name);
+    uint32_t found = LOAD(d->child), found_dir = LOAD(d->child_dir);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (LOAD(d->seq) != seq) {
+        hit = 0;
+    }
+    if (!hit) {
+        count(&fs->dcache_misses);
+        return 0;
+    }
+    count(found == ERROR ? &fs->dcache_negative_hits : &fs->dcache_hits);
+    *child = found;
+    if (child_dir != NULL) {
+        *child_dir = (int) found_dir;
+    }
+    return 1;
+}
+
+// Caches the result of a search of parent, which the caller holds locked.
+void dcache_insert(struct extfs *fs, uint32_t parent, const char *name, uint32_t hash, uint32_t child) {
+    struct dentry *d = dcache_slot(fs, parent, hash);
+    dcache_write_begin(fs, d);
+    STORE(d->parent, parent);
+    STORE(d->parent_gen, fs->img->dcache_gen[parent]);
+    STORE(d->epoch, fs->img->dcache_epoch);
+    STORE(d->child, child);
+    STORE(d->child_dir, child != ERROR && get_inode(fs, child)->mode == MODE_DIR);
+    STORE(d->hash, hash);
+    for (size_t i = 0; i == 0 || name[i - 1] != '\0'; i++) {
+        STORE(d->name[i], name[i]);
+    }
+    dcache_write_end(fs, d);
+}
+
+void dcache_invalidate(struct extfs *fs, uint32_t parent, const char *name) {
+    uint32_t hash = name_hash(name);
+    struct dentry *d = dcache_slot(fs, parent, hash);
+    dcache_write_begin(fs, d);
+    if (dcache_match(fs, d, parent, hash, name)) {
+        STORE(d->epoch, 0);
+        count(&fs->dcache_invalidations);
+    }
+    dcache_write_end(fs, d);
+}
+
+void dcache_clear(struct extfs *fs) {
+    fs->img->dcache_epoch++;
+}
+
+void drop_subtrees(struct extfs *fs) {
+    STORE(fs->img->subtrees_valid, 0);
+}
+
+// Directory entries
+
+// Finds name in the entry chain of dir, bypassing the dentry cache.
+uint32_t dir_search(struct extfs *fs, uint32_t dir, const char *name, uint32_t *chain, int *slot) {
+    if (get_inode(fs, dir)->index_inode != 0)
+        return index_lookup(fs, dir, name, chain, slot);
+    uint32_t temp_inode = dir;
+    size_t len = strlen(name);
+    STAT_ADD(fs, dir_scans, 1);
+    do {
+        for (int i = next_record(fs, temp_inode, -1); i >= 0; i = next_record(fs, temp_inode, i)) {
+            struct entry *e = chain_entry(fs, temp_inode, i);
+            STAT_ADD(fs, records_scanned, 1);
+            if (e->name_len == len && (STAT_ADD(fs, name_compares, 1), memcmp(name, e->name, len) == 0)) {
+                if (chain != NULL) {
+                    *chain = temp_inode;
+                    *slot = i;
+                }
+                return e->id;
+            }
+        }
+        temp_inode = get_inode(fs, temp_inode)->next_inode;
+        STAT_ADD(fs, chain_links, temp_inode != INVALID_INODE);
+    } while (temp_inode != INVALID_INODE);
+    return ERROR;
+}
+
+// Finds name in the entry chain of dir. Returns the inode it refers to and,
+// when chain/slot are given, where the entry lives; ERROR if absent.
+uint32_t dir_lookup(struct extfs *fs, uint32_t dir, const char *name, uint32_t *chain, int *slot) {
+    if (chain == NULL) {
+        // only the target is wanted, which the dentry cache can answer
+        uint32_t hash = name_hash(name), child;
+        if (dcache_lookup(fs, dir, name, hash, &child, NULL))
+            return child;
+        child = dir_search(fs, dir, name, NULL, NULL);
+        dcache_insert(fs, dir, name, hash, child);
+        return child;
+    }
+    return dir_search(fs, dir, name, chain, slot);
+}
+
+// Gives a chain or index inode a copy of its block if a snapshot shares it.
+// The caller made sure there is a free block.
+void own_block(struct extfs *fs, uint32_t inode) {
+    uint32_t old = get_inode(fs, inode)->blocks[0], len;
+    if (fs->img->refs[old] <= 1)
+        return;
+    uint32_t block = allocate_blocks(fs, 1, inode_group(fs, inode), &len);
+    memcpy(get_block(fs, block), get_block(fs, old), BLOCK_SIZE);
+    mark_block_dirty(fs, block);
+    free_blocks(fs, old, 1);
+    get_inode(fs, inode)->blocks[0] = block;
+    mark_inode_dirty(fs, inode);
+}
+
+// Copies the chain and index blocks dir still shares with a snapshot, before
+// they are changed in place. Returns ERROR if there are not enough free
+// blocks for the copies, leaving dir alone.
+uint32_t own_dir(struct extfs *fs, uint32_t dir) {
+    if (fs->img->refs == NULL)
+        return 0;
+    uint16_t index[MAX_INDEX_BLOCKS];
+    uint32_t index_blocks = 0, shared = 0;
+    if (get_inode(fs, dir)->index_inode != 0) {
+        struct index_header *h = index_header(fs, dir);
+        index_blocks = h->blocks;
+        memcpy(index, h->inodes, sizeof(index));
+    }
+    for (uint32_t i = 0; i < index_blocks; i++) {
+        shared += fs->img->refs[get_inode(fs, index[i])->blocks[0]] > 1;
+    }
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        shared += fs->img->refs[get_inode(fs, chain)->blocks[0]] > 1;
+    }
+    if (shared == 0)
+        return 0;
+    if (shared > fs->img->fp->free_blocks)
+        return fail(fs, EXTFS_NO_BLOCK);
+    for (uint32_t i = 0; i < index_blocks; i++) {
+        own_block(fs, index[i]);
+    }
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        own_block(fs, chain);
+    }
+    return 0;
+}
+
+// Finds room for a record of size bytes in the block of chain, splitting it
+// off the slack of a used record if needed. Returns its slot, -1 if the
+// block has no room for it.
+int make_room(struct extfs *fs, uint32_t chain, uint32_t size) {
+    if (get_inode(fs, chain)->max_free < size)
+        return -1;
+    char *data = get_block(fs, get_inode(fs, chain)->blocks[0])->data;
+    for (uint32_t off = 0; off < BLOCK_SIZE;) {
+        struct entry *e = (struct entry *) (data + off);
+        uint32_t used = e->type == 0 ? 0 : record_size(e->name_len);
+        if (e->rec_len - used >= size) {
+            if (used == 0)
+                return off / RECORD_ALIGN;
+            struct entry *rest = (struct entry *) (data + off + used);
+            rest->rec_len = e->rec_len - used;
+            rest->type = 0;
+            e->rec_len = used;
+            mark_dirty(fs, e, sizeof(struct entry));
+            mark_dirty(fs, rest, sizeof(struct entry));
+            return (off + used) / RECORD_ALIGN;
+        }
+        off += e->rec_len;
+    }
+    return -1;
+}
+
+// Fills the free record at slot, which make_room found.
+void dir_fill_slot(struct extfs *fs, uint32_t dir, uint32_t chain, int slot, const char *name, uint32_t inode) {
+    struct entry *e = chain_entry(fs, chain, slot);
+    uint32_t len = strlen(name);
+    e->id = inode;
+    e->name_len = len;
+    e->type = get_inode(fs, inode)->mode;
+    memcpy(e->name, name, len + 1);
+    mark_dirty(fs, e, record_size(len));
+    get_inode(fs, chain)->entry_count++;
+    get_inode(fs, chain)->free_bytes -= record_size(len);
+    update_max_free(fs, chain);
+    if (get_inode(fs, inode)->mode == MODE_DIR) {
+        get_inode(fs, inode)->parent = dir;
+        get_inode(fs, inode)->parent_chain = chain;
+        get_inode(fs, inode)->parent_slot = slot;
+        mark_inode_dirty(fs, inode);
+    }
+}
+
+// Adds an entry to the first block of dir with room for it, growing the
+// chain if needed.
+uint32_t dir_insert(struct extfs *fs, uint32_t dir, const char *name, uint32_t inode) {
+    if (own_dir(fs, dir) == ERROR)
+        return ERROR;
+    dcache_invalidate(fs, dir, name);
+    uint32_t prev_inode = INVALID_INODE;
+    uint32_t temp_inode = dir;
+    uint32_t chain_len = 0, size = record_size(strlen(name)), room = 0;
+    struct index_header *h = NULL;
+    if (get_inode(fs, dir)->index_inode != 0) {
+        h = index_header(fs, dir);
+        if (h->room < size) {
+            // no block has room, append right away
+            prev_inode = h->tail;
+            temp_inode = INVALID_INODE;
+            room = h->room;
+        }
+    }
+    while (temp_inode != INVALID_INODE) {
+        int slot = make_room(fs, temp_inode, size);
+        if (slot >= 0) {
+            dir_fill_slot(fs, dir, temp_inode, slot, name, inode);
+            if (h != NULL) {
+                index_add(fs, dir, temp_inode, slot);
+            }
+            return 0;
+        }
+        if (get_inode(fs, temp_inode)->max_free > room) {
+            room = get_inode(fs, temp_inode)->max_free;
+        }
+        prev_inode = temp_inode;
+        temp_inode = get_inode(fs, temp_inode)->next_inode;
+        chain_len++;
+        STAT_ADD(fs, chain_links, temp_inode != INVALID_INODE);
+    }
+
+    if (!fs->img->replaying) {
+        info(fs, "INFO: Dir entry limit exceeded and creating a new inode for it.\n");
+    }
+    uint32_t new_cont = allocate_inode(fs, MODE_CONT, inode_group(fs, dir));
+    if (new_cont == ERROR)
+        return ERROR;
+    dir_fill_slot(fs, dir, new_cont, make_room(fs, new_cont, size), name, inode);
+    get_inode(fs, prev_inode)->next_inode = new_cont;
+    mark_inode_dirty(fs, prev_inode);
+    if (h != NULL) {
+        // the walk found no room, so room holds the max_free of the others
+        h->tail = new_cont;
+        h->room = room > get_inode(fs, new_cont)->max_free ? room : get_inode(fs, new_cont)->max_free;
+        mark_dirty(fs, h, sizeof(struct index_header));
+        index_add(fs, dir, new_cont, 0);
+    } else if (chain_len >= INDEX_MIN_CHAIN) {
+        build_index(fs, dir, 1);
+    }
+    return 0;
+}
+
+void dir_clear_slot(struct extfs *fs, uint32_t chain, int slot) {
+    char *data = get_block(fs, get_inode(fs, chain)->blocks[0])->data;
+    struct entry *e = (struct entry *) (data + slot * RECORD_ALIGN), *prev = NULL;
+    for (uint32_t off = 0; off < (uint32_t) slot * RECORD_ALIGN; off += prev->rec_len) {
+        prev = (struct entry *) (data + off);
+    }
+    get_inode(fs, chain)->entry_count--;
+    get_inode(fs, chain)->free_bytes += record_size(e->name_len);
+    if (prev == NULL) {
+        e->type = 0;
+        mark_dirty(fs, e, sizeof(struct entry));
+    } else {
+        prev->rec_len += e->rec_len;
+        mark_dirty(fs, prev, sizeof(struct entry));
+    }
+    update_max_free(fs, chain);
+}
+
+uint32_t dir_remove(struct extfs *fs, uint32_t dir, uint32_t chain, int slot) {
+    if (own_dir(fs, dir) == ERROR)
+        return ERROR;
+    dcache_invalidate(fs, dir, chain_entry(fs, chain, slot)->name);
+    if (get_inode(fs, dir)->index_inode != 0) {
+        index_remove(fs, dir, chain, slot);
+    }
+    dir_clear_slot(fs, chain, slot);
+    if (get_inode(fs, dir)->index_inode != 0) {
+        struct index_header *h = index_header(fs, dir);
+        if (get_inode(fs, chain)->max_free > h->room) {
+            h->room = get_inode(fs, chain)->max_free;
+            mark_dirty(fs, h, sizeof(struct index_header));
+        }
+    }
+    return 0;
+}
+
+// Closes a block filled by rewrite_dir up to off, the last record running to
+// its end.
+void end_records(struct extfs *fs, uint32_t chain, struct entry *last, uint32_t off) {
+    if (last == NULL)
+        return;
+    last->rec_len += BLOCK_SIZE - off;
+    mark_dirty(fs, get_block(fs, get_inode(fs, chain)->blocks[0]), off);
+    get_inode(fs, chain)->max_free = BLOCK_SIZE - off;
+    mark_inode_dirty(fs, chain);
+}
+
+// Lays out the len bytes of records, each rec_len long, from the start of the
+// chain of dir, growing it if needed and freeing the cont inodes left over,
+// and rebuilds its index. The records are packed one after the other, a block
+// at a time. Returns ERROR if the chain could not grow, leaving out the
+// records past that point.
+uint32_t rewrite_dir(struct extfs *fs, uint32_t dir, const char *records, size_t len) {
+    uint32_t chain = dir, chain_len = 1, result = 0, off = 0;
+    struct entry *last = NULL;
+    if (own_dir(fs, dir) == ERROR)
+        return ERROR;
+    init_records(fs, dir);
+    for (size_t pos = 0; pos < len; pos += ((const struct entry *) (records + pos))->rec_len) {
+        const struct entry *e = (const struct entry *) (records + pos);
+        uint32_t size = record_size(e->name_len);
+        if (off + size > BLOCK_SIZE) {
+            end_records(fs, chain, last, off);
+            uint32_t next = get_inode(fs, chain)->next_inode;
+            if (next == INVALID_INODE) {
+                next = allocate_inode(fs, MODE_CONT, inode_group(fs, dir));
+                if (next == ERROR) {
+                    result = ERROR;
+                    last = NULL;
+                    break;
+                }
+                get_inode(fs, chain)->next_inode = next;
+                mark_inode_dirty(fs, chain);
+            } else {
+                init_records(fs, next);
+            }
+            chain = next;
+            chain_len++;
+            off = 0;
+        }
+        struct entry *to = chain_entry(fs, chain, off / RECORD_ALIGN);
+        to->id = e->id;
+        to->rec_len = size;
+        to->name_len = e->name_len;
+        to->type = get_inode(fs, e->id)->mode;
+        memcpy(to->name, e->name, e->name_len + 1);
+        get_inode(fs, chain)->entry_count++;
+        get_inode(fs, chain)->free_bytes -= size;
+        if (to->type == MODE_DIR) {
+            get_inode(fs, e->id)->parent = dir;
+            get_inode(fs, e->id)->parent_chain = chain;
+            get_inode(fs, e->id)->parent_slot = off / RECORD_ALIGN;
+            mark_inode_dirty(fs, e->id);
+        }
+        last = to;
+        off += size;
+    }
+    end_records(fs, chain, last, off);
+    uint32_t cont = get_inode(fs, chain)->next_inode;
+    get_inode(fs, chain)->next_inode = INVALID_INODE;
+    mark_inode_dirty(fs, chain);
+    while (cont != INVALID_INODE) {
+        uint32_t next = get_inode(fs, cont)->next_inode;
+        free_inode(fs, cont);
+        cont = next;
+    }
+    // the slots of the entries changed, and dir_insert indexes chains this long
+    if (chain_len > INDEX_MIN_CHAIN) {
+        build_index(fs, dir, 1);
+    } else {
+        free_index(fs, dir);
+    }
+    return result;
+}
+
+void remove_ending_slash(char *path) {
+    size_t len = strlen(path);
+    if (len > 1 && path[len - 1] == '/') {
+        path[len - 1] = '\0';
+    }
+}
+
+int check_filename_valid(struct extfs *fs, const char *path) {
+    size_t len = strlen(path);
+    if (len >= MAX_FILENAME - 1) {
+        return fail(fs, EXTFS_NAME_TOO_LONG);
+    } else if (len == 0) {
+        return fail(fs, EXTFS_NAME_EMPTY);
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!(isalnum(path[i]) || path[i] == '.' || path[i] == '_')) {
+            return fail(fs, EXTFS_NAME_INVALID);
+        }
+    }
+    if (strcmp(path, ".") == 0 || strcmp(path, "..") == 0) {
+        return fail(fs, EXTFS_NAME_RESERVED);
+    }
+    return 0;
+}
+
+void split_path(char **path, char **file_name) {
+    char *rev_slash = strrchr(*path, '/');
+    if (rev_slash == NULL) {
+        *file_name = *path;
+        *path += strlen(*path);
+    } else {
+        if (rev_slash == *path) {
+            *file_name = *path + 1;
+            *path = "/";
+        } else {
+            *file_name = rev_slash + 1;
+            *rev_slash = '\0';
+        }
+    }
+}
+
+// Whether p has no components left but "." ones.
+int path_done(const char *p) {
+    while (*p == '/' || (*p == '.' && (p[1] == '/' || p[1] == '\0'))) p++;
+    return *p == '\0';
+}
+
+// Resolves path from the working dir. Dirs only go away with rmdir, which
+// excludes all other calls, so a lookup answered by the dentry cache needs
+// no lock. Otherwise the dir is locked shared while it is searched. If held
+// is not NULL and the last component is found in a dir, that dir stays
+// locked and *held is set to it, to INVALID_INODE otherwise.
+uint32_t walk_path(struct extfs *fs, char *path, uint32_t *held) {
+    uint32_t cur_inode = path[0] == '/' ? ROOT_INODE : fs->cur_dir;
+    int is_dir = 1;
+    if (held != NULL) {
+        *held = INVALID_INODE;
+    }
+    fs->temp_parent = get_inode(fs, cur_inode)->parent;
+    char name[MAX_FILENAME];
+    const char *p = path;
+    while (*p != '\0') {
+        const char *end = strchr(p, '/');
+        size_t name_len = end == NULL ? strlen(p) : (size_t) (end - p);
+        const char *next = end == NULL ? p + name_len : end + 1;
+        if (name_len == 0 || (name_len == 1 && p[0] == '.')) {
+            p = next;
+            continue;
+        } else if (name_len == 2 && p[0] == '.' && p[1] == '.') {
+            // only dirs know their parent, a file goes back to where it was found
+            if (is_dir) {
+                if (cur_inode == ROOT_INODE) {
+                    return fail(fs, EXTFS_AT_ROOT);
+                }
+                cur_inode = get_inode(fs, cur_inode)->parent;
+            } else {
+                cur_inode = fs->temp_parent;
+            }
+            is_dir = 1;
+            fs->temp_parent = get_inode(fs, cur_inode)->parent;
+            p = next;
+            continue;
+        }
+
+        uint32_t id = ERROR;
+        if (name_len < MAX_FILENAME && is_dir) {
+            memcpy(name, p, name_len);
+            name[name_len] = '\0';
+            uint32_t hash = name_hash(name);
+            if (held != NULL && path_done(next)) {
+                // the last component, which stays locked
+                lock_dir(fs, cur_inode, 0);
+                id = dir_lookup(fs, cur_inode, name, NULL, NULL);
+                if (id != ERROR) {
+                    *held = cur_inode;
+                } else {
+                    unlock_dir(fs, cur_inode);
+                }
+            } else if (!dcache_lookup(fs, cur_inode, name, hash, &id, &is_dir)) {
+                lock_dir(fs, cur_inode, 0);
+                id = dir_search(fs, cur_inode, name, NULL, NULL);
+                dcache_insert(fs, cur_inode, name, hash, id);
+                is_dir = id != ERROR && get_inode(fs, id)->mode == MODE_DIR;
+                unlock_dir(fs, cur_inode);
+            }
+        }
+        if (id == ERROR) {
+            return fail(fs, EXTFS_PATH_NOT_FOUND);
+        }
+        fs->temp_parent = cur_inode;
+        cur_inode = id;
+        p = next;
+        STAT_ADD(fs, path_components, 1);
+    }
+    return cur_inode;
+}
+
+uint32_t find_path_inode(struct extfs *fs, char *path) {
+    return walk_path(fs, path, NULL);
+}
+
+void release_path(struct extfs *fs, uint32_t held) {
+    if (held != INVALID_INODE) {
+        unlock_dir(fs, held);
+    }
+}
+
+// Replaces the image with size bytes of zeros. Returns ERROR, leaving the
+// image alone, if it cannot be resized.
+int reset_image(struct extfs *fs, size_t size) {
+    void *addr;
+    if (fs->img->fs_fd >= 0 && fs->img->journal_policy != EXTFS_JOURNAL_OFF) {
+        // the image file itself is only rewritten by the next checkpoint
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            return ERROR;
+        munmap(fs->img->fp, fs->img->image_size);
+    } else if (fs->img->fs_fd >= 0) {
+        // dropping the file contents is much cheaper than dirtying every page
+        if (ftruncate(fs->img->fs_fd, 0) != 0 || ftruncate(fs->img->fs_fd, size) != 0)
+            return ERROR;
+        addr = mremap(fs->img->fp, fs->img->image_size, size, MREMAP_MAYMOVE);
+        if (addr == MAP_FAILED)
+            return ERROR;
+    } else {
+        addr = calloc(1, size);
+        if (addr == NULL)
+            return ERROR;
+        cache_drop(fs);
+        free(fs->img->fp);
+    }
+    fs->img->fp = (struct super_block *) addr;
+    fs->img->image_size = size;
+    resize_dirty_chunks(fs, size);
+    if (fs->img->journal_policy != EXTFS_JOURNAL_OFF || fs->img->fs_fd < 0) {
+        // the next save starts the file over, writing what the format dirtied
+        clear_dirty(fs);
+        fs->img->format_pending = 1;
+    }
+    return 0;
+}
+
+// Extends the image to size bytes, keeping its contents.
+int grow_image(struct extfs *fs, size_t size) {
+    void *addr;
+    if (fs->img->fs_fd >= 0) {
+        // pages of a file mapping past the end of the file cannot be touched
+        struct stat st;
+        if (fstat(fs->img->fs_fd, &st) != 0 || (st.st_size < (off_t) size && ftruncate(fs->img->fs_fd, size) != 0))
+            return ERROR;
+        addr = mremap(fs->img->fp, fs->img->image_size, size, MREMAP_MAYMOVE);
+        if (addr == MAP_FAILED)
+            return ERROR;
+    } else {
+        if (fs->img->lazy) {
+            cache_load_all(fs);
+            cache_drop(fs);
+        }
+        addr = realloc(fs->img->fp, size);
+        if (addr == NULL)
+            return ERROR;
+        memset((char *) addr + fs->img->image_size, 0, size - fs->img->image_size);
+    }
+    fs->img->fp = (struct super_block *) addr;
+    fs->img->image_size = size;
+    resize_dirty_chunks(fs, size);
+    return 0;
+}
+
+// Blocks taken by the metadata at the start of a group.
+uint32_t group_metadata(uint32_t group, uint32_t inodes_per_group) {
+    return (group == 0) + 2 + inodes_per_group / INODES_PER_BLOCK;
+}
+
+// Works out the geometry of an image with room for about inodes inodes in
+// *blocks blocks. A trailing group too short for its own metadata is left
+// out of *blocks. Returns the inodes per group, or ERROR if there is none.
+uint32_t plan_layout(uint32_t inodes, uint32_t *blocks) {
+    uint32_t groups = (*blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    if (inodes > MAX_INODE) {
+        inodes = MAX_INODE;
+    }
+    while (groups > 0 && groups <= MAX_GROUPS && inodes > 0) {
+        uint32_t per_group = (inodes + groups - 1) / groups;
+        per_group = (per_group + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+        if (per_group > BLOCK_SIZE * 8 || group_metadata(0, per_group) >= GROUP_BLOCKS)
+            return ERROR;
+        if (*blocks - (groups - 1) * GROUP_BLOCKS > group_metadata(groups - 1, per_group))
+            return per_group;
+        *blocks = --groups * GROUP_BLOCKS;
+    }
+    return ERROR;
+}
+
+// Sets up the metadata of the next group, which ends the image.
+void init_group(struct extfs *fs, uint32_t group) {
+    struct group_desc *gd = &fs->img->fp->groups[group];
+    uint32_t per_group = fs->img->fp->inodes_per_group, len = group_length(fs, group);
+    uint32_t inodes = MAX_INODE - fs->img->fp->inodes_count < per_group ? MAX_INODE - fs->img->fp->inodes_count : per_group;
+    uint32_t used = group_metadata(group, per_group);
+    memset(gd, 0, sizeof(struct group_desc));
+    gd->block_bitmap = group * GROUP_BLOCKS + (group == 0);
+    gd->inode_bitmap = gd->block_bitmap + 1;
+    gd->inode_table = gd->block_bitmap + 2;
+    gd->inodes = inodes;
+    if (len >= used + SUM_BLOCKS) {
+        gd->sums = group * GROUP_BLOCKS + used;
+        used += SUM_BLOCKS;
+    }
+    memset(block_bitmap(fs, group), 0, BLOCK_SIZE);
+    memset(inode_bitmap(fs, group), 0, BLOCK_SIZE);
+    // the metadata, checksums, blocks past the end and inodes past MAX_INODE
+    // look taken
+    for (uint32_t i = 0; i < GROUP_BLOCKS; i++) {
+        if (i < used || i >= len) {
+            set_bit(block_bitmap(fs, group), i);
+        }
+    }
+    for (uint32_t i = inodes; i < per_group; i++) {
+        set_bit(inode_bitmap(fs, group), i);
+    }
+    gd->free_blocks = len - used;
+    gd->free_inodes = inodes;
+    fs->img->fp->free_blocks += gd->free_blocks;
+    fs->img->fp->free_inodes += inodes;
+    fs->img->fp->inodes_count += inodes;
+    fs->img->fp->group_count = group + 1;
+    mark_block_dirty(fs, gd->block_bitmap);
+    mark_block_dirty(fs, gd->inode_bitmap);
+    mark_dirty(fs, fs->img->fp, 64);
+    mark_dirty(fs, gd, sizeof(struct group_desc));
+    fill_sums(fs, group);
+}
+
+// Lays out an empty image. Returns ERROR, leaving the image alone, if the
+// counts make no usable image or it cannot be resized.
+uint32_t layout_fs(struct extfs *fs, uint32_t inodes, uint32_t blocks) {
+    uint32_t per_group = plan_layout(inodes, &blocks);
+    if (per_group == ERROR || reset_image(fs, (size_t) blocks * BLOCK_SIZE) == ERROR)
+        return ERROR;
+    fs->img->fp->version = CURRENT_VERSION;
+    fs->img->fp->blocks_count = blocks;
+    fs->img->fp->inodes_per_group = per_group;
+    while (fs->img->fp->group_count * GROUP_BLOCKS < blocks) {
+        init_group(fs, fs->img->fp->group_count);
+    }
+    return 0;
+}
+
+void load_refs(struct extfs *fs);
+
+uint32_t format(struct extfs *fs, uint32_t inodes, uint32_t blocks) {
+    uint32_t planned = blocks;
+    if (plan_layout(inodes, &planned) == ERROR) {
+        return fail(fs, EXTFS_BAD_COUNT);
+    }
+    info(fs, "Formatting disk...\n");
+    dcache_clear(fs);
+    drop_subtrees(fs);
+    fs->img->orphans.count = 0;
+    if (layout_fs(fs, inodes, blocks) == ERROR) {
+        return fail(fs, EXTFS_RESIZE_FAILED);
+    }
+    load_refs(fs);
+    // the first inode allocated on an empty disk is always ROOT_INODE
+    uint32_t root = allocate_inode(fs, MODE_DIR, 0);
+    get_inode(fs, root)->parent = root;
+    get_inode(fs, root)->parent_chain = INVALID_INODE;
+    reset_cwds(fs);
+    info(fs, "Formatting done...\n");
+    return 0;
+}
+
+// Grows the image to blocks blocks, first filling up the last group and
+// then adding new ones. Returns the new block count.
+uint32_t do_resize(struct extfs *fs, uint32_t blocks) {
+    if (blocks > MAX_GROUPS * GROUP_BLOCKS) {
+        return fail(fs, EXTFS_TOO_LARGE);
+    }
+    uint32_t groups = (blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    if (groups > fs->img->fp->group_count &&
+        blocks - (groups - 1) * GROUP_BLOCKS <= group_metadata(groups - 1, fs->img->fp->inodes_per_group)) {
+        // too short for the metadata of a new group
+        blocks = --groups * GROUP_BLOCKS;
+    }
+    if (blocks <= fs->img->fp->blocks_count) {
+        return fail(fs, EXTFS_CANNOT_SHRINK);
+    }
+    if (grow_image(fs, (size_t) blocks * BLOCK_SIZE) == ERROR) {
+        return fail(fs, EXTFS_RESIZE_FAILED);
+    }
+    uint32_t last = fs->img->fp->group_count - 1, old_len = group_length(fs, last);
+    if (fs->img->refs != NULL) {
+        fs->img->refs = (uint8_t *) realloc(fs->img->refs, blocks);
+        memset(fs->img->refs + fs->img->fp->blocks_count, 0, blocks - fs->img->fp->blocks_count);
+    }
+    fs->img->fp->blocks_count = blocks;
+    for (uint32_t i = old_len; i < group_length(fs, last); i++) {
+        clear_bit(block_bitmap(fs, last), i);
+    }
+    fs->img->fp->groups[last].free_blocks += group_length(fs, last) - old_len;
+    fs->img->fp->free_blocks += group_length(fs, last) - old_len;
+    mark_block_dirty(fs, fs->img->fp->groups[last].block_bitmap);
+    mark_counters_dirty(fs, last);
+    while (fs->img->fp->group_count < groups) {
+        init_group(fs, fs->img->fp->group_count);
+    }
+    mark_dirty(fs, fs->img->fp, 64);
+    return blocks;
+}
+
+// Converts a LEGACY_VERSION image in place. The byte-per-entry bitmaps become
+// packed ones, which moves the inode table and the blocks by a few bytes.
+void upgrade_legacy_fs(struct fixed_file *f) {
+    struct legacy_file *legacy = (struct legacy_file *) f;
+    uint8_t *bitmaps = (uint8_t *) malloc(FIXED_INODES + FIXED_BLOCKS);
+    memcpy(bitmaps, legacy->inode_bitmap, FIXED_INODES + FIXED_BLOCKS);
+    memmove(f->nodes, legacy->nodes, sizeof(legacy->nodes) + sizeof(legacy->blocks));
+    memset(&f->sb, 0, sizeof(struct fixed_super_block));
+    for (uint32_t i = 0; i < FIXED_INODES; i++) {
+        if (bitmaps[i] != 0) {
+            set_bit(f->sb.inode_bitmap, i);
+        }
+    }
+    for (uint32_t i = 0; i < FIXED_BLOCKS; i++) {
+        if (bitmaps[FIXED_INODES + i] != 0) {
+            set_bit(f->sb.block_bitmap, i);
+        }
+    }
+    free(bitmaps);
+    f->version = PACKED_BITMAP_VERSION;
+}
+
+// Converts an INDEXED_VERSION image in place. The byte-per-slot entry bitmap
+// of each inode is packed into one word, which frees room for the parent
+// pointers of dirs.
+void upgrade_indexed_fs(struct fixed_file *f) {
+    for (uint32_t i = 0; i < FIXED_INODES; i++) {
+        uint8_t old_bitmap[MAX_DIRENTRY_PER_BLOCK];
+        // the old bitmap started where the packed one does
+        uint8_t *p = (uint8_t *) &f->nodes[i].bitmap;
+        memcpy(old_bitmap, p, sizeof(old_bitmap));
+        memset(p, 0, sizeof(old_bitmap));
+        if (!test_bit(f->sb.inode_bitmap, i) ||
+            (f->nodes[i].mode != MODE_DIR && f->nodes[i].mode != MODE_CONT))
+            continue;
+        for (int j = 0; j < MAX_DIRENTRY_PER_BLOCK; j++) {
+            if (old_bitmap[j] != 0) {
+                f->nodes[i].bitmap |= 1 << j;
+            }
+        }
+    }
+    f->nodes[ROOT_INODE].parent = ROOT_INODE;
+    f->nodes[ROOT_INODE].parent_chain = INVALID_INODE;
+    for (uint32_t i = 0; i < FIXED_INODES; i++) {
+        if (!test_bit(f->sb.inode_bitmap, i) || f->nodes[i].mode != MODE_DIR)
+            continue;
+        uint32_t temp_inode = i;
+        do {
+            for (int j = 0; j < MAX_DIRENTRY_PER_BLOCK; j++) {
+                if ((f->nodes[temp_inode].bitmap >> j) & 1) {
+                    uint32_t id = f->blocks[f->nodes[temp_inode].blocks[0]].slots[j].id;
+                    if (f->nodes[id].mode == MODE_DIR) {
+                        f->nodes[id].parent = i;
+                        f->nodes[id].parent_chain = temp_inode;
+                        f->nodes[id].parent_slot = j;
+                    }
+                }
+            }
+            temp_inode = f->nodes[temp_inode].next_inode;
+        } while (temp_inode != INVALID_INODE);
+    }
+    f->version = PARENT_VERSION;
+}
+
+// Converts a PARENT_VERSION image in place. Its files own exactly the one
+// block in blocks[0], which becomes their only extent.
+void upgrade_parent_fs(struct fixed_file *f) {
+    for (uint32_t i = 0; i < FIXED_INODES; i++) {
+        struct inode *node = &f->nodes[i];
+        if (!test_bit(f->sb.inode_bitmap, i) || node->mode != MODE_FILE)
+            continue;
+        uint32_t block = node->blocks[0];
+        memset(&node->extent_count, 0, sizeof(struct inode) - offsetof(struct inode, extent_count));
+        node->extent_count = 1;
+        node->extents[0].start = block;
+        node->extents[0].len = 1;
+    }
+    f->version = EXTENT_VERSION;
+}
+
+// Moves an EXTENT_VERSION image into a single block group. Inode numbers stay
+// the same, block numbers shift past the group metadata and checksums.
+void upgrade_extent_fs(struct extfs *fs, struct fixed_file *f) {
+    uint32_t shift = group_metadata(0, FIXED_INODES) + SUM_BLOCKS;
+    layout_fs(fs, FIXED_INODES, FIXED_BLOCKS + shift);
+    for (uint32_t j = 0; j < FIXED_BLOCKS; j++) {
+        if (test_bit(f->sb.block_bitmap, j)) {
+            memcpy(get_block(fs, j + shift), &f->blocks[j], BLOCK_SIZE);
+            set_bit(block_bitmap(fs, 0), j + shift);
+            fs->img->fp->groups[0].free_blocks--;
+            fs->img->fp->free_blocks--;
+        }
+    }
+    for (uint32_t i = 0; i < FIXED_INODES; i++) {
+        if (!test_bit(f->sb.inode_bitmap, i))
+            continue;
+        struct inode *node = get_inode(fs, i);
+        *node = f->nodes[i];
+        set_bit(inode_bitmap(fs, 0), i);
+        fs->img->fp->groups[0].free_inodes--;
+        fs->img->fp->free_inodes--;
+        if (node->mode != MODE_FILE) {
+            node->blocks[0] += shift;
+            continue;
+        }
+        if (node->extent_block != 0) {
+            node->extent_block += shift;
+        }
+        for (uint32_t k = 0; k < node->extent_count; k++) {
+            file_extent(fs, i, k)->start += shift;
+        }
+    }
+    fs->img->fp->inode_hint = f->sb.inode_hint;
+    fs->img->fp->block_hint = f->sb.block_hint + shift;
+    mark_all_dirty(fs);
+}
+
+// Converts an image of up to INLINE_VERSION in place. The fixed entry slots of
+// its dir blocks become records, which may take more blocks when all 16 names
+// are long. Its indexes point at slots and are built again.
+void upgrade_inline_fs(struct extfs *fs) {
+    for (uint32_t i = 0; i < fs->img->fp->inodes_count; i++) {
+        if (!inode_used(fs, i))
+            continue;
+        if (get_inode(fs, i)->mode == MODE_INDEX) {
+            free_inode(fs, i);
+        } else if (get_inode(fs, i)->mode == MODE_DIR) {
+            get_inode(fs, i)->index_inode = 0;
+            mark_inode_dirty(fs, i);
+        }
+    }
+    size_t cap = 0;
+    char *records = NULL;
+    for (uint32_t i = 0; i < fs->img->fp->inodes_count; i++) {
+        if (!inode_used(fs, i) || get_inode(fs, i)->mode != MODE_DIR)
+            continue;
+        size_t len = 0;
+        for (uint32_t chain = i; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+            struct slot_entry *slots = get_block(fs, get_inode(fs, chain)->blocks[0])->slots;
+            for (int j = 0; j < MAX_DIRENTRY_PER_BLOCK; j++) {
+                if (!((get_inode(fs, chain)->bitmap >> j) & 1))
+                    continue;
+                uint32_t name_len = strlen(slots[j].name);
+                if (len + record_size(name_len) > cap) {
+                    cap = cap == 0 ? BLOCK_SIZE : cap * 2;
+                    records = (char *) realloc(records, cap);
+                }
+                struct entry *e = (struct entry *) (records + len);
+                e->id = slots[j].id;
+                e->rec_len = record_size(name_len);
+                e->name_len = name_len;
+                e->type = get_inode(fs, slots[j].id)->mode;
+                memcpy(e->name, slots[j].name, name_len + 1);
+                len += e->rec_len;
+            }
+        }
+        if (rewrite_dir(fs, i, records, len) == ERROR) {
+            info(fs, "ERR: no inode left for all entries of dir %u.\n", i);
+        }
+    }
+    free(records);
+}
+
+// Gives the groups of an image from before CURRENT_VERSION their checksums,
+// where SUM_BLOCKS blocks in a row are left.
+void upgrade_sums_fs(struct extfs *fs) {
+    for (uint32_t g = 0; g < fs->img->fp->group_count; g++) {
+        struct group_desc *gd = &fs->img->fp->groups[g];
+        uint32_t len, start = gd->sums != 0 ? ERROR : find_zero_run(block_bitmap(fs, g), GROUP_BLOCKS, 0, SUM_BLOCKS, &len);
+        if (start != ERROR && len == SUM_BLOCKS) {
+            for (uint32_t i = start; i < start + SUM_BLOCKS; i++) {
+                set_bit(block_bitmap(fs, g), i);
+            }
+            gd->sums = g * GROUP_BLOCKS + start;
+            gd->free_blocks -= SUM_BLOCKS;
+            fs->img->fp->free_blocks -= SUM_BLOCKS;
+            mark_block_bitmap_dirty(fs, gd->sums, SUM_BLOCKS);
+            mark_counters_dirty(fs, g);
+        }
+        fill_sums(fs, g);
+    }
+    fs->img->fp->version = CURRENT_VERSION;
+    mark_dirty(fs, fs->img->fp, 64);
+}
+
+void upgrade_fs(struct extfs *fs) {
+    // the old image is copied out, it is laid out again from scratch
+    struct fixed_file *f = (struct fixed_file *) malloc(sizeof(struct fixed_file));
+    memcpy(f, fs->img->fp, sizeof(struct fixed_file));
+    if (f->version == LEGACY_VERSION) {
+        upgrade_legacy_fs(f);
+    }
+    // PACKED_BITMAP_VERSION only differs in the upper half of the inode mode,
+    // which was always zero and now reads as "no index"
+    if (f->version == PACKED_BITMAP_VERSION || f->version == INDEXED_VERSION) {
+        upgrade_indexed_fs(f);
+    }
+    if (f->version == PARENT_VERSION) {
+        upgrade_parent_fs(f);
+    }
+    upgrade_extent_fs(fs, f);
+    free(f);
+    upgrade_inline_fs(fs);
+}
+
+int fixed_version(uint32_t version) {
+    return version == LEGACY_VERSION || version == PACKED_BITMAP_VERSION ||
+           version == INDEXED_VERSION || version == PARENT_VERSION || version == EXTENT_VERSION;
+}
+
+// Size of the image described by header, 0 if it is none we know.
+size_t header_image_size(const struct super_block *header) {
+    if ((header->version == CURRENT_VERSION || header->version == SNAPSHOT_VERSION || header->version == RECORD_VERSION ||
+         header->version == INLINE_VERSION || header->version == GROUP_VERSION) &&
+        header->blocks_count > 0 &&
+        header->blocks_count <= MAX_GROUPS * GROUP_BLOCKS)
+        return (size_t) header->blocks_count * BLOCK_SIZE;
+    if (fixed_version(header->version))
+        return sizeof(struct fixed_file);
+    return 0;
+}
+
+// Tree scans
+//
+// scan_tree visits every entry below a dir. Like fsck, worker threads take
+// dirs off a shared stack, so a large tree spreads over the cores once the
+// first dir has turned up subdirs. While a worker reads a chain block it
+// prefetches the next one, and the inodes of the block's entries before it
+// looks at them. Each dir is locked shared while it is read.
+
+struct tree_scan;
+
+// gets every entry of dir, on whichever thread scans it, and NULL first
+typedef void (*scan_fn)(struct tree_scan *sc, uint32_t dir, const struct entry *e);
+
+struct scan_worker {
+    struct tree_scan *sc;
+    pthread_t thread;
+    struct dir_stack found; // subdirs of the dir being scanned
+};
+
+struct tree_scan {
+    struct extfs *fs;
+    scan_fn fn;
+    void *arg;
+    pthread_mutex_t lock; // guards queue, seen and busy
+    pthread_cond_t cond;
+    struct dir_stack queue;
+    struct dir_stack seen; // every dir queued, each after its parent
+    uint32_t busy;
+    struct scan_worker workers[SCAN_THREADS];
+};
+
+void dir_stack_push(struct dir_stack *s, uint32_t dir);
+
+// Starts bringing a block into the CPU caches. Blocks of a lazily read pack
+// that are not in memory yet are left to cache_touch.
+void prefetch_block(struct extfs *fs, uint32_t block) {
+    if (fs->img->lazy && !(__atomic_load_n(&fs->img->loaded[block / 64], __ATOMIC_ACQUIRE) & (1ULL << (block % 64))))
+        return;
+    const char *p = (const char *) fs->img->fp + (size_t) block * BLOCK_SIZE;
+    for (uint32_t off = 0; off < BLOCK_SIZE; off += 64) {
+        __builtin_prefetch(p + off);
+    }
+}
+
+void scan_dir(struct scan_worker *w, uint32_t dir) {
+    struct tree_scan *sc = w->sc;
+    struct extfs *fs = sc->fs;
+    lock_dir(fs, dir, 0);
+    sc->fn(sc, dir, NULL);
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        uint32_t next = get_inode(fs, chain)->next_inode;
+        if (next != INVALID_INODE) {
+            prefetch_block(fs, get_inode(fs, next)->blocks[0]);
+        }
+        for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+            __builtin_prefetch(get_inode(fs, chain_entry(fs, chain, i)->id));
+        }
+        for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+            struct entry *e = chain_entry(fs, chain, i);
+            if (e->type == MODE_DIR) {
+                dir_stack_push(&w->found, e->id);
+            }
+            sc->fn(sc, dir, e);
+        }
+    }
+    unlock_dir(fs, dir);
+    if (w->found.count > 0) {
+        pthread_mutex_lock(&sc->lock);
+        for (uint32_t i = 0; i < w->found.count; i++) {
+            dir_stack_push(&sc->queue, w->found.dirs[i]);
+            dir_stack_push(&sc->seen, w->found.dirs[i]);
+        }
+        pthread_cond_broadcast(&sc->cond);
+        pthread_mutex_unlock(&sc->lock);
+        w->found.count = 0;
+    }
+}
+
+// Scans dirs off the queue until it is empty and no other worker can add to
+// it.
+void *scan_main(void *arg) {
+    struct scan_worker *w = (struct scan_worker *) arg;
+    struct tree_scan *sc = w->sc;
+    pthread_mutex_lock(&sc->lock);
+    for (;;) {
+        while (sc->queue.count == 0 && sc->busy > 0) {
+            pthread_cond_wait(&sc->cond, &sc->lock);
+        }
+        if (sc->queue.count == 0)
+            break;
+        uint32_t dir = sc->queue.dirs[--sc->queue.count];
+        sc->busy++;
+        pthread_mutex_unlock(&sc->lock);
+        scan_dir(w, dir);
+        pthread_mutex_lock(&sc->lock);
+        if (--sc->busy == 0 && sc->queue.count == 0) {
+            pthread_cond_broadcast(&sc->cond);
+        }
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return NULL;
+}
+
+// Hands fn every entry below root. If seen is given, it gets every dir of
+// the subtree, root first and each dir after its parent.
+void scan_tree(struct extfs *fs, uint32_t root, scan_fn fn, void *arg, struct dir_stack *seen) {
+    struct tree_scan *sc = (struct tree_scan *) calloc(1, sizeof(struct tree_scan));
+    sc->fs = fs;
+    sc->fn = fn;
+    sc->arg = arg;
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_cond_init(&sc->cond, NULL);
+    for (uint32_t t = 0; t < SCAN_THREADS; t++) {
+        sc->workers[t].sc = sc;
+    }
+    dir_stack_push(&sc->seen, root);
+    // threads only pay off once there are subtrees to hand out
+    scan_dir(&sc->workers[0], root);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cpus < 1 ? 1 : cpus > SCAN_THREADS ? SCAN_THREADS : (uint32_t) cpus;
+    if (threads > sc->queue.count) {
+        threads = sc->queue.count > 0 ? sc->queue.count : 1;
+    }
+    int started[SCAN_THREADS] = {0};
+    for (uint32_t t = 1; t < threads; t++) {
+        started[t] = pthread_create(&sc->workers[t].thread, NULL, scan_main, &sc->workers[t]) == 0;
+    }
+    scan_main(&sc->workers[0]);
+    for (uint32_t t = 0; t < SCAN_THREADS; t++) {
+        if (started[t]) {
+            pthread_join(sc->workers[t].thread, NULL);
+        }
+        free(sc->workers[t].found.dirs);
+    }
+    if (seen != NULL) {
+        *seen = sc->seen;
+    } else {
+        free(sc->seen.dirs);
+    }
+    free(sc->queue.dirs);
+    pthread_mutex_destroy(&sc->lock);
+    pthread_cond_destroy(&sc->cond);
+    free(sc);
+}
+
+// Subtree totals
+
+void count_entry(struct tree_scan *sc, uint32_t dir, const struct entry *e) {
+    struct subtree *t = &sc->fs->img->subtrees[dir];
+    if (e == NULL) {
+        t->bytes = 0;
+        t->inodes = 0;
+    } else {
+        if (e->type == MODE_FILE) {
+            t->bytes += get_inode(sc->fs, e->id)->file_size;
+            t->inodes++;
+        }
+    }
+}
+
+// Works out the totals of root and every dir below it, which must not
+// change meanwhile.
+void count_subtrees(struct extfs *fs, uint32_t root) {
+    struct dir_stack seen;
+    if (fs->img->subtrees == NULL) {
+        fs->img->subtrees = (struct subtree *) calloc(MAX_INODE, sizeof(struct subtree));
+    }
+    scan_tree(fs, root, count_entry, NULL, &seen);
+    // the files of each dir are counted, so add the dir itself and hand the
+    // sum up, subdirs first
+    for (uint32_t i = seen.count; i-- > 0;) {
+        uint32_t dir = seen.dirs[i];
+        struct subtree *t = &fs->img->subtrees[dir];
+        t->inodes++;
+        if (dir != root) {
+            struct subtree *parent = &fs->img->subtrees[get_inode(fs, dir)->parent];
+            parent->bytes += t->bytes;
+            parent->inodes += t->inodes;
+        }
+    }
+    free(seen.dirs);
+}
+
+// Adds to the totals of dir and all dirs above it.
+void subtree_add(struct extfs *fs, uint32_t dir, int64_t bytes, int32_t inodes) {
+    if (!LOAD(fs->img->subtrees_valid))
+        return;
+    for (;; dir = get_inode(fs, dir)->parent) {
+        __atomic_fetch_add(&fs->img->subtrees[dir].bytes, (uint64_t) bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&fs->img->subtrees[dir].inodes, (uint32_t) inodes, __ATOMIC_RELAXED);
+        if (dir == ROOT_INODE)
+            break;
+    }
+}
+
+// Paths below a dir whose name matches a pattern, see extfs_find.
+struct find {
+    struct extfs *fs;
+    uint32_t root;
+    const char *prefix, *pattern;
+    pthread_mutex_t lock; // guards paths
+    char **paths;
+    uint32_t count, cap;
+};
+
+void find_entry(struct tree_scan *sc, uint32_t dir, const struct entry *e) {
+    struct find *f = (struct find *) sc->arg;
+    struct extfs *fs = f->fs;
+    if (e == NULL || fnmatch(f->pattern, e->name, 0) != 0)
+        return;
+    // the path from the prefix down, with a '/' after dirs
+    size_t len = strlen(f->prefix) + 1 + e->name_len + 1, pos;
+    for (uint32_t d = dir; d != f->root; d = get_inode(fs, d)->parent) {
+        len += 1 + chain_entry(fs, get_inode(fs, d)->parent_chain, get_inode(fs, d)->parent_slot)->name_len;
+    }
+    // built from the end, then moved to the front
+    char *path = (char *) malloc(len + 1);
+    pos = len;
+    path[pos] = '\0';
+    if (e->type == MODE_DIR) {
+        path[--pos] = '/';
+    }
+    pos -= e->name_len;
+    memcpy(path + pos, e->name, e->name_len);
+    for (uint32_t d = dir; d != f->root; d = get_inode(fs, d)->parent) {
+        const struct entry *name = chain_entry(fs, get_inode(fs, d)->parent_chain, get_inode(fs, d)->parent_slot);
+        path[--pos] = '/';
+        pos -= name->name_len;
+        memcpy(path + pos, name->name, name->name_len);
+    }
+    size_t prefix_len = strlen(f->prefix);
+    if (prefix_len > 0 && f->prefix[prefix_len - 1] != '/') {
+        path[--pos] = '/';
+    }
+    pos -= prefix_len;
+    memcpy(path + pos, f->prefix, prefix_len);
+    memmove(path, path + pos, len + 1 - pos);
+    pthread_mutex_lock(&f->lock);
+    if (f->count == f->cap) {
+        f->cap = f->cap == 0 ? 64 : f->cap * 2;
+        f->paths = (char **) realloc(f->paths, f->cap * sizeof(char *));
+    }
+    f->paths[f->count++] = path;
+    pthread_mutex_unlock(&f->lock);
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Operations, shared by the commands and journal replay
+
+uint32_t do_mkdir(struct extfs *fs, uint32_t dir, const char *name) {
+    uint32_t new_inode = allocate_inode(fs, MODE_DIR, dir_group(fs, dir));
+    if (new_inode == ERROR)
+        return ERROR;
+    if (dir_insert(fs, dir, name, new_inode) == ERROR) {
+        free_inode(fs, new_inode);
+        return ERROR;
+    }
+    if (LOAD(fs->img->subtrees_valid)) {
+        struct subtree empty = {0, 1, 0};
+        fs->img->subtrees[new_inode] = empty;
+    }
+    subtree_add(fs, dir, 0, 1);
+    return new_inode;
+}
+
+uint32_t do_echo(struct extfs *fs, uint32_t dir, const char *name, const char *str, uint32_t len) {
+    uint32_t new_inode = allocate_inode(fs, MODE_FILE, inode_group(fs, dir));
+    if (new_inode == ERROR)
+        return ERROR;
+    if (file_allocate(fs, new_inode, len) == ERROR || dir_insert(fs, dir, name, new_inode) == ERROR) {
+        free_inode(fs, new_inode);
+        return ERROR;
+    }
+    file_write(fs, new_inode, str, len);
+    subtree_add(fs, dir, len, 1);
+    return new_inode;
+}
+
+uint32_t do_rm(struct extfs *fs, uint32_t dir, const char *name) {
+    uint32_t chain;
+    int slot;
+    uint32_t index = dir_lookup(fs, dir, name, &chain, &slot);
+    if (index == ERROR || get_inode(fs, index)->mode != MODE_FILE || dir_remove(fs, dir, chain, slot) == ERROR)
+        return ERROR;
+    subtree_add(fs, dir, -(int64_t) get_inode(fs, index)->file_size, -1);
+    free_inode(fs, index);
+    return index;
+}
+
+// Subtree removal
+//
+// A removed subtree is walked with an explicit stack of dirs. The inodes and
+// block runs it frees are gathered into a batch and cleared from the bitmaps
+// together, with one counter update per group.
+//
+// With EXTFS_LAZY_FREE, rmdir only unlinks the subtree and queues its root on
+// orphans for the reclaim thread. Each step of the reclaim is logged, since
+// replay has to free the inodes and blocks at the same point between the
+// allocations. Saves and checkpoints free what is left first, so no image
+// written out holds an unlinked subtree.
+
+struct free_batch {
+    uint32_t *inodes;
+    uint32_t inode_count, inode_cap;
+    struct extent *runs;
+    uint32_t run_count, run_cap;
+};
+
+void dir_stack_push(struct dir_stack *s, uint32_t dir) {
+    if (s->count == s->cap) {
+        s->cap = s->cap == 0 ? 64 : s->cap * 2;
+        s->dirs = (uint32_t *) realloc(s->dirs, s->cap * sizeof(uint32_t));
+    }
+    s->dirs[s->count++] = dir;
+}
+
+void batch_add_run(struct free_batch *b, uint32_t start, uint32_t len) {
+    if (b->run_count == b->run_cap) {
+        b->run_cap = b->run_cap == 0 ? 64 : b->run_cap * 2;
+        b->runs = (struct extent *) realloc(b->runs, b->run_cap * sizeof(struct extent));
+    }
+    b->runs[b->run_count].start = start;
+    b->runs[b->run_count].len = len;
+    b->run_count++;
+}
+
+// Adds an inode and the blocks it owns.
+void batch_add_inode(struct extfs *fs, struct free_batch *b, uint32_t inode) {
+    struct inode *node = get_inode(fs, inode);
+    if (node->mode == MODE_FILE) {
+        // the inline block goes with the last file of the batch in it
+        if (node->file_flags & FILE_INLINE) {
+            uint32_t block = release_inline(fs, inode);
+            if (block != 0) {
+                batch_add_run(b, block, 1);
+            }
+        }
+        for (uint32_t k = 0; k < node->extent_count; k++) {
+            struct extent *e = file_extent(fs, inode, k);
+            batch_add_run(b, e->start, e->len);
+        }
+        if (node->extent_block != 0) {
+            batch_add_run(b, node->extent_block, 1);
+        }
+    } else {
+        batch_add_run(b, node->blocks[0], 1);
+    }
+    if (b->inode_count == b->inode_cap) {
+        b->inode_cap = b->inode_cap == 0 ? 64 : b->inode_cap * 2;
+        b->inodes = (uint32_t *) realloc(b->inodes, b->inode_cap * sizeof(uint32_t));
+    }
+    b->inodes[b->inode_count++] = inode;
+}
+
+// Adds dir with its chain, index and files, and pushes the dirs in it.
+void batch_add_dir(struct extfs *fs, struct free_batch *b, struct dir_stack *stack, uint32_t dir) {
+    if (get_inode(fs, dir)->index_inode != 0) {
+        struct index_header *h = index_header(fs, dir);
+        for (int i = 0; i < h->blocks; i++) {
+            batch_add_inode(fs, b, h->inodes[i]);
+        }
+    }
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+            struct entry *e = chain_entry(fs, chain, i);
+            if (e->type == MODE_DIR) {
+                dir_stack_push(stack, e->id);
+            } else {
+                batch_add_inode(fs, b, e->id);
+            }
+        }
+        batch_add_inode(fs, b, chain);
+    }
+}
+
+// Clears the batch from the bitmaps in one pass over it, then updates the
+// counters and marks the bitmaps dirty once per group, and empties it.
+void batch_apply(struct extfs *fs, struct free_batch *b) {
+    uint32_t groups = fs->img->fp->group_count, per_group = fs->img->fp->inodes_per_group;
+    // blocks, then inodes, freed per group
+    uint32_t *freed = (uint32_t *) calloc(2 * groups, sizeof(uint32_t));
+    for (uint32_t i = 0; i < b->run_count; i++) {
+        uint32_t start = b->runs[i].start, g = start / GROUP_BLOCKS;
+        if (fs->img->refs != NULL) {
+            // blocks a snapshot still holds stay taken
+            for (uint32_t j = start; j < start + b->runs[i].len; j++) {
+                if (--fs->img->refs[j] == 0) {
+                    clear_bit(block_bitmap(fs, g), j % GROUP_BLOCKS);
+                    mark_block_dirty(fs, j);
+                    freed[g]++;
+                }
+            }
+            continue;
+        }
+        clear_bits(block_bitmap(fs, g), start % GROUP_BLOCKS, b->runs[i].len);
+        // so that the next save punches a hole for them
+        mark_blocks_dirty(fs, start, b->runs[i].len);
+        freed[g] += b->runs[i].len;
+    }
+    for (uint32_t i = 0; i < b->inode_count; i++) {
+        uint32_t g = inode_group(fs, b->inodes[i]);
+        clear_bit(inode_bitmap(fs, g), b->inodes[i] % per_group);
+        fs->img->dcache_gen[b->inodes[i]]++;
+        freed[groups + g]++;
+    }
+    for (uint32_t g = 0; g < groups; g++) {
+        if (freed[g] != 0) {
+            fs->img->fp->free_blocks += freed[g];
+            fs->img->fp->groups[g].free_blocks += freed[g];
+            mark_dirty(fs, block_bitmap(fs, g), GROUP_BLOCKS / 8);
+        }
+        if (freed[groups + g] != 0) {
+            fs->img->fp->free_inodes += freed[groups + g];
+            fs->img->fp->groups[g].free_inodes += freed[groups + g];
+            mark_dirty(fs, inode_bitmap(fs, g), (per_group + 7) / 8);
+        }
+        if (freed[g] != 0 || freed[groups + g] != 0) {
+            mark_counters_dirty(fs, g);
+        }
+    }
+    free(freed);
+    b->run_count = 0;
+    b->inode_count = 0;
+}
+
+// Frees up to budget dirs off stack, together with their files. Returns the
+// number of dirs freed.
+uint32_t free_subtrees(struct extfs *fs, struct dir_stack *stack, uint32_t budget) {
+    struct free_batch b;
+    memset(&b, 0, sizeof(b));
+    uint32_t n = 0;
+    for (; n < budget && stack->count > 0; n++) {
+        batch_add_dir(fs, &b, stack, stack->dirs[--stack->count]);
+    }
+    batch_apply(fs, &b);
+    free(b.inodes);
+    free(b.runs);
+    return n;
+}
+
+// Unlinks inode from dir. Returns ERROR if it is not a dir in dir.
+uint32_t detach_dir(struct extfs *fs, uint32_t dir, uint32_t inode) {
+    if (get_inode(fs, inode)->mode != MODE_DIR || get_inode(fs, inode)->parent != dir || inode == ROOT_INODE)
+        return ERROR;
+    if (dir_remove(fs, dir, get_inode(fs, inode)->parent_chain, get_inode(fs, inode)->parent_slot) == ERROR)
+        return ERROR;
+    if (LOAD(fs->img->subtrees_valid)) {
+        struct subtree *t = &fs->img->subtrees[inode];
+        subtree_add(fs, dir, -(int64_t) t->bytes, -(int32_t) t->inodes);
+    }
+    return inode;
+}
+
+uint32_t do_rmdir(struct extfs *fs, uint32_t dir, uint32_t inode) {
+    if (detach_dir(fs, dir, inode) == ERROR)
+        return ERROR;
+    struct dir_stack stack = {NULL, 0, 0};
+    dir_stack_push(&stack, inode);
+    free_subtrees(fs, &stack, UINT32_MAX);
+    free(stack.dirs);
+    return inode;
+}
+
+// Unlinks the subtree and leaves freeing it to the reclaim thread.
+uint32_t do_rmdir_lazy(struct extfs *fs, uint32_t dir, uint32_t inode) {
+    if (detach_dir(fs, dir, inode) == ERROR)
+        return ERROR;
+    dir_stack_push(&fs->img->orphans, inode);
+    return inode;
+}
+
+void journal_log(struct extfs *fs, uint32_t type, uint32_t dir, uint32_t target, const char *name,
+                 const char *data, uint32_t data_len);
+
+// Frees up to budget queued dirs. Returns the number left.
+uint32_t reclaim(struct extfs *fs, uint32_t budget) {
+    uint32_t n = free_subtrees(fs, &fs->img->orphans, budget);
+    if (n > 0) {
+        journal_log(fs, JR_RECLAIM, 0, n, NULL, NULL, 0);
+    }
+    return fs->img->orphans.count;
+}
+
+// Frees the queued subtrees a step at a time, so that updates waiting for the
+// image get their turn in between.
+void *reclaim_main(void *arg) {
+    struct extfs *fs = (struct extfs *) arg;
+    int stop = 0;
+    while (!stop) {
+        begin_update(fs);
+        uint32_t left = reclaim(fs, RECLAIM_STEP);
+        end_update(fs);
+        pthread_mutex_lock(&fs->img->reclaim_lock);
+        while (left == 0 && !fs->img->reclaim_stop && !fs->img->reclaim_wanted) {
+            pthread_cond_wait(&fs->img->reclaim_cond, &fs->img->reclaim_lock);
+        }
+        fs->img->reclaim_wanted = 0;
+        stop = fs->img->reclaim_stop;
+        pthread_mutex_unlock(&fs->img->reclaim_lock);
+    }
+    return NULL;
+}
+
+void reclaim_start(struct extfs *fs) {
+    if (fs->img->lazy_free && !fs->img->reclaimer_running) {
+        fs->img->reclaim_stop = 0;
+        fs->img->reclaimer_running = pthread_create(&fs->img->reclaimer, NULL, reclaim_main, &fs->img->self) == 0;
+    }
+}
+
+void reclaim_wake(struct extfs *fs) {
+    pthread_mutex_lock(&fs->img->reclaim_lock);
+    fs->img->reclaim_wanted = 1;
+    pthread_cond_signal(&fs->img->reclaim_cond);
+    pthread_mutex_unlock(&fs->img->reclaim_lock);
+}
+
+// Stops the reclaim thread, the next save frees what it left.
+void reclaim_shutdown(struct extfs *fs) {
+    if (fs->img->reclaimer_running) {
+        pthread_mutex_lock(&fs->img->reclaim_lock);
+        fs->img->reclaim_stop = 1;
+        pthread_cond_signal(&fs->img->reclaim_cond);
+        pthread_mutex_unlock(&fs->img->reclaim_lock);
+        pthread_join(fs->img->reclaimer, NULL);
+        fs->img->reclaimer_running = 0;
+    }
+}
+
+// Defragmentation
+//
+// Removing entries leaves holes in dir chains, which only new entries fill
+// again. Defragmenting a dir moves its entries to the front of its chain,
+// frees the cont inodes left empty and rebuilds its index. Its chain blocks
+// and the blocks of each of its files are then moved into single runs where
+// the free space allows. Nothing refers to an entry by its slot but the
+// index and the parent_chain and parent_slot of dirs, so the dentry cache
+// stays valid.
+
+// Counts the entries, chain inodes and bytes taken by records of dir.
+void dir_usage(struct extfs *fs, uint32_t dir, uint32_t *entries, uint32_t *chain_len, uint32_t *used) {
+    *entries = 0;
+    *chain_len = 0;
+    *used = 0;
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        *entries += get_inode(fs, chain)->entry_count;
+        *used += BLOCK_SIZE - get_inode(fs, chain)->free_bytes;
+        (*chain_len)++;
+    }
+}
+
+// Whether less than defrag_threshold percent of the chain blocks of dir are
+// taken by records and repacking would shorten its chain.
+int dir_sparse(struct extfs *fs, uint32_t dir) {
+    uint32_t entries, chain_len, used;
+    dir_usage(fs, dir, &entries, &chain_len, &used);
+    return chain_len > 1 && (used + BLOCK_SIZE - 1) / BLOCK_SIZE < chain_len &&
+           (uint64_t) used * 100 < (uint64_t) chain_len * BLOCK_SIZE * fs->img->defrag_threshold;
+}
+
+// Moves every entry of dir to the front of its chain, keeping their order,
+// and frees the cont inodes left empty.
+void repack_dir(struct extfs *fs, uint32_t dir) {
+    uint32_t entries, chain_len, used;
+    dir_usage(fs, dir, &entries, &chain_len, &used);
+    if ((used + BLOCK_SIZE - 1) / BLOCK_SIZE >= chain_len)
+        return;
+    // records packed in order never need more blocks than they had
+    char *records = (char *) malloc(used + 1);
+    size_t len = 0;
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+            struct entry *e = chain_entry(fs, chain, i);
+            uint32_t size = record_size(e->name_len);
+            memcpy(records + len, e, size);
+            ((struct entry *) (records + len))->rec_len = size;
+            len += size;
+        }
+    }
+    rewrite_dir(fs, dir, records, len);
+    free(records);
+}
+
+// Moves the chain blocks of dir into one run, in chain order. Returns the
+// number of blocks moved.
+uint32_t cluster_dir(struct extfs *fs, uint32_t dir) {
+    uint32_t chain_len = 0, prev = ERROR;
+    int contiguous = 1;
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        uint32_t block = get_inode(fs, chain)->blocks[0];
+        if (prev != ERROR && block != prev + 1) {
+            contiguous = 0;
+        }
+        prev = block;
+        chain_len++;
+    }
+    if (contiguous)
+        return 0;
+    uint32_t len, start = allocate_blocks(fs, chain_len, inode_group(fs, dir), &len);
+    if (start == ERROR)
+        return 0;
+    if (len < chain_len) {
+        free_blocks(fs, start, len);
+        return 0;
+    }
+    uint32_t block = start;
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        uint32_t old = get_inode(fs, chain)->blocks[0];
+        memcpy(get_block(fs, block), get_block(fs, old), BLOCK_SIZE);
+        mark_block_dirty(fs, block);
+        free_blocks(fs, old, 1);
+        get_inode(fs, chain)->blocks[0] = block++;
+        mark_inode_dirty(fs, chain);
+    }
+    return chain_len;
+}
+
+// Moves the blocks of a file split over several extents into a single one,
+// unless it shares them with a snapshot, which would keep the old ones.
+// Returns the number of blocks moved.
+uint32_t cluster_file(struct extfs *fs, uint32_t inode) {
+    struct inode *node = get_inode(fs, inode);
+    if (node->extent_count < 2)
+        return 0;
+    uint32_t total = 0;
+    for (uint32_t k = 0; k < node->extent_count; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        if (fs->img->refs != NULL && fs->img->refs[e->start] > 1)
+            return 0;
+        total += e->len;
+    }
+    uint32_t len, start = allocate_blocks(fs, total, inode_group(fs, inode), &len);
+    if (start == ERROR)
+        return 0;
+    if (len < total) {
+        free_blocks(fs, start, len);
+        return 0;
+    }
+    uint32_t block = start;
+    for (uint32_t k = 0; k < node->extent_count; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        memcpy(get_blocks(fs, block, e->len), get_blocks(fs, e->start, e->len), (size_t) e->len * BLOCK_SIZE);
+        block += e->len;
+    }
+    mark_blocks_dirty(fs, start, total);
+    uint32_t size = node->file_size;
+    free_extents(fs, inode);
+    node->extent_count = 1;
+    node->extents[0].start = start;
+    node->extents[0].len = total;
+    node->file_size = size;
+    mark_inode_dirty(fs, inode);
+    return total;
+}
+
+void defrag_dir(struct extfs *fs, uint32_t dir, struct extfs_defrag_stats *st) {
+    uint32_t entries, chain_len, used;
+    dir_usage(fs, dir, &entries, &chain_len, &used);
+    st->dirs++;
+    st->chain_before += chain_len;
+    repack_dir(fs, dir);
+    st->blocks_moved += cluster_dir(fs, dir);
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+            if (chain_entry(fs, chain, i)->type == MODE_FILE) {
+                uint32_t moved = cluster_file(fs, chain_entry(fs, chain, i)->id);
+                st->files_moved += moved > 0;
+                st->blocks_moved += moved;
+            }
+        }
+    }
+    dir_usage(fs, dir, &entries, &chain_len, &used);
+    st->chain_after += chain_len;
+}
+
+// Defragments every dir of the subtree at dir, walking it with an explicit
+// stack like subtree removal.
+void defrag_tree(struct extfs *fs, uint32_t dir, struct extfs_defrag_stats *st) {
+    uint32_t before = fs->img->fp->free_blocks;
+    struct dir_stack stack = {NULL, 0, 0};
+    dir_stack_push(&stack, dir);
+    while (stack.count > 0) {
+        dir = stack.dirs[--stack.count];
+        defrag_dir(fs, dir, st);
+        for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+            for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+                if (chain_entry(fs, chain, i)->type == MODE_DIR) {
+                    dir_stack_push(&stack, chain_entry(fs, chain, i)->id);
+                }
+            }
+        }
+    }
+    free(stack.dirs);
+    st->blocks_freed += fs->img->fp->free_blocks > before ? fs->img->fp->free_blocks - before : 0;
+}
+
+// Repacks dir if defrag_threshold says so. Unlink only notes the dir, as
+// moving entries needs the image exclusive, so it may be gone by now.
+void defrag_sparse(struct extfs *fs, uint32_t dir) {
+    if (fs->img->defrag_threshold == 0 || dir >= fs->img->fp->inodes_count || !inode_used(fs, dir) ||
+        get_inode(fs, dir)->mode != MODE_DIR || !dir_sparse(fs, dir))
+        return;
+    repack_dir(fs, dir);
+    journal_log(fs, JR_DEFRAG, dir, 0, NULL, NULL, 0);
+}
+
+// Snapshots
+//
+// A snapshot copies the inode bitmaps and inode tables into blocks of its
+// own and shares everything else: while there are snapshots, refs counts the
+// trees referring to each block. Files never change once written, so only
+// the blocks of dir chains, indexes and inline files are ever copied, by the
+// first update of the live tree that would change them in place. Rolling back
+// copies the inode tables of a snapshot back and moves the references of the
+// live tree over to its blocks.
+
+struct snapshot_table *snapshot_table(struct extfs *fs) {
+    if (fs->img->fp->snapshot_table == 0)
+        return NULL;
+    return (struct snapshot_table *) get_block(fs, fs->img->fp->snapshot_table)->data;
+}
+
+// Blocks a snapshot keeps per group: the inode bitmap, then the inode table.
+uint32_t snapshot_span(struct extfs *fs) {
+    return 1 + fs->img->fp->inodes_per_group / INODES_PER_BLOCK;
+}
+
+// Block k of the copy s keeps.
+union data *snapshot_block(struct extfs *fs, const struct snapshot *s, uint32_t k) {
+    for (uint32_t r = 0; r < s->run_count; k -= s->runs[r].len, r++) {
+        if (k < s->runs[r].len)
+            return get_block(fs, s->runs[r].start + k);
+    }
+    return NULL;
+}
+
+struct snapshot *find_snapshot(struct extfs *fs, const char *name) {
+    struct snapshot_table *t = snapshot_table(fs);
+    for (uint32_t i = 0; t != NULL && i < t->count; i++) {
+        if (strcmp(t->snapshots[i].name, name) == 0)
+            return &t->snapshots[i];
+    }
+    return NULL;
+}
+
+void ref_blocks(struct extfs *fs, uint32_t start, uint32_t len, int delta) {
+    if (delta < 0) {
+        free_blocks(fs, start, len);
+        return;
+    }
+    for (uint32_t b = start; b < start + len; b++) {
+        fs->img->refs[b]++;
+    }
+}
+
+// Hands fn every run of blocks the inodes of a tree refer to: the live one if
+// s is NULL, else the one s keeps. The small files of a run of inodes share
+// one inline block, which comes once.
+void walk_tree(struct extfs *fs, const struct snapshot *s, void (*fn)(struct extfs *, uint32_t, uint32_t, void *),
+               void *arg) {
+    uint32_t per_group = fs->img->fp->inodes_per_group, span = snapshot_span(fs);
+    uint32_t groups = s == NULL ? fs->img->fp->group_count : s->groups;
+    for (uint32_t g = 0; g < groups; g++) {
+        const uint64_t *bitmap = s == NULL ? inode_bitmap(fs, g) : (const uint64_t *) snapshot_block(fs, s, g * span)->data;
+        uint32_t inline_run = ERROR;
+        for (uint32_t i = 0; i < fs->img->fp->groups[g].inodes; i++) {
+            if (!test_bit(bitmap, i))
+                continue;
+            const struct inode *node = s == NULL ? get_inode(fs, g * per_group + i) :
+                (const struct inode *) snapshot_block(fs, s, g * span + 1 + i / INODES_PER_BLOCK)->data + i % INODES_PER_BLOCK;
+            if (node->mode != MODE_FILE) {
+                fn(fs, node->blocks[0], 1, arg);
+            } else if (node->file_flags & FILE_INLINE) {
+                if (i / INLINE_PER_BLOCK != inline_run) {
+                    fn(fs, node->inline_block, 1, arg);
+                    inline_run = i / INLINE_PER_BLOCK;
+                }
+            } else {
+                for (uint32_t k = 0; k < node->extent_count; k++) {
+                    const struct extent *e = k < INLINE_EXTENTS ? &node->extents[k] :
+                        &get_block(fs, node->extent_block)->extents[k - INLINE_EXTENTS];
+                    fn(fs, e->start, e->len, arg);
+                }
+                if (node->extent_block != 0) {
+                    fn(fs, node->extent_block, 1, arg);
+                }
+            }
+        }
+    }
+}
+
+void ref_run(struct extfs *fs, uint32_t start, uint32_t len, void *arg) {
+    ref_blocks(fs, start, len, *(int *) arg);
+}
+
+// Adds delta, 1 or -1, to the references of every block of a tree.
+void ref_tree(struct extfs *fs, const struct snapshot *s, int delta) {
+    walk_tree(fs, s, ref_run, &delta);
+}
+
+// Counts the references to every block from scratch, after the image was
+// read or laid out again.
+void load_refs(struct extfs *fs) {
+    free(fs->img->refs);
+    fs->img->refs = NULL;
+    struct snapshot_table *t = snapshot_table(fs);
+    if (t == NULL)
+        return;
+    fs->img->refs = (uint8_t *) calloc(fs->img->fp->blocks_count, 1);
+    fs->img->refs[fs->img->fp->snapshot_table] = 1;
+    ref_tree(fs, NULL, 1);
+    for (uint32_t i = 0; i < t->count; i++) {
+        ref_tree(fs, &t->snapshots[i], 1);
+        for (uint32_t r = 0; r < t->snapshots[i].run_count; r++) {
+            memset(fs->img->refs + t->snapshots[i].runs[r].start, 1, t->snapshots[i].runs[r].len);
+        }
+    }
+}
+
+// Frees the snapshot table once the last snapshot is gone.
+void drop_snapshot_table(struct extfs *fs) {
+    free_blocks(fs, fs->img->fp->snapshot_table, 1);
+    fs->img->fp->snapshot_table = 0;
+    mark_dirty(fs, fs->img->fp, 64);
+    free(fs->img->refs);
+    fs->img->refs = NULL;
+}
+
+uint32_t do_snapshot(struct extfs *fs, const char *name, uint64_t taken) {
+    struct snapshot_table *t = snapshot_table(fs);
+    if (find_snapshot(fs, name) != NULL)
+        return fail(fs, EXTFS_EXISTS);
+    if (t != NULL && t->count == MAX_SNAPSHOTS)
+        return fail(fs, EXTFS_TOO_MANY_SNAPSHOTS);
+    // a snapshot of an unlinked subtree would keep it forever
+    reclaim(fs, UINT32_MAX);
+    uint32_t span = snapshot_span(fs), left = fs->img->fp->group_count * span, len;
+    if (left + (t == NULL) > fs->img->fp->free_blocks)
+        return fail(fs, EXTFS_NO_BLOCK);
+    if (fs->img->refs == NULL) {
+        fs->img->refs = (uint8_t *) calloc(fs->img->fp->blocks_count, 1);
+        ref_tree(fs, NULL, 1);
+    }
+    if (t == NULL) {
+        uint32_t block = allocate_blocks(fs, 1, 0, &len);
+        memset(get_block(fs, block), 0, BLOCK_SIZE);
+        mark_block_dirty(fs, block);
+        fs->img->fp->snapshot_table = block;
+        mark_dirty(fs, fs->img->fp, 64);
+        t = snapshot_table(fs);
+    }
+    struct snapshot s;
+    memset(&s, 0, sizeof(s));
+    while (left > 0 && s.run_count < SNAPSHOT_RUNS) {
+        s.runs[s.run_count].start = allocate_blocks(fs, left, 0, &len);
+        s.runs[s.run_count++].len = len;
+        left -= len;
+    }
+    if (left > 0) {
+        for (uint32_t r = 0; r < s.run_count; r++) {
+            free_blocks(fs, s.runs[r].start, s.runs[r].len);
+        }
+        if (t->count == 0) {
+            drop_snapshot_table(fs);
+        }
+        return fail(fs, EXTFS_NO_CONTIGUOUS);
+    }
+    for (uint32_t g = 0; g < fs->img->fp->group_count; g++) {
+        memcpy(snapshot_block(fs, &s, g * span), inode_bitmap(fs, g), BLOCK_SIZE);
+        for (uint32_t k = 1; k < span; k++) {
+            memcpy(snapshot_block(fs, &s, g * span + k), get_block(fs, fs->img->fp->groups[g].inode_table + k - 1), BLOCK_SIZE);
+        }
+    }
+    for (uint32_t r = 0; r < s.run_count; r++) {
+        mark_blocks_dirty(fs, s.runs[r].start, s.runs[r].len);
+    }
+    ref_tree(fs, NULL, 1);
+    strcpy(s.name, name);
+    s.time = taken;
+    s.groups = fs->img->fp->group_count;
+    t->snapshots[t->count++] = s;
+    mark_block_dirty(fs, fs->img->fp->snapshot_table);
+    return 0;
+}
+
+// Replaces the live tree with the one the snapshot called name keeps, which
+// stays around.
+uint32_t do_rollback(struct extfs *fs, const char *name) {
+    struct snapshot *s = find_snapshot(fs, name);
+    if (s == NULL)
+        return fail(fs, EXTFS_NOT_FOUND);
+    reclaim(fs, UINT32_MAX);
+    ref_tree(fs, NULL, -1);
+    uint32_t span = snapshot_span(fs), free_inodes = 0;
+    for (uint32_t g = 0; g < fs->img->fp->group_count; g++) {
+        struct group_desc *gd = &fs->img->fp->groups[g];
+        if (g < s->groups) {
+            memcpy(inode_bitmap(fs, g), snapshot_block(fs, s, g * span), BLOCK_SIZE);
+            for (uint32_t k = 1; k < span; k++) {
+                memcpy(get_block(fs, gd->inode_table + k - 1), snapshot_block(fs, s, g * span + k), BLOCK_SIZE);
+            }
+            mark_blocks_dirty(fs, gd->inode_table, span - 1);
+        } else {
+            // groups added since hold no inodes in it
+            clear_bits(inode_bitmap(fs, g), 0, gd->inodes);
+        }
+        mark_block_dirty(fs, gd->inode_bitmap);
+        gd->free_inodes = count_zero_bits(inode_bitmap(fs, g), fs->img->fp->inodes_per_group);
+        free_inodes += gd->free_inodes;
+        mark_counters_dirty(fs, g);
+    }
+    fs->img->fp->free_inodes = free_inodes;
+    ref_tree(fs, NULL, 1);
+    dcache_clear(fs);
+    drop_subtrees(fs);
+    reset_cwds(fs);
+    return 0;
+}
+
+uint32_t do_drop_snapshot(struct extfs *fs, const char *name) {
+    struct snapshot *s = find_snapshot(fs, name);
+    if (s == NULL)
+        return fail(fs, EXTFS_NOT_FOUND);
+    ref_tree(fs, s, -1);
+    for (uint32_t r = 0; r < s->run_count; r++) {
+        free_blocks(fs, s->runs[r].start, s->runs[r].len);
+    }
+    struct snapshot_table *t = snapshot_table(fs);
+    memmove(s, s + 1, (t->snapshots + t->count - (s + 1)) * sizeof(struct snapshot));
+    t->count--;
+    mark_block_dirty(fs, fs->img->fp->snapshot_table);
+    if (t->count == 0) {
+        drop_snapshot_table(fs);
+    }
+    return 0;
+}
+
+// Consistency check
+//
+// fsck walks the tree from the root, and from the subtrees rmdir left to the
+// reclaim thread, claiming every inode and block it reaches in bitmaps of its
+// own. A claim that finds its bit set means two owners: a chain that loops
+// back, or blocks two files share. Worker threads take dirs off a shared
+// stack, so the walk of a large tree spreads over the cores. Whatever claims
+// first keeps the inode or block, so which of two owners of a damaged image
+// loses may differ from run to run. A dir entry only claims its dir if the
+// parent of the dir points back at it; dirs no such entry reached are
+// adopted by their other entries once the walk is done. The claims, with
+// the blocks of the snapshots, are then compared with the bitmaps and
+// counters of the image.
+//
+// Repair writes the claims as the bitmaps, which frees everything nothing
+// reaches, then cuts broken chains, drops the entries that point at nothing
+// sound and rewrites their dirs. A dropped entry leaves its inode unreached,
+// so passes are repeated until one finds nothing to fix. Repairs are not
+// journaled, the image is saved right after them.
+
+// A problem fsck found, and what repair does about it.
+struct fsck_issue {
+    uint64_t key; // dir in the upper half and the order within it, dirs before groups
+    int fix;
+    uint32_t dir, chain, slot, target;
+    char text[MAX_FILENAME + 96];
+};
+
+// the entry at chain and slot of dir, which points at inode
+struct fsck_ref {
+    uint32_t inode, block;
+    uint32_t dir, chain, slot;
+};
+
+struct fsck_refs {
+    struct fsck_ref *refs;
+    uint32_t count, cap;
+};
+
+struct fsck;
+
+struct fsck_worker {
+    struct fsck *ck;
+    pthread_t thread;
+    struct fsck_issue *issues;
+    uint32_t issue_count, issue_cap, seq;
+    struct fsck_refs inlines; // small files, checked against the others of their run after the walk
+    struct fsck_refs moved;   // entries of dirs whose parent points elsewhere
+    struct dir_stack found;   // dirs the entries of the current dir claimed
+    // the chain inodes of the current dir, each with a bit per used record
+    // and a bit per record its index points at
+    uint32_t *chains;
+    uint64_t *starts, *indexed;
+    uint32_t chain_cap;
+    uint32_t *chain_pos; // per inode, 1 + its position in chains
+    uint32_t dirs, files;
+    uint32_t first_block, end_block, bad_blocks, first_bad; // checksums
+};
+
+struct fsck {
+    struct extfs *fs;
+    uint64_t *inodes, *blocks; // claims
+    pthread_mutex_t lock; // guards queue and busy
+    pthread_cond_t cond;
+    struct dir_stack queue;
+    uint32_t busy; // workers checking a dir
+    uint32_t thread_count;
+    int broken; // the root is, so nothing can be checked or repaired
+    struct fsck_worker workers[FSCK_THREADS];
+};
+
+void fsck_note(struct fsck_worker *w, uint32_t dir, int fix, uint32_t chain, uint32_t slot, uint32_t target,
+               const char *format, ...) {
+    if (w->issue_count == w->issue_cap) {
+        w->issue_cap = w->issue_cap == 0 ? 16 : w->issue_cap * 2;
+        w->issues = (struct fsck_issue *) realloc(w->issues, w->issue_cap * sizeof(struct fsck_issue));
+    }
+    struct fsck_issue *i = &w->issues[w->issue_count++];
+    i->key = (uint64_t) dir << 32 | w->seq++;
+    i->fix = fix;
+    i->dir = dir;
+    i->chain = chain;
+    i->slot = slot;
+    i->target = target;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(i->text, sizeof(i->text), format, args);
+    va_end(args);
+}
+
+void fsck_ref_add(struct fsck_refs *r, uint32_t inode, uint32_t block, uint32_t dir, uint32_t chain, uint32_t slot) {
+    if (r->count == r->cap) {
+        r->cap = r->cap == 0 ? 64 : r->cap * 2;
+        r->refs = (struct fsck_ref *) realloc(r->refs, r->cap * sizeof(struct fsck_ref));
+    }
+    struct fsck_ref ref = {inode, block, dir, chain, slot};
+    r->refs[r->count++] = ref;
+}
+
+int compare_refs(const void *a, const void *b) {
+    const struct fsck_ref *x = (const struct fsck_ref *) a, *y = (const struct fsck_ref *) b;
+    if (x->inode != y->inode)
+        return x->inode < y->inode ? -1 : 1;
+    if (x->dir != y->dir)
+        return x->dir < y->dir ? -1 : 1;
+    if (x->chain != y->chain)
+        return x->chain < y->chain ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+// Moves the small files, or else the moved dirs, of every worker into one
+// list in inode order.
+struct fsck_refs fsck_gather(struct fsck *ck, int inlines) {
+    struct fsck_refs all = {NULL, 0, 0};
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        struct fsck_refs *r = inlines ? &ck->workers[t].inlines : &ck->workers[t].moved;
+        for (uint32_t i = 0; i < r->count; i++) {
+            struct fsck_ref *ref = &r->refs[i];
+            fsck_ref_add(&all, ref->inode, ref->block, ref->dir, ref->chain, ref->slot);
+        }
+        r->count = 0;
+    }
+    if (all.count > 0) {
+        qsort(all.refs, all.count, sizeof(struct fsck_ref), compare_refs);
+    }
+    return all;
+}
+
+// Sets bit i of a claim bitmap. Returns 1 if something claimed it before.
+int claim(uint64_t *bitmap, uint32_t i) {
+    uint64_t bit = 1ULL << (i % 64);
+    return (__atomic_fetch_or(&bitmap[i / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+int claim_run(uint64_t *bitmap, uint32_t start, uint32_t len) {
+    int seen = 0;
+    for (uint32_t b = start; b < start + len; b++) {
+        seen |= claim(bitmap, b);
+    }
+    return seen;
+}
+
+// Whether inode is a chain inode of the given mode, with its block in the
+// image.
+int sound_chain(struct extfs *fs, uint32_t inode, int mode) {
+    return inode < fs->img->fp->inodes_count && get_inode(fs, inode)->mode == mode &&
+           get_inode(fs, inode)->blocks[0] < fs->img->fp->blocks_count;
+}
+
+// Parses the records of the block of chain, setting the bit of each used one
+// in starts, and stores their count, the bytes they take and the largest
+// record that still fits. Returns the offset of the first broken record,
+// BLOCK_SIZE if there is none.
+uint32_t fsck_records(struct extfs *fs, uint32_t chain, uint64_t *starts, uint32_t *entries, uint32_t *used,
+                      uint32_t *max_free) {
+    char *data = get_block(fs, get_inode(fs, chain)->blocks[0])->data;
+    uint32_t off = 0;
+    *entries = 0;
+    *used = 0;
+    *max_free = 0;
+    while (off < BLOCK_SIZE) {
+        struct entry *e = (struct entry *) (data + off);
+        if (off + offsetof(struct entry, name) > BLOCK_SIZE || e->rec_len < offsetof(struct entry, name) ||
+            e->rec_len % RECORD_ALIGN != 0 || off + e->rec_len > BLOCK_SIZE)
+            break;
+        uint32_t size = 0;
+        if (e->type != 0) {
+            size = record_size(e->name_len);
+            if (e->name_len == 0 || size > e->rec_len || e->name[e->name_len] != '\0' ||
+                memchr(e->name, '\0', e->name_len) != NULL)
+                break;
+            set_bit(starts, off / RECORD_ALIGN);
+            (*entries)++;
+            *used += size;
+        }
+        if (e->rec_len - size > *max_free) {
+            *max_free = e->rec_len - size;
+        }
+        off += e->rec_len;
+    }
+    return off;
+}
+
+// Checks the blocks of a file and claims them. Returns what is wrong with
+// it, NULL if nothing is.
+const char *fsck_file(struct fsck_worker *w, uint32_t dir, uint32_t chain, uint32_t slot, uint32_t inode) {
+    struct extfs *fs = w->ck->fs;
+    struct inode *node = get_inode(fs, inode);
+    uint32_t blocks = fs->img->fp->blocks_count;
+    if (node->file_flags & FILE_INLINE) {
+        if (node->file_flags != FILE_INLINE || node->file_size == 0 || node->file_size > INLINE_DATA_SIZE ||
+            node->inline_block == 0 || node->inline_block >= blocks)
+            return "is a broken small file";
+        fsck_ref_add(&w->inlines, inode, node->inline_block, dir, chain, slot);
+        return NULL;
+    }
+    if (node->file_flags != 0 || node->extent_count > MAX_EXTENTS || node->extent_block >= blocks ||
+        (node->extent_count > INLINE_EXTENTS && node->extent_block == 0))
+        return "has broken extents";
+    uint64_t total = 0;
+    for (uint32_t k = 0; k < node->extent_count; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        if (e->start == 0 || e->len == 0 || e->start >= blocks || e->len > blocks - e->start)
+            return "has an extent past the end of the image";
+        total += e->len;
+    }
+    if (total != ((uint64_t) node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+        return "has extents that do not match its size";
+    int shared = node->extent_block != 0 && claim(w->ck->blocks, node->extent_block);
+    for (uint32_t k = 0; k < node->extent_count; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        shared |= claim_run(w->ck->blocks, e->start, e->len);
+    }
+    return shared ? "shares blocks with another file" : NULL;
+}
+
+void fsck_entry(struct fsck_worker *w, uint32_t dir, uint32_t chain, uint32_t slot) {
+    struct fsck *ck = w->ck;
+    struct extfs *fs = ck->fs;
+    struct entry *e = chain_entry(fs, chain, slot);
+    uint32_t id = e->id;
+    if (id == ROOT_INODE || id >= fs->img->fp->inodes_count || (e->type != MODE_DIR && e->type != MODE_FILE) ||
+        get_inode(fs, id)->mode != e->type) {
+        fsck_note(w, dir, FIX_DROP, chain, slot, 0, "Dir %u: entry %s points at inode %u, which is no such %s", dir,
+                  e->name, id, e->type == MODE_DIR ? "dir" : "file");
+        return;
+    }
+    struct inode *node = get_inode(fs, id);
+    if (e->type == MODE_FILE) {
+        const char *problem = claim(ck->inodes, id) ? "is linked elsewhere too" : fsck_file(w, dir, chain, slot, id);
+        if (problem != NULL) {
+            fsck_note(w, dir, FIX_DROP, chain, slot, 0, "Dir %u: file %s (inode %u) %s", dir, e->name, id, problem);
+        } else {
+            w->files++;
+        }
+    } else if (node->blocks[0] >= fs->img->fp->blocks_count) {
+        fsck_note(w, dir, FIX_DROP, chain, slot, 0, "Dir %u: dir %s (inode %u) has its block past the end of the image",
+                  dir, e->name, id);
+    } else if (node->parent != dir || node->parent_chain != chain || node->parent_slot != slot) {
+        fsck_ref_add(&w->moved, id, 0, dir, chain, slot);
+    } else if (claim(ck->inodes, id) || claim(ck->blocks, node->blocks[0])) {
+        fsck_note(w, dir, FIX_DROP, chain, slot, 0, "Dir %u: dir %s (inode %u) is used elsewhere too", dir, e->name, id);
+    } else {
+        dir_stack_push(&w->found, id);
+    }
+}
+
+// Checks the index of dir against its chain, of count inodes. Returns what
+// is wrong with it, NULL if nothing is.
+const char *fsck_index(struct fsck_worker *w, uint32_t dir, uint32_t count, uint32_t entries, uint32_t room) {
+    struct extfs *fs = w->ck->fs;
+    uint32_t idx = get_inode(fs, dir)->index_inode, inodes = fs->img->fp->inodes_count;
+    if (idx >= inodes || get_inode(fs, idx)->mode != MODE_INDEX ||
+        get_inode(fs, idx)->blocks[0] >= fs->img->fp->blocks_count)
+        return "points at no index inode";
+    struct index_header *h = index_header(fs, dir);
+    if (h->blocks == 0 || h->blocks > MAX_INDEX_BLOCKS || h->inodes[0] != idx)
+        return "has a broken header";
+    for (uint32_t i = 0; i < h->blocks; i++) {
+        uint32_t inode = h->inodes[i];
+        if (inode >= inodes || get_inode(fs, inode)->mode != MODE_INDEX ||
+            get_inode(fs, inode)->blocks[0] >= fs->img->fp->blocks_count)
+            return "has a block that is no index inode";
+        if (claim(w->ck->inodes, inode) || claim(w->ck->blocks, get_inode(fs, inode)->blocks[0]))
+            return "shares an inode or block with something else";
+    }
+    if (h->tail != w->chains[count - 1] || h->room < room)
+        return "does not match the chain";
+    uint32_t size = index_size(h), used = 0, live = 0;
+    for (uint32_t k = 0; k < size; k++) {
+        struct index_entry *e = index_slot(fs, h, k);
+        if (e->state == INDEX_EMPTY)
+            continue;
+        used++;
+        if (e->state == INDEX_DELETED)
+            continue;
+        uint32_t pos = e->chain < inodes ? w->chain_pos[e->chain] : 0;
+        if (e->state != INDEX_LIVE || pos == 0 || !test_bit(w->starts + (pos - 1) * SLOT_WORDS, e->slot) ||
+            e->hash != name_hash(chain_entry(fs, e->chain, e->slot)->name))
+            return "has an entry that matches no record";
+        if (test_bit(w->indexed + (pos - 1) * SLOT_WORDS, e->slot))
+            return "has two entries for one record";
+        set_bit(w->indexed + (pos - 1) * SLOT_WORDS, e->slot);
+        live++;
+    }
+    if (live != entries || live != h->live || used != h->used || used >= size)
+        return "has counts that are off";
+    return NULL;
+}
+
+// Checks the chain, entries and index of dir, which is claimed.
+void fsck_dir(struct fsck_worker *w, uint32_t dir) {
+    struct fsck *ck = w->ck;
+    struct extfs *fs = ck->fs;
+    uint32_t count = 0, prev = INVALID_INODE, entries = 0, room = 0;
+    w->seq = 0;
+    w->dirs++;
+    for (uint32_t chain = dir; chain != INVALID_INODE; prev = chain, chain = get_inode(fs, chain)->next_inode) {
+        if (chain != dir) {
+            if (!sound_chain(fs, chain, MODE_CONT)) {
+                fsck_note(w, dir, FIX_CUT, prev, 0, 0, "Dir %u: chain inode %u after %u is no cont inode", dir, chain,
+                          prev);
+                break;
+            }
+            if (w->chain_pos[chain] != 0) {
+                fsck_note(w, dir, FIX_CUT, prev, 0, 0, "Dir %u: the chain loops back from inode %u to %u", dir, prev,
+                          chain);
+                break;
+            }
+            if (claim(ck->inodes, chain) || claim(ck->blocks, get_inode(fs, chain)->blocks[0])) {
+                fsck_note(w, dir, FIX_CUT, prev, 0, 0, "Dir %u: chain inode %u after %u is used elsewhere too", dir,
+                          chain, prev);
+                break;
+            }
+        }
+        if (count == w->chain_cap) {
+            w->chain_cap = w->chain_cap == 0 ? 16 : w->chain_cap * 2;
+            w->chains = (uint32_t *) realloc(w->chains, w->chain_cap * sizeof(uint32_t));
+            w->starts = (uint64_t *) realloc(w->starts, w->chain_cap * SLOT_WORDS * sizeof(uint64_t));
+            w->indexed = (uint64_t *) realloc(w->indexed, w->chain_cap * SLOT_WORDS * sizeof(uint64_t));
+        }
+        uint64_t *starts = w->starts + count * SLOT_WORDS;
+        memset(starts, 0, SLOT_WORDS * sizeof(uint64_t));
+        memset(w->indexed + count * SLOT_WORDS, 0, SLOT_WORDS * sizeof(uint64_t));
+        uint32_t n, used, max_free;
+        uint32_t end = fsck_records(fs, chain, starts, &n, &used, &max_free);
+        struct inode *node = get_inode(fs, chain);
+        if (end < BLOCK_SIZE) {
+            fsck_note(w, dir, FIX_COUNTS, chain, 0, 0, "Dir %u: the records of chain inode %u break off at byte %u",
+                      dir, chain, end);
+        } else if (node->entry_count != n || node->free_bytes != BLOCK_SIZE - used || node->max_free != max_free) {
+            fsck_note(w, dir, FIX_COUNTS, chain, 0, 0, "Dir %u: the counts of chain inode %u are off", dir, chain);
+        }
+        w->chains[count++] = chain;
+        w->chain_pos[chain] = count;
+        entries += n;
+        room = max_free > room ? max_free : room;
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        for (uint32_t slot = 0; slot < BLOCK_SIZE / RECORD_ALIGN; slot++) {
+            if (test_bit(w->starts + k * SLOT_WORDS, slot)) {
+                fsck_entry(w, dir, w->chains[k], slot);
+            }
+        }
+    }
+    if (get_inode(fs, dir)->index_inode != 0) {
+        const char *problem = fsck_index(w, dir, count, entries, room);
+        if (problem != NULL) {
+            fsck_note(w, dir, FIX_INDEX, 0, 0, 0, "Dir %u: the index %s", dir, problem);
+        }
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        w->chain_pos[w->chains[k]] = 0;
+    }
+    if (w->found.count > 0) {
+        pthread_mutex_lock(&ck->lock);
+        for (uint32_t i = 0; i < w->found.count; i++) {
+            dir_stack_push(&ck->queue, w->found.dirs[i]);
+        }
+        pthread_cond_broadcast(&ck->cond);
+        pthread_mutex_unlock(&ck->lock);
+        w->found.count = 0;
+    }
+}
+
+// Checks dirs off the queue until it is empty and no other worker can add to
+// it.
+void *fsck_main(void *arg) {
+    struct fsck_worker *w = (struct fsck_worker *) arg;
+    struct fsck *ck = w->ck;
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        while (ck->queue.count == 0 && ck->busy > 0) {
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        }
+        if (ck->queue.count == 0)
+            break;
+        uint32_t dir = ck->queue.dirs[--ck->queue.count];
+        ck->busy++;
+        pthread_mutex_unlock(&ck->lock);
+        fsck_dir(w, dir);
+        pthread_mutex_lock(&ck->lock);
+        if (--ck->busy == 0 && ck->queue.count == 0) {
+            pthread_cond_broadcast(&ck->cond);
+        }
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+// Checks the blocks of the range of the worker against their checksums,
+// leaving out the dirty ones, whose checksums are only brought up to date
+// when they are saved.
+void *fsck_sums_main(void *arg) {
+    struct fsck_worker *w = (struct fsck_worker *) arg;
+    struct extfs *fs = w->ck->fs;
+    for (uint32_t b = w->first_block; b < w->end_block; b++) {
+        uint32_t sum = stored_sum(fs->img->fp, b);
+        if (sum == 0 || test_bit(fs->img->dirty_chunks, b))
+            continue;
+        if (block_sum(fs, b) != sum && w->bad_blocks++ == 0) {
+            w->first_bad = b;
+        }
+    }
+    return NULL;
+}
+
+// Runs fn on every worker, the first one on the calling thread.
+void fsck_run(struct fsck *ck, void *(*fn)(void *)) {
+    int started[FSCK_THREADS] = {0};
+    for (uint32_t t = 1; t < ck->thread_count; t++) {
+        started[t] = pthread_create(&ck->workers[t].thread, NULL, fn, &ck->workers[t]) == 0;
+        if (!started[t]) {
+            fn(&ck->workers[t]);
+        }
+    }
+    fn(&ck->workers[0]);
+    for (uint32_t t = 1; t < ck->thread_count; t++) {
+        if (started[t]) {
+            pthread_join(ck->workers[t].thread, NULL);
+        }
+    }
+}
+
+// Settles the entries of dirs whose parent points elsewhere, once the walk
+// is done: the first entry of a dir nothing claimed yet adopts it, the others
+// are dropped.
+void fsck_moved(struct fsck *ck) {
+    struct extfs *fs = ck->fs;
+    struct fsck_worker *w = &ck->workers[0];
+    struct fsck_refs moved = fsck_gather(ck, 0);
+    for (uint32_t i = 0; i < moved.count; i++) {
+        struct fsck_ref *r = &moved.refs[i];
+        const char *name = chain_entry(fs, r->chain, r->slot)->name;
+        w->seq = UINT16_MAX + i;
+        if (claim(ck->inodes, r->inode) || claim(ck->blocks, get_inode(fs, r->inode)->blocks[0])) {
+            fsck_note(w, r->dir, FIX_DROP, r->chain, r->slot, 0, "Dir %u: dir %s (inode %u) is used elsewhere too",
+                      r->dir, name, r->inode);
+        } else {
+            fsck_note(w, r->dir, FIX_PARENT, r->chain, r->slot, r->inode,
+                      "Dir %u: dir %s (inode %u) has its parent pointing elsewhere", r->dir, name, r->inode);
+            dir_stack_push(&ck->queue, r->inode);
+        }
+    }
+    free(moved.refs);
+}
+
+// Checks that the small files of each run of inodes share one inline block,
+// as inline_block expects, and claims it.
+void fsck_inlines(struct fsck *ck) {
+    struct extfs *fs = ck->fs;
+    struct fsck_worker *w = &ck->workers[0];
+    struct fsck_refs inlines = fsck_gather(ck, 1);
+    for (uint32_t i = 0, j; i < inlines.count; i = j) {
+        uint32_t block = inlines.refs[i].block, run = inlines.refs[i].inode / INLINE_PER_BLOCK;
+        int shared = claim(ck->blocks, block);
+        for (j = i; j < inlines.count && inlines.refs[j].inode / INLINE_PER_BLOCK == run; j++) {
+            struct fsck_ref *r = &inlines.refs[j];
+            const char *name = chain_entry(fs, r->chain, r->slot)->name;
+            w->seq = 2 * UINT16_MAX + j;
+            if (r->block != block) {
+                fsck_note(w, r->dir, FIX_DROP, r->chain, r->slot, 0,
+                          "Dir %u: small file %s (inode %u) is not in the inline block of its run", r->dir, name,
+                          r->inode);
+            } else if (shared) {
+                fsck_note(w, r->dir, FIX_DROP, r->chain, r->slot, 0,
+                          "Dir %u: small file %s (inode %u) shares its block with something else", r->dir, name,
+                          r->inode);
+            }
+        }
+    }
+    free(inlines.refs);
+}
+
+void claim_snapshot_run(struct extfs *fs, uint32_t start, uint32_t len, void *arg) {
+    struct fsck *ck = (struct fsck *) arg;
+    if (start < fs->img->fp->blocks_count && len <= fs->img->fp->blocks_count - start) {
+        claim_run(ck->blocks, start, len);
+    }
+}
+
+int block_metadata(struct extfs *fs, uint32_t block);
+
+// Claims what nothing in the tree refers to but is in use all the same: the
+// metadata and checksums, the blocks past the end of the last group, the
+// inodes past MAX_INODE and the blocks of the snapshots.
+void fsck_claim_fixed(struct fsck *ck) {
+    struct extfs *fs = ck->fs;
+    struct super_block *sb = fs->img->fp;
+    for (uint32_t b = 0; b < sb->group_count * GROUP_BLOCKS; b++) {
+        if (b >= sb->blocks_count || block_metadata(fs, b)) {
+            claim(ck->blocks, b);
+        }
+    }
+    for (uint32_t g = 0; g < sb->group_count; g++) {
+        for (uint32_t i = sb->groups[g].inodes; i < sb->inodes_per_group; i++) {
+            claim(ck->inodes, g * sb->inodes_per_group + i);
+        }
+    }
+    struct snapshot_table *t = snapshot_table(fs);
+    if (t == NULL)
+        return;
+    claim(ck->blocks, sb->snapshot_table);
+    for (uint32_t i = 0; i < t->count && i < MAX_SNAPSHOTS; i++) {
+        for (uint32_t r = 0; r < t->snapshots[i].run_count && r < SNAPSHOT_RUNS; r++) {
+            claim_snapshot_run(fs, t->snapshots[i].runs[r].start, t->snapshots[i].runs[r].len, ck);
+        }
+    }
+}
+
+// Claims the blocks the trees of the snapshots refer to, which the live tree
+// may share.
+void fsck_claim_snapshots(struct fsck *ck) {
+    struct snapshot_table *t = snapshot_table(ck->fs);
+    for (uint32_t i = 0; t != NULL && i < t->count && i < MAX_SNAPSHOTS; i++) {
+        walk_tree(ck->fs, &t->snapshots[i], claim_snapshot_run, ck);
+    }
+}
+
+// Compares the claims with the bitmaps and counters of every group.
+void fsck_bitmaps(struct fsck *ck) {
+    struct extfs *fs = ck->fs;
+    struct super_block *sb = fs->img->fp;
+    struct fsck_worker *w = &ck->workers[0];
+    uint32_t per_group = sb->inodes_per_group, free_blocks = 0, free_inodes = 0;
+    w->seq = 0;
+    for (uint32_t g = 0; g < sb->group_count; g++) {
+        uint64_t *blocks = ck->blocks + g * GROUP_BLOCKS / 64, *inodes = ck->inodes + g * per_group / 64;
+        uint32_t lost[2] = {0, 0}, unmarked[2] = {0, 0};
+        for (uint32_t i = 0; i < GROUP_BLOCKS; i++) {
+            lost[0] += test_bit(block_bitmap(fs, g), i) && !test_bit(blocks, i);
+            unmarked[0] += !test_bit(block_bitmap(fs, g), i) && test_bit(blocks, i);
+        }
+        for (uint32_t i = 0; i < per_group; i++) {
+            lost[1] += test_bit(inode_bitmap(fs, g), i) && !test_bit(inodes, i);
+            unmarked[1] += !test_bit(inode_bitmap(fs, g), i) && test_bit(inodes, i);
+        }
+        uint32_t dir = MAX_INODE + 1 + g;
+        if (lost[0] + lost[1] > 0) {
+            fsck_note(w, dir, FIX_BITMAPS, 0, 0, 0, "Group %u: %u blocks and %u inodes are marked used but unreached",
+                      g, lost[0], lost[1]);
+        }
+        if (unmarked[0] + unmarked[1] > 0) {
+            fsck_note(w, dir, FIX_BITMAPS, 0, 0, 0, "Group %u: %u blocks and %u inodes in use are marked free", g,
+                      unmarked[0], unmarked[1]);
+        }
+        uint32_t blocks_left = count_zero_bits(blocks, GROUP_BLOCKS), inodes_left = count_zero_bits(inodes, per_group);
+        if (sb->groups[g].free_blocks != blocks_left || sb->groups[g].free_inodes != inodes_left) {
+            fsck_note(w, dir, FIX_BITMAPS, 0, 0, 0, "Group %u: counts %u free blocks and %u free inodes, not %u and %u",
+                      g, sb->groups[g].free_blocks, sb->groups[g].free_inodes, blocks_left, inodes_left);
+        }
+        free_blocks += blocks_left;
+        free_inodes += inodes_left;
+    }
+    if (sb->free_blocks != free_blocks || sb->free_inodes != free_inodes) {
+        fsck_note(w, MAX_INODE + 1 + MAX_GROUPS, FIX_BITMAPS, 0, 0, 0,
+                  "The super block counts %u free blocks and %u free inodes, not %u and %u", sb->free_blocks,
+                  sb->free_inodes, free_blocks, free_inodes);
+    }
+}
+
+void fsck_sums(struct fsck *ck) {
+    struct extfs *fs = ck->fs;
+    uint32_t blocks = fs->img->fp->blocks_count, per_thread = (blocks + ck->thread_count - 1) / ck->thread_count;
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        ck->workers[t].first_block = t * per_thread < blocks ? t * per_thread : blocks;
+        ck->workers[t].end_block = (t + 1) * per_thread < blocks ? (t + 1) * per_thread : blocks;
+        ck->workers[t].bad_blocks = 0;
+    }
+    fsck_run(ck, fsck_sums_main);
+    uint32_t bad = 0, first = 0;
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        if (bad == 0) {
+            first = ck->workers[t].first_bad;
+        }
+        bad += ck->workers[t].bad_blocks;
+    }
+    if (bad > 0) {
+        ck->workers[0].seq = 0;
+        fsck_note(&ck->workers[0], MAX_INODE + 2 + MAX_GROUPS, FIX_NONE, 0, 0, 0,
+                  "%u blocks fail their checksums, the first is block %u", bad, first);
+    }
+}
+
+// Walks the whole image once, leaving the problems in the issues of the
+// workers.
+void fsck_pass(struct fsck *ck) {
+    struct extfs *fs = ck->fs;
+    struct super_block *sb = fs->img->fp;
+    memset(ck->inodes, 0, (sb->group_count * sb->inodes_per_group + 63) / 64 * sizeof(uint64_t));
+    memset(ck->blocks, 0, sb->group_count * GROUP_BLOCKS / 64 * sizeof(uint64_t));
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        ck->workers[t].issue_count = 0;
+        ck->workers[t].dirs = 0;
+        ck->workers[t].files = 0;
+    }
+    ck->broken = 0;
+    fsck_claim_fixed(ck);
+    if (!sound_chain(fs, ROOT_INODE, MODE_DIR) || claim(ck->blocks, get_inode(fs, ROOT_INODE)->blocks[0])) {
+        ck->workers[0].seq = 0;
+        fsck_note(&ck->workers[0], ROOT_INODE, FIX_NONE, 0, 0, 0, "The root dir is broken");
+        ck->broken = 1;
+        return;
+    }
+    claim(ck->inodes, ROOT_INODE);
+    dir_stack_push(&ck->queue, ROOT_INODE);
+    struct dir_stack *orphans = &fs->img->orphans;
+    for (uint32_t i = 0; i < orphans->count; i++) {
+        uint32_t dir = orphans->dirs[i];
+        if (sound_chain(fs, dir, MODE_DIR) && !claim(ck->inodes, dir) && !claim(ck->blocks, get_inode(fs, dir)->blocks[0])) {
+            dir_stack_push(&ck->queue, dir);
+        }
+    }
+    while (ck->queue.count > 0) {
+        fsck_run(ck, fsck_main);
+        fsck_moved(ck);
+    }
+    fsck_inlines(ck);
+    fsck_claim_snapshots(ck);
+    fsck_bitmaps(ck);
+    fsck_sums(ck);
+}
+
+int compare_issues(const void *a, const void *b) {
+    uint64_t x = ((const struct fsck_issue *) a)->key, y = ((const struct fsck_issue *) b)->key;
+    return x < y ? -1 : x > y;
+}
+
+// Moves the issues of every worker into one list in key order.
+struct fsck_issue *fsck_issues(struct fsck *ck, uint32_t *count) {
+    *count = 0;
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        *count += ck->workers[t].issue_count;
+    }
+    struct fsck_issue *all = (struct fsck_issue *) malloc((*count + 1) * sizeof(struct fsck_issue)), *p = all;
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        memcpy(p, ck->workers[t].issues, ck->workers[t].issue_count * sizeof(struct fsck_issue));
+        p += ck->workers[t].issue_count;
+    }
+    qsort(all, *count, sizeof(struct fsck_issue), compare_issues);
+    return all;
+}
+
+// Lays out the sound records of dir again, leaving out the count dropped
+// ones.
+void fsck_rewrite(struct extfs *fs, uint32_t dir, const struct fsck_issue *drops, uint32_t count) {
+    char *records = NULL;
+    size_t len = 0, cap = 0;
+    for (uint32_t chain = dir; chain != INVALID_INODE; chain = get_inode(fs, chain)->next_inode) {
+        uint64_t starts[SLOT_WORDS] = {0};
+        uint32_t entries, used, max_free;
+        fsck_records(fs, chain, starts, &entries, &used, &max_free);
+        for (uint32_t slot = 0; slot < BLOCK_SIZE / RECORD_ALIGN; slot++) {
+            int dropped = !test_bit(starts, slot);
+            for (uint32_t i = 0; i < count && !dropped; i++) {
+                dropped = drops[i].fix == FIX_DROP && drops[i].chain == chain && drops[i].slot == slot;
+            }
+            if (dropped)
+                continue;
+            struct entry *e = chain_entry(fs, chain, slot);
+            uint32_t size = record_size(e->name_len);
+            if (len + size > cap) {
+                cap = cap == 0 ? BLOCK_SIZE : cap * 2;
+                records = (char *) realloc(records, cap);
+            }
+            memcpy(records + len, e, size);
+            ((struct entry *) (records + len))->rec_len = size;
+            len += size;
+        }
+    }
+    rewrite_dir(fs, dir, records, len);
+    free(records);
+}
+
+// Writes the claims as the bitmaps, with the counters to match, then applies
+// the fixes of the issues, which are in key order.
+void fsck_repair(struct fsck *ck, const struct fsck_issue *issues, uint32_t count) {
+    struct extfs *fs = ck->fs;
+    struct super_block *sb = fs->img->fp;
+    uint32_t per_group = sb->inodes_per_group;
+    sb->free_blocks = 0;
+    sb->free_inodes = 0;
+    for (uint32_t g = 0; g < sb->group_count; g++) {
+        uint64_t *blocks = ck->blocks + g * GROUP_BLOCKS / 64, *inodes = ck->inodes + g * per_group / 64;
+        if (memcmp(block_bitmap(fs, g), blocks, GROUP_BLOCKS / 8) != 0) {
+            memcpy(block_bitmap(fs, g), blocks, GROUP_BLOCKS / 8);
+            mark_block_dirty(fs, sb->groups[g].block_bitmap);
+        }
+        if (memcmp(inode_bitmap(fs, g), inodes, per_group / 8) != 0) {
+            memcpy(inode_bitmap(fs, g), inodes, per_group / 8);
+            mark_block_dirty(fs, sb->groups[g].inode_bitmap);
+        }
+        sb->groups[g].free_blocks = count_zero_bits(blocks, GROUP_BLOCKS);
+        sb->groups[g].free_inodes = count_zero_bits(inodes, per_group);
+        sb->free_blocks += sb->groups[g].free_blocks;
+        sb->free_inodes += sb->groups[g].free_inodes;
+        mark_counters_dirty(fs, g);
+    }
+    mark_dirty(fs, sb, 64);
+    load_refs(fs);
+    for (uint32_t i = 0; i < count; i++) {
+        if (issues[i].fix == FIX_PARENT) {
+            struct inode *node = get_inode(fs, issues[i].target);
+            node->parent = issues[i].dir;
+            node->parent_chain = issues[i].chain;
+            node->parent_slot = issues[i].slot;
+            mark_inode_dirty(fs, issues[i].target);
+        }
+    }
+    for (uint32_t i = 0, j; i < count; i = j) {
+        int rewrite = 0;
+        for (j = i; j < count && issues[j].dir == issues[i].dir; j++) {
+            if (issues[j].fix == FIX_CUT) {
+                get_inode(fs, issues[j].chain)->next_inode = INVALID_INODE;
+                mark_inode_dirty(fs, issues[j].chain);
+            } else if (issues[j].fix == FIX_INDEX) {
+                get_inode(fs, issues[j].dir)->index_inode = 0;
+                mark_inode_dirty(fs, issues[j].dir);
+            }
+            rewrite |= issues[j].fix == FIX_DROP || issues[j].fix == FIX_CUT || issues[j].fix == FIX_INDEX ||
+                       issues[j].fix == FIX_COUNTS;
+        }
+        if (rewrite) {
+            fsck_rewrite(fs, issues[i].dir, issues + i, j - i);
+        }
+    }
+    load_refs(fs);
+    dcache_clear(fs);
+    drop_subtrees(fs);
+    reset_cwds(fs);
+}
+
+// Checks the image, repairing it if asked to, and hands fn the problems of
+// the first pass and those a repair left. Returns the number of repairs.
+uint32_t do_fsck(struct extfs *fs, int repair, extfs_fsck_fn fn, void *arg, struct extfs_fsck_stats *st) {
+    struct super_block *sb = fs->img->fp;
+    struct fsck *ck = (struct fsck *) calloc(1, sizeof(struct fsck));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ck->fs = fs;
+    ck->thread_count = cpus < 1 ? 1 : cpus > FSCK_THREADS ? FSCK_THREADS : (uint32_t) cpus;
+    ck->inodes = (uint64_t *) malloc((sb->group_count * sb->inodes_per_group + 63) / 64 * sizeof(uint64_t));
+    ck->blocks = (uint64_t *) malloc(sb->group_count * GROUP_BLOCKS / 64 * sizeof(uint64_t));
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        ck->workers[t].ck = ck;
+        ck->workers[t].chain_pos = (uint32_t *) calloc(sb->inodes_count, sizeof(uint32_t));
+    }
+    st->threads = ck->thread_count;
+    uint32_t repairs = 0;
+    for (uint32_t pass = 1;; pass++) {
+        fsck_pass(ck);
+        uint32_t count, fixes = 0;
+        struct fsck_issue *issues = fsck_issues(ck, &count);
+        for (uint32_t i = 0; i < count; i++) {
+            fixes += issues[i].fix != FIX_NONE;
+        }
+        int last = !repair || fixes == 0 || ck->broken || pass == FSCK_ROUNDS;
+        for (uint32_t i = 0; i < count && (pass == 1 || last); i++) {
+            fn(arg, issues[i].text);
+        }
+        if (pass == 1) {
+            st->problems = count;
+        }
+        st->left = count;
+        st->dirs = 0;
+        st->files = 0;
+        for (uint32_t t = 0; t < ck->thread_count; t++) {
+            st->dirs += ck->workers[t].dirs;
+            st->files += ck->workers[t].files;
+        }
+        if (!last) {
+            fsck_repair(ck, issues, count);
+            repairs++;
+        }
+        free(issues);
+        if (last)
+            break;
+    }
+    for (uint32_t t = 0; t < ck->thread_count; t++) {
+        struct fsck_worker *w = &ck->workers[t];
+        free(w->issues);
+        free(w->inlines.refs);
+        free(w->moved.refs);
+        free(w->found.dirs);
+        free(w->chains);
+        free(w->starts);
+        free(w->indexed);
+        free(w->chain_pos);
+    }
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    free(ck->queue.dirs);
+    free(ck->inodes);
+    free(ck->blocks);
+    free(ck);
+    return repairs;
+}
+
+// Host import and export
+//
+// Import builds every dir it copies at once: it gives all files of a host dir
+// their inodes and a share of one run of blocks, reads them straight into
+// those blocks, and then lays out the entry blocks with rewrite_dir instead
+// of inserting the entries one by one. Export writes files straight from
+// their blocks.
+
+// an entry of a dir being copied
+struct host_entry {
+    char name[MAX_FILENAME];
+    int is_dir;
+    uint32_t size;
+    uint32_t inode;
+};
+
+struct transfer {
+    struct extfs *fs;
+    struct extfs_transfer_stats *st;
+    char path[MAX_PATH]; // host dir of the dir being copied
+    struct host_entry *entries;
+    uint32_t count, cap;
+};
+
+// Appends name to the host path, ERROR if it gets too long. Returns the old
+// length, to cut it back to.
+size_t push_host_path(struct transfer *t, const char *name) {
+    size_t len = strlen(t->path);
+    if (len + 1 + strlen(name) >= MAX_PATH)
+        return fail(t->fs, EXTFS_PATH_TOO_LONG);
+    t->path[len] = '/';
+    strcpy(t->path + len + 1, name);
+    return len;
+}
+
+struct host_entry *add_host_entry(struct transfer *t) {
+    if (t->count == t->cap) {
+        t->cap = t->cap == 0 ? 64 : t->cap * 2;
+        t->entries = (struct host_entry *) realloc(t->entries, t->cap * sizeof(struct host_entry));
+    }
+    return &t->entries[t->count++];
+}
+
+// Reads len bytes of fd into p. A file that got shorter meanwhile ends in
+// zeros. Returns ERROR if the read fails.
+uint32_t read_full(int fd, char *p, uint32_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return ERROR;
+        if (n == 0) {
+            memset(p, 0, len);
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+uint32_t write_full(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERROR;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Gives an empty file the blocks for size bytes from the front of run, which
+// are enough of them.
+void file_assign(struct extfs *fs, uint32_t inode, struct extent *run, uint32_t size) {
+    struct inode *node = get_inode(fs, inode);
+    uint32_t want = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    node->extents[0].start = run->start;
+    node->extents[0].len = want;
+    node->extent_count = 1;
+    node->file_size = size;
+    mark_inode_dirty(fs, inode);
+    run->start += want;
+    run->len -= want;
+}
+
+// Fills a new file with the contents of fd, like file_write.
+uint32_t file_read_host(struct extfs *fs, uint32_t inode, int fd) {
+    uint32_t len = get_inode(fs, inode)->file_size;
+    if (get_inode(fs, inode)->file_flags & FILE_INLINE) {
+        char *p = inline_data(fs, inode);
+        mark_dirty(fs, p, len);
+        return read_full(fd, p, len);
+    }
+    uint32_t pos = 0;
+    for (uint32_t k = 0; pos < len; k++) {
+        struct extent *e = file_extent(fs, inode, k);
+        uint32_t n = e->len * BLOCK_SIZE < len - pos ? e->len * BLOCK_SIZE : len - pos;
+        char *p = get_blocks(fs, e->start, (n + BLOCK_SIZE - 1) / BLOCK_SIZE)->data;
+        mark_dirty(fs, p, n);
+        if (read_full(fd, p, n) == ERROR)
+            return ERROR;
+        pos += n;
+    }
+    return 0;
+}
+
+// Lists the host dir at t->path into t->entries, leaving out what extfs
+// cannot hold: entries that are neither files nor dirs, files of 4 GB and
+// more, and names it does not allow.
+uint32_t list_host_dir(struct transfer *t, int dfd) {
+    DIR *d = fdopendir(dfd);
+    if (d == NULL) {
+        close(dfd);
+        return fail(t->fs, EXTFS_HOST_IO);
+    }
+    t->count = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat sb;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (fstatat(dirfd(d), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            closedir(d);
+            return fail(t->fs, EXTFS_HOST_IO);
+        }
+        if (!(S_ISDIR(sb.st_mode) || (S_ISREG(sb.st_mode) && (uint64_t) sb.st_size <= UINT32_MAX - BLOCK_SIZE)) ||
+            check_filename_valid(t->fs, de->d_name) == ERROR) {
+            t->st->skipped++;
+            continue;
+        }
+        struct host_entry *e = add_host_entry(t);
+        strcpy(e->name, de->d_name);
+        e->is_dir = S_ISDIR(sb.st_mode);
+        e->size = e->is_dir ? 0 : (uint32_t) sb.st_size;
+        e->inode = ERROR;
+    }
+    closedir(d);
+    return 0;
+}
+
+// Frees the inodes given to the first count entries, which no dir refers to
+// yet.
+void drop_host_entries(struct extfs *fs, struct host_entry *entries, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        free_inode(fs, entries[i].inode);
+    }
+}
+
+// Inodes the chain of a dir takes for records of the given sizes, as
+// rewrite_dir packs them.
+uint32_t chain_inodes(const char *records, size_t len) {
+    uint32_t inodes = 1, off = 0;
+    for (size_t pos = 0; pos < len; pos += ((const struct entry *) (records + pos))->rec_len) {
+        uint32_t size = ((const struct entry *) (records + pos))->rec_len;
+        if (off + size > BLOCK_SIZE) {
+            inodes++;
+            off = 0;
+        }
+        off += size;
+    }
+    return inodes;
+}
+
+// Copies the host dir at t->path into the empty dir, then its subdirs. A dir
+// that does not fit is left empty, and ERROR returned.
+uint32_t import_dir(struct transfer *t, uint32_t dir) {
+    struct extfs *fs = t->fs;
+    int dfd = open(t->path, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0 || list_host_dir(t, dfd) == ERROR) {
+        return fail(fs, EXTFS_HOST_IO);
+    }
+    uint32_t count = t->count, result = 0;
+    // t->entries is reused by the subdirs
+    struct host_entry *entries = t->entries;
+    t->entries = NULL;
+    t->count = t->cap = 0;
+
+    // one run for the files that take blocks of their own
+    uint64_t want = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i].size > INLINE_DATA_SIZE) {
+            want += (entries[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+    }
+    struct extent run = {0, 0};
+    if (want > 0 && want <= fs->img->fp->free_blocks) {
+        run.start = allocate_blocks(fs, want < GROUP_BLOCKS ? want : GROUP_BLOCKS, inode_group(fs, dir), &run.len);
+        if (run.start == ERROR) {
+            run.len = 0;
+        }
+    }
+
+    size_t records_len = 0;
+    char *records = (char *) malloc((size_t) count * record_size(MAX_FILENAME) + 1);
+    uint32_t done = 0;
+    dfd = open(t->path, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        result = fail(fs, EXTFS_HOST_IO);
+    }
+    for (; done < count && result == 0; done++) {
+        struct host_entry *e = &entries[done];
+        if (e->is_dir) {
+            e->inode = allocate_inode(fs, MODE_DIR, dir_group(fs, dir));
+        } else {
+            e->inode = allocate_inode(fs, MODE_FILE, inode_group(fs, dir));
+        }
+        if (e->inode == ERROR) {
+            result = ERROR;
+            break;
+        }
+        if (!e->is_dir && e->size > 0) {
+            uint32_t blocks = (e->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (e->size > INLINE_DATA_SIZE && blocks <= run.len) {
+                file_assign(fs, e->inode, &run, e->size);
+            } else if (file_allocate(fs, e->inode, e->size) == ERROR) {
+                done++;
+                result = ERROR;
+                break;
+            }
+            int fd = openat(dfd, e->name, O_RDONLY);
+            uint32_t copied = fd < 0 ? ERROR : file_read_host(fs, e->inode, fd);
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (copied == ERROR) {
+                done++;
+                result = fail(fs, EXTFS_HOST_IO);
+                break;
+            }
+        }
+        struct entry *r = (struct entry *) (records + records_len);
+        r->id = e->inode;
+        r->name_len = strlen(e->name);
+        r->rec_len = record_size(r->name_len);
+        memcpy(r->name, e->name, r->name_len + 1);
+        records_len += r->rec_len;
+    }
+    if (dfd >= 0) {
+        close(dfd);
+    }
+    if (run.len > 0) {
+        free_blocks(fs, run.start, run.len);
+    }
+    // the chain has to grow in full, rewrite_dir leaves out what does not fit
+    uint32_t chain = chain_inodes(records, records_len) - 1;
+    if (result == 0 && (chain > fs->img->fp->free_inodes || chain > fs->img->fp->free_blocks)) {
+        result = fail(fs, chain > fs->img->fp->free_inodes ? EXTFS_NO_INODE : EXTFS_NO_BLOCK);
+    }
+    if (result == ERROR) {
+        drop_host_entries(fs, entries, done);
+    } else {
+        rewrite_dir(fs, dir, records, records_len);
+        for (uint32_t i = 0; i < count; i++) {
+            if (entries[i].is_dir) {
+                t->st->dirs++;
+            } else {
+                t->st->files++;
+                t->st->bytes += entries[i].size;
+            }
+        }
+    }
+    free(records);
+
+    for (uint32_t i = 0; i < count && result == 0; i++) {
+        if (!entries[i].is_dir)
+            continue;
+        size_t len = push_host_path(t, entries[i].name);
+        if (len == ERROR) {
+            result = ERROR;
+            break;
+        }
+        result = import_dir(t, entries[i].inode);
+        t->path[len] = '\0';
+    }
+    free(entries);
+    return result;
+}
+
+uint32_t do_import(struct extfs *fs, const char *hostdir, uint32_t dir, const char *name,
+                   struct extfs_transfer_stats *st) {
+    struct transfer t;
+    memset(&t, 0, sizeof(t));
+    t.fs = fs;
+    t.st = st;
+    if (strlen(hostdir) >= MAX_PATH)
+        return fail(fs, EXTFS_PATH_TOO_LONG);
+    strcpy(t.path, hostdir);
+    struct stat sb;
+    if (stat(hostdir, &sb) != 0 || !S_ISDIR(sb.st_mode))
+        return fail(fs, EXTFS_HOST_IO);
+    uint32_t inode = do_mkdir(fs, dir, name);
+    if (inode == ERROR)
+        return ERROR;
+    st->dirs++;
+    uint32_t result = import_dir(&t, inode);
+    free(t.entries);
+    // do_mkdir counted the new dir already
+    if (LOAD(fs->img->subtrees_valid)) {
+        count_subtrees(fs, inode);
+        subtree_add(fs, dir, fs->img->subtrees[inode].bytes, fs->img->subtrees[inode].inodes - 1);
+    }
+    return result;
+}
+
+struct host_file {
+    int fd;
+    int failed;
+};
+
+void write_host_file(void *arg, const char *data, size_t len) {
+    struct host_file *f = (struct host_file *) arg;
+    if (!f->failed && write_full(f->fd, data, len) == ERROR) {
+        f->failed = 1;
+    }
+}
+
+// Writes the files of dir into the host dir at t->path, creating it, then
+// its subdirs.
+uint32_t export_dir(struct transfer *t, uint32_t dir) {
+    struct extfs *fs = t->fs;
+    struct stat sb;
+    if (mkdir(t->path, 0755) != 0 && (errno != EEXIST || stat(t->path, &sb) != 0 || !S_ISDIR(sb.st_mode)))
+        return fail(fs, EXTFS_HOST_IO);
+    int dfd = open(t->path, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0)
+        return fail(fs, EXTFS_HOST_IO);
+    uint32_t result = 0;
+    t->st->dirs++;
+    t->count = 0;
+    // files cannot be removed while their dir is locked
+    lock_dir(fs, dir, 0);
+    for (uint32_t chain = dir; chain != INVALID_INODE && result == 0; chain = get_inode(fs, chain)->next_inode) {
+        for (int i = next_record(fs, chain, -1); i >= 0; i = next_record(fs, chain, i)) {
+            struct entry *e = chain_entry(fs, chain, i);
+            if (e->type == MODE_DIR) {
+                struct host_entry *sub = add_host_entry(t);
+                strcpy(sub->name, e->name);
+                sub->inode = e->id;
+                continue;
+            }
+            struct host_file f = {openat(dfd, e->name, O_WRONLY | O_CREAT | O_TRUNC, 0644), 0};
+            if (f.fd >= 0) {
+                file_read(fs, e->id, write_host_file, &f);
+                f.failed |= close(f.fd) != 0;
+            }
+            if (f.fd < 0 || f.failed) {
+                result = fail(fs, EXTFS_HOST_IO);
+                break;
+            }
+            t->st->files++;
+            t->st->bytes += get_inode(fs, e->id)->file_size;
+        }
+    }
+    unlock_dir(fs, dir);
+    close(dfd);
+    // only rmdir removes dirs, and it waits for the image lock
+    uint32_t count = t->count;
+    struct host_entry *subdirs = t->entries;
+    t->entries = NULL;
+    t->count = t->cap = 0;
+    for (uint32_t i = 0; i < count && result == 0; i++) {
+        size_t len = push_host_path(t, subdirs[i].name);
+        if (len == ERROR) {
+            result = ERROR;
+            break;
+        }
+        result = export_dir(t, subdirs[i].inode);
+        t->path[len] = '\0';
+    }
+    free(subdirs);
+    return result;
+}
+
+uint32_t do_export(struct extfs *fs, uint32_t dir, const char *hostdir, struct extfs_transfer_stats *st) {
+    struct transfer t;
+    memset(&t, 0, sizeof(t));
+    t.fs = fs;
+    t.st = st;
+    if (strlen(hostdir) >= MAX_PATH)
+        return fail(fs, EXTFS_PATH_TOO_LONG);
+    strcpy(t.path, hostdir);
+    uint32_t result = export_dir(&t, dir);
+    free(t.entries);
+    return result;
+}
+
+// Journal
+//
+// With journaling on, the image file only changes at checkpoints. Every
+// successful mutation is appended to journal_file as a logical record instead.
+// A checkpoint writes the dirty chunks to checkpoint_file, copies them into
+// the image and then drops the journal records and the checkpoint file, in
+// that order. On startup a complete checkpoint file is applied again and only
+// the records newer than it are replayed.
+
+struct journal_record {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t dir;
+    uint32_t target;
+    uint32_t name_len;
+    uint32_t data_len;
+    uint32_t checksum; // over the record with this field zeroed, and its payload
+    uint32_t reserved;
+};
+
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t seq; // last record included
+    uint64_t body_len;
+    uint32_t checksum; // over the body
+    uint32_t blocks; // size of the image, 0 if written before block groups
+};
+
+// body is a sequence of (uint64_t offset, uint64_t len, data) ranges. A
+// len with CHECKPOINT_HOLE has no data, its blocks are unused.
+struct checkpoint {
+    struct checkpoint_header header;
+    char *body;
+    int failed;
+    struct extfs *fs;
+};
+
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return ERROR;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void sync_dir(struct extfs *fs) {
+    int fd = open(fs->img->dir_name, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+char *read_whole_file(const char *name, size_t *len) {
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    char *data = (char *) malloc(st.st_size + 1);
+    ssize_t n = read(fd, data, st.st_size);
+    close(fd);
+    *len = n > 0 ? (size_t) n : 0;
+    return data;
+}
+
+// Appends the buffered records to the journal file. Needs journal_flush_lock.
+int journal_write_pending(struct extfs *fs, int sync) {
+    pthread_mutex_lock(&fs->img->journal_lock);
+    char *data = fs->img->journal_buf;
+    size_t len = fs->img->journal_len;
+    fs->img->journal_buf = fs->img->journal_spare;
+    fs->img->journal_spare = data;
+    size_t cap = fs->img->journal_cap;
+    fs->img->journal_cap = fs->img->journal_spare_cap;
+    fs->img->journal_spare_cap = cap;
+    fs->img->journal_len = 0;
+    fs->img->journal_pending = 0;
+    pthread_mutex_unlock(&fs->img->journal_lock);
+
+    if (fs->img->journal_fd < 0) {
+        // the journal could not be opened, records only live in memory
+        if (len > 0) {
+            STORE(fs->img->io_failed, 1);
+        }
+        return 0;
+    }
+    if (len > 0 && write_all(fs->img->journal_fd, data, len) != 0) {
+        STORE(fs->img->io_failed, 1);
+        return ERROR;
+    }
+    if (sync && (len > 0 || fs->img->journal_unsynced) && fsync(fs->img->journal_fd) != 0) {
+        STORE(fs->img->io_failed, 1);
+        return ERROR;
+    }
+    fs->img->journal_unsynced = !sync && (fs->img->journal_unsynced || len > 0);
+    return 0;
+}
+
+int journal_flush(struct extfs *fs, int sync) {
+    pthread_mutex_lock(&fs->img->journal_flush_lock);
+    int result = journal_write_pending(fs, sync);
+    pthread_mutex_unlock(&fs->img->journal_flush_lock);
+    return result;
+}
+
+// Group commit: waits for the first pending record, lets more of them gather
+// for JOURNAL_GROUP_MS and writes them with a single fsync.
+void *journal_flusher_main(void *arg) {
+    struct extfs *fs = (struct extfs *) arg;
+    pthread_mutex_lock(&fs->img->journal_lock);
+    while (!fs->img->journal_stop) {
+        if (fs->img->journal_pending == 0) {
+            pthread_cond_wait(&fs->img->journal_cond, &fs->img->journal_lock);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_GROUP_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!fs->img->journal_stop && fs->img->journal_pending > 0 && fs->img->journal_pending < JOURNAL_GROUP_RECORDS &&
+               pthread_cond_timedwait(&fs->img->journal_cond, &fs->img->journal_lock, &deadline) == 0);
+        pthread_mutex_unlock(&fs->img->journal_lock);
+        journal_flush(fs, 1);
+        pthread_mutex_lock(&fs->img->journal_lock);
+    }
+    pthread_mutex_unlock(&fs->img->journal_lock);
+    return NULL;
+}
+
+void journal_start(struct extfs *fs) {
+    if (fs->img->journal_policy == EXTFS_JOURNAL_GROUP && !fs->img->journal_flusher_running) {
+        fs->img->journal_stop = 0;
+        fs->img->journal_flusher_running = pthread_create(&fs->img->journal_flusher, NULL, journal_flusher_main, &fs->img->self) == 0;
+    }
+}
+
+void journal_shutdown(struct extfs *fs) {
+    if (fs->img->journal_flusher_running) {
+        pthread_mutex_lock(&fs->img->journal_lock);
+        fs->img->journal_stop = 1;
+        pthread_cond_signal(&fs->img->journal_cond);
+        pthread_mutex_unlock(&fs->img->journal_lock);
+        pthread_join(fs->img->journal_flusher, NULL);
+        fs->img->journal_flusher_running = 0;
+    }
+}
+
+// Collects the dirty chunks into a checkpoint and starts a new dirty set.
+struct checkpoint *capture_checkpoint(struct extfs *fs) {
+    struct checkpoint *c = (struct checkpoint *) calloc(1, sizeof(struct checkpoint));
+    c->fs = &fs->img->self;
+    update_sums(fs);
+    size_t chunk = 0, offset, len, body_len = 0;
+    int hole;
+    while (next_save_range(fs, &chunk, &offset, &len, &hole)) {
+        body_len += 2 * sizeof(uint64_t) + (hole ? 0 : len);
+    }
+    c->body = (char *) malloc(body_len + 1);
+    char *p = c->body;
+    chunk = 0;
+    while (next_save_range(fs, &chunk, &offset, &len, &hole)) {
+        uint64_t range[2] = {offset, hole ? len | CHECKPOINT_HOLE : len};
+        memcpy(p, range, sizeof(range));
+        p += sizeof(range);
+        if (!hole) {
+            memcpy(p, (char *) fs->img->fp + offset, len);
+            p += len;
+        }
+    }
+    clear_dirty(fs);
+    c->header.magic = CHECKPOINT_MAGIC;
+    c->header.flags = fs->img->format_pending ? CHECKPOINT_TRUNCATE : 0;
+    c->header.blocks = fs->img->fp->blocks_count;
+    c->header.seq = fs->img->journal_seq;
+    c->header.body_len = body_len;
+    fs->img->format_pending = 0;
+    return c;
+}
+
+// Makes the checkpoint durable under checkpoint_file, atomically.
+int write_checkpoint(struct extfs *fs, struct checkpoint *c) {
+    int fd = open(fs->img->checkpoint_temp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return ERROR;
+    c->header.checksum = checksum(CHECKSUM_SEED, c->body, c->header.body_len);
+    if (write_all(fd, &c->header, sizeof(c->header)) != 0 ||
+        write_all(fd, c->body, c->header.body_len) != 0 || fsync(fd) != 0) {
+        close(fd);
+        return ERROR;
+    }
+    close(fd);
+    if (rename(fs->img->checkpoint_temp_file, fs->img->checkpoint_file) != 0)
+        return ERROR;
+    sync_dir(fs);
+    return 0;
+}
+
+// Packs
+
+// A pack starts with its header, followed by the stored blocks and the
+// index. Updates append the blocks they change and a new index before they
+// rewrite the header, so a torn update leaves the old image in place.
+struct pack_header {
+    uint32_t magic;
+    uint32_t blocks; // size of the image
+    uint64_t index_offset;
+    uint64_t garbage; // bytes the index no longer refers to
+    uint32_t entries; // in the index, one per block that is not all zeros
+    uint32_t checksum; // over the index
+};
+
+// where a block is stored, len 0 for a block of zeros
+struct pack_entry {
+    uint64_t offset;
+    uint32_t block;
+    uint32_t len; // BLOCK_SIZE if stored uncompressed
+    uint32_t checksum; // over the stored bytes
+    uint32_t reserved;
+};
+
+// buffers appends to a pack
+struct pack_writer {
+    int fd;
+    uint64_t pos; // where the next byte goes
+    char *buf;
+    size_t len;
+};
+
+int is_pack(const char *file) {
+    uint32_t magic = 0;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    int result = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == PACK_MAGIC;
+    close(fd);
+    return result;
+}
+
+// Reads the header and index of the pack in fd into *index, an entry for
+// each of its blocks, which the caller frees. Returns ERROR if fd holds no
+// intact pack.
+int read_pack_index(int fd, struct pack_header *h, struct pack_entry **index) {
+    *index = NULL;
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) || h->magic != PACK_MAGIC || h->blocks > MAX_GROUPS * GROUP_BLOCKS ||
+        h->entries > h->blocks)
+        return ERROR;
+    size_t len = (size_t) h->entries * sizeof(struct pack_entry);
+    struct pack_entry *entries = (struct pack_entry *) malloc(len + 1);
+    int result = 0;
+    if (pread(fd, entries, len, h->index_offset) != (ssize_t) len || checksum(CHECKSUM_SEED, entries, len) != h->checksum)
+        result = ERROR;
+    *index = (struct pack_entry *) calloc(h->blocks + 1, sizeof(struct pack_entry));
+    for (uint32_t i = 0; i < h->entries && result == 0; i++) {
+        if (entries[i].block >= h->blocks) {
+            result = ERROR;
+        } else {
+            (*index)[entries[i].block] = entries[i];
+        }
+    }
+    free(entries);
+    if (result != 0) {
+        free(*index);
+        *index = NULL;
+    }
+    return result;
+}
+
+// Stores the block at data into out, compressed when that makes it smaller.
+// Returns the stored length.
+uint32_t pack_block(const char *data, char *out) {
+    if (data[0] == 0 && memcmp(data, data + 1, BLOCK_SIZE - 1) == 0)
+        return 0;
+    uLongf len = BLOCK_SIZE - 1;
+    if (compress2((Bytef *) out, &len, (const Bytef *) data, BLOCK_SIZE, PACK_LEVEL) == Z_OK)
+        return len;
+    memcpy(out, data, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+// Reads the block e refers to into out. Returns ERROR if it is damaged.
+int unpack_block(int fd, const struct pack_entry *e, char *out) {
+    char buf[BLOCK_SIZE];
+    if (e->len == 0) {
+        memset(out, 0, BLOCK_SIZE);
+        return 0;
+    }
+    if (e->len > BLOCK_SIZE || pread(fd, buf, e->len, e->offset) != (ssize_t) e->len ||
+        checksum(CHECKSUM_SEED, buf, e->len) != e->checksum)
+        return ERROR;
+    if (e->len == BLOCK_SIZE) {
+        memcpy(out, buf, BLOCK_SIZE);
+        return 0;
+    }
+    uLongf len = BLOCK_SIZE;
+    if (uncompress((Bytef *) out, &len, (const Bytef *) buf, e->len) != Z_OK || len != BLOCK_SIZE)
+        return ERROR;
+    return 0;
+}
+
+int pack_flush(struct pack_writer *w) {
+    if (w->len > 0 && pwrite(w->fd, w->buf, w->len, w->pos - w->len) != (ssize_t) w->len)
+        return ERROR;
+    w->len = 0;
+    return 0;
+}
+
+// Appends up to a block of data.
+int pack_put(struct pack_writer *w, const void *data, size_t len) {
+    if (w->len + len > PACK_BUFFER && pack_flush(w) != 0)
+        return ERROR;
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    w->pos += len;
+    return 0;
+}
+
+// Appends the block at data and points e to it.
+int pack_store(struct pack_writer *w, const char *data, struct pack_entry *e) {
+    char out[BLOCK_SIZE];
+    e->len = pack_block(data, out);
+    e->offset = e->len == 0 ? 0 : w->pos;
+    e->checksum = checksum(CHECKSUM_SEED, out, e->len);
+    return pack_put(w, out, e->len);
+}
+
+// Appends the entries of index for blocks that are not all zeros.
+int write_pack_index(struct pack_writer *w, struct pack_header *h, struct pack_entry *index) {
+    h->index_offset = w->pos;
+    h->entries = 0;
+    h->checksum = CHECKSUM_SEED;
+    for (uint32_t b = 0; b < h->blocks; b++) {
+        if (index[b].len == 0)
+            continue;
+        index[b].block = b;
+        h->entries++;
+        h->checksum = checksum(h->checksum, &index[b], sizeof(index[b]));
+        if (pack_put(w, &index[b], sizeof(index[b])) != 0)
+            return ERROR;
+    }
+    return 0;
+}
+
+// Copies the blocks the checkpoint leaves alone from the old data_file in
+// fd, a pack or a raw image, to the new pack.
+int pack_carry_over(struct pack_writer *w, int fd, struct pack_header *old, struct pack_entry *old_index,
+                    const uint64_t *covered, struct pack_entry *index, uint32_t blocks) {
+    struct stat st;
+    char buf[BLOCK_SIZE];
+    if (fstat(fd, &st) != 0)
+        return ERROR;
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (test_bit(covered, b))
+            continue;
+        if (old_index != NULL) {
+            struct pack_entry *e = &old_index[b];
+            if (b >= old->blocks || e->len == 0)
+                continue;
+            if (e->len > BLOCK_SIZE || pread(fd, buf, e->len, e->offset) != (ssize_t) e->len)
+                return ERROR;
+            index[b] = *e;
+            index[b].offset = w->pos;
+            if (pack_put(w, buf, e->len) != 0)
+                return ERROR;
+        } else if ((off_t) (b + 1) * BLOCK_SIZE <= st.st_size) {
+            if (pread(fd, buf, BLOCK_SIZE, (off_t) b * BLOCK_SIZE) != BLOCK_SIZE || pack_store(w, buf, &index[b]) != 0)
+                return ERROR;
+        }
+    }
+    return 0;
+}
+
+// Copies the checkpoint into the pack. Changed blocks go to the end of the
+// file, which leaves their old copies as garbage. Once that is half of the
+// file, or the file is no pack yet, a new pack is written next to it and
+// renamed into place.
+int apply_pack(struct extfs *fs, struct checkpoint *c) {
+    int fd = open(fs->img->data_file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return ERROR;
+    struct stat st;
+    struct pack_header old, h;
+    struct pack_entry *old_index;
+    uint32_t blocks = c->header.blocks;
+    int truncate = c->header.flags & CHECKPOINT_TRUNCATE;
+    if (read_pack_index(fd, &old, &old_index) != 0) {
+        memset(&old, 0, sizeof(old));
+    }
+    int result = fstat(fd, &st) == 0 ? 0 : ERROR;
+    if (result != 0 || (old_index != NULL && c->header.body_len == 0 && !truncate && old.blocks == blocks)) {
+        // an empty checkpoint leaves the pack alone
+        free(old_index);
+        close(fd);
+        return result;
+    }
+    int rewrite = truncate || old_index == NULL || old.garbage * 2 > (uint64_t) st.st_size;
+    struct pack_entry *index = (struct pack_entry *) calloc(blocks + 1, sizeof(struct pack_entry));
+    uint64_t *covered = (uint64_t *) calloc(blocks / 64 + 1, sizeof(uint64_t));
+    struct pack_writer w = {fd, (uint64_t) st.st_size, (char *) malloc(PACK_BUFFER), 0};
+    memset(&h, 0, sizeof(h));
+    h.magic = PACK_MAGIC;
+    h.blocks = blocks;
+    char *p = c->body, *end = c->body + c->header.body_len;
+    while (p < end) {
+        uint64_t range[2];
+        memcpy(range, p, sizeof(range));
+        uint64_t len = range[1] & ~CHECKPOINT_HOLE;
+        for (uint64_t b = range[0] / BLOCK_SIZE; b < (range[0] + len) / BLOCK_SIZE && b < blocks; b++) {
+            set_bit(covered, b);
+        }
+        p += sizeof(range) + (range[1] & CHECKPOINT_HOLE ? 0 : len);
+    }
+
+    if (rewrite) {
+        w.fd = open(fs->img->pack_temp_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        w.pos = sizeof(h);
+        if (w.fd < 0 || (!truncate && pack_carry_over(&w, fd, &old, old_index, covered, index, blocks) != 0)) {
+            result = ERROR;
+        }
+    } else {
+        memcpy(index, old_index, (old.blocks < blocks ? old.blocks : blocks) * sizeof(struct pack_entry));
+        h.garbage = old.garbage + (uint64_t) old.entries * sizeof(struct pack_entry);
+    }
+    for (p = c->body; p < end && result == 0;) {
+        uint64_t range[2];
+        memcpy(range, p, sizeof(range));
+        p += sizeof(range);
+        uint64_t len = range[1] & ~CHECKPOINT_HOLE;
+        for (uint64_t b = range[0] / BLOCK_SIZE, i = 0; i < len / BLOCK_SIZE && b < blocks && result == 0; b++, i++) {
+            if (!rewrite) {
+                h.garbage += index[b].len;
+            }
+            if (range[1] & CHECKPOINT_HOLE) {
+                memset(&index[b], 0, sizeof(index[b]));
+            } else {
+                result = pack_store(&w, p + i * BLOCK_SIZE, &index[b]);
+            }
+        }
+        p += range[1] & CHECKPOINT_HOLE ? 0 : len;
+    }
+
+    if (result != 0 || write_pack_index(&w, &h, index) != 0 || pack_flush(&w) != 0 ||
+        fsync(w.fd) != 0 || pwrite(w.fd, &h, sizeof(h), 0) != sizeof(h) || fsync(w.fd) != 0) {
+        result = ERROR;
+    }
+    if (rewrite && w.fd >= 0) {
+        if (result == 0 && rename(fs->img->pack_temp_file, fs->img->data_file) != 0) {
+            result = ERROR;
+        }
+        if (result != 0) {
+            unlink(fs->img->pack_temp_file);
+        }
+        sync_dir(fs);
+    }
+    pthread_mutex_lock(&fs->img->cache_lock);
+    if (result == 0 && fs->img->lazy) {
+        // blocks not in memory are read from the new pack from now on
+        if (rewrite) {
+            close(fs->img->pack_fd);
+            fs->img->pack_fd = w.fd;
+            w.fd = fd;
+        }
+        free(fs->img->pack_index);
+        fs->img->pack_index = index;
+        index = NULL;
+    }
+    pthread_mutex_unlock(&fs->img->cache_lock);
+    if (w.fd != fd && w.fd >= 0) {
+        close(w.fd);
+    }
+    close(fd);
+    free(w.buf);
+    free(covered);
+    free(index);
+    free(old_index);
+    return result;
+}
+
+// Reads the pack in data_file into memory. Returns 1 if the file was just
+// created, 0 if it was read, ERROR if it holds no intact pack.
+int load_pack(struct extfs *fs) {
+    struct stat st;
+    struct pack_header h;
+    struct pack_entry *index;
+    int fd = open(fs->img->data_file, O_RDONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return ERROR;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return ERROR;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+    if (read_pack_index(fd, &h, &index) != 0) {
+        close(fd);
+        return ERROR;
+    }
+    size_t size = (size_t) h.blocks * BLOCK_SIZE;
+    // aligned, so that dropped blocks can give their pages back
+    char *image = size == 0 ? NULL : (char *) aligned_alloc(BLOCK_SIZE, size);
+    int result = image == NULL ? ERROR : unpack_block(fd, &index[0], image);
+    struct super_block *sb = (struct super_block *) image;
+    int lazy = result == 0 && sb->version == CURRENT_VERSION && sb->blocks_count == h.blocks;
+    uint32_t words = (h.blocks + 63) / 64;
+    uint64_t *loaded = (uint64_t *) calloc(words + 1, sizeof(uint64_t));
+    for (uint32_t b = 1; b < h.blocks && result == 0; b++) {
+        // anything else is read in full and left to load_fs to sort out
+        if (!lazy || b % GROUP_BLOCKS < group_metadata(b / GROUP_BLOCKS, sb->inodes_per_group) || sum_block(sb, b)) {
+            result = unpack_block(fd, &index[b], image + (size_t) b * BLOCK_SIZE);
+            set_bit(loaded, b);
+        }
+    }
+    if (result != 0) {
+        close(fd);
+        free(index);
+        free(loaded);
+        free(image);
+        return ERROR;
+    }
+    set_bit(loaded, 0);
+    free(fs->img->fp);
+    fs->img->fp = sb;
+    fs->img->image_size = size;
+    resize_dirty_chunks(fs, size);
+    if (!lazy) {
+        close(fd);
+        free(index);
+        free(loaded);
+        return 0;
+    }
+    pthread_mutex_lock(&fs->img->cache_lock);
+    fs->img->pack_fd = fd;
+    fs->img->pack_index = index;
+    fs->img->loaded = loaded;
+    fs->img->referenced = (uint64_t *) calloc(words + 1, sizeof(uint64_t));
+    fs->img->cache_limit = CACHE_BLOCKS;
+    fs->img->clock_hand = 0;
+    STORE(fs->img->resident, 0);
+    STORE(fs->img->lazy, 1);
+    pthread_mutex_unlock(&fs->img->cache_lock);
+    return 0;
+}
+
+// Block cache
+
+int block_metadata(struct extfs *fs, uint32_t block) {
+    return block % GROUP_BLOCKS < group_metadata(block / GROUP_BLOCKS, fs->img->fp->inodes_per_group) ||
+           sum_block(fs->img->fp, block);
+}
+
+// Unpacks a block of a lazily read pack into memory.
+void cache_fault(struct extfs *fs, uint32_t block) {
+    struct image *img = fs->img;
+    pthread_mutex_lock(&img->cache_lock);
+    if (!test_bit(img->loaded, block)) {
+        char *p = (char *) img->fp + (size_t) block * BLOCK_SIZE;
+        uint32_t sum = stored_sum(img->fp, block);
+        if (unpack_block(img->pack_fd, &img->pack_index[block], p) != 0) {
+            // read as zeros, and counted like a block failing its checksum
+            memset(p, 0, BLOCK_SIZE);
+            __atomic_fetch_add(&img->bad_blocks, 1, __ATOMIC_RELAXED);
+        } else if (sum != 0 && crc32c(0, p, BLOCK_SIZE) != sum) {
+            __atomic_fetch_add(&img->bad_blocks, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_or(&img->loaded[block / 64], 1ULL << (block % 64), __ATOMIC_RELEASE);
+        STORE(img->resident, img->resident + 1);
+        STAT_ADD(fs, bytes_read, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&img->cache_lock);
+}
+
+// Makes sure the blocks are in memory and marks them referenced.
+void cache_touch(struct extfs *fs, uint32_t block, uint32_t len) {
+    struct image *img = fs->img;
+    for (uint32_t b = block; b < block + len; b++) {
+        uint64_t bit = 1ULL << (b % 64);
+        if (!(__atomic_load_n(&img->loaded[b / 64], __ATOMIC_ACQUIRE) & bit)) {
+            cache_fault(fs, b);
+        }
+        if (!(LOAD(img->referenced[b / 64]) & bit)) {
+            __atomic_fetch_or(&img->referenced[b / 64], bit, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Takes newly allocated blocks as loaded, without reading them.
+void cache_mark_loaded(struct extfs *fs, uint32_t block, uint32_t len) {
+    struct image *img = fs->img;
+    pthread_mutex_lock(&img->cache_lock);
+    for (uint32_t b = block; b < block + len; b++) {
+        if (!test_bit(img->loaded, b)) {
+            __atomic_fetch_or(&img->loaded[b / 64], 1ULL << (b % 64), __ATOMIC_RELEASE);
+            STORE(img->resident, img->resident + 1);
+        }
+    }
+    pthread_mutex_unlock(&img->cache_lock);
+}
+
+void cache_load_all(struct extfs *fs) {
+    for (uint32_t b = 0; b < fs->img->fp->blocks_count; b++) {
+        if (!test_bit(fs->img->loaded, b)) {
+            cache_fault(fs, b);
+        }
+    }
+}
+
+// Stops reading lazily, all blocks in memory are taken as they are.
+void cache_drop(struct extfs *fs) {
+    struct image *img = fs->img;
+    pthread_mutex_lock(&img->cache_lock);
+    if (img->pack_fd >= 0) {
+        close(img->pack_fd);
+        img->pack_fd = -1;
+    }
+    free(img->pack_index);
+    free(img->loaded);
+    free(img->referenced);
+    img->pack_index = NULL;
+    img->loaded = img->referenced = NULL;
+    STORE(img->resident, 0);
+    STORE(img->lazy, 0);
+    pthread_mutex_unlock(&img->cache_lock);
+}
+
+// Drops clean data blocks from memory in CLOCK order until at most target
+// are left. Needs the image exclusive and no checkpoint running.
+void cache_evict(struct extfs *fs, uint32_t target) {
+    struct image *img = fs->img;
+    uint32_t blocks = img->fp->blocks_count;
+    for (uint32_t scanned = 0; img->resident > target && scanned < 2 * blocks; scanned++) {
+        uint32_t b = img->clock_hand;
+        img->clock_hand = (b + 1) % blocks;
+        uint64_t bit = 1ULL << (b % 64);
+        if (!(img->loaded[b / 64] & bit) || (img->dirty_chunks[b / 64] & bit) || block_metadata(fs, b))
+            continue;
+        if (img->referenced[b / 64] & bit) {
+            img->referenced[b / 64] &= ~bit;
+            continue;
+        }
+        madvise((char *) img->fp + (size_t) b * BLOCK_SIZE, BLOCK_SIZE, MADV_DONTNEED);
+        img->loaded[b / 64] &= ~bit;
+        STORE(img->resident, img->resident - 1);
+    }
+}
+
+
+// Copies the checkpoint into the image. Applying it twice is harmless.
+int apply_checkpoint(struct extfs *fs, struct checkpoint *c) {
+    if (fs->img->packed)
+        return apply_pack(fs, c);
+    int fd = open(fs->img->data_file, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return ERROR;
+    // the file only ever shrinks with a format, which also dropped its mapping
+    struct stat st;
+    off_t size = (off_t) c->header.blocks * BLOCK_SIZE;
+    if (((c->header.flags & CHECKPOINT_TRUNCATE) && ftruncate(fd, 0) != 0) || fstat(fd, &st) != 0 ||
+        (st.st_size < size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return ERROR;
+    }
+    char *p = c->body, *end = c->body + c->header.body_len;
+    while (p < end) {
+        uint64_t range[2];
+        memcpy(range, p, sizeof(range));
+        p += sizeof(range);
+        if (range[1] & CHECKPOINT_HOLE) {
+            // where holes are not supported the unused blocks keep their bytes
+            if (!(c->header.flags & CHECKPOINT_TRUNCATE)) {
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1] & ~CHECKPOINT_HOLE);
+            }
+            continue;
+        }
+        if (pwrite(fd, p, range[1], range[0]) != (ssize_t) range[1]) {
+            close(fd);
+            return ERROR;
+        }
+        p += range[1];
+    }
+    int result = fsync(fd) == 0 ? 0 : ERROR;
+    close(fd);
+    return result;
+}
+
+void *checkpoint_main(void *arg) {
+    struct checkpoint *c = (struct checkpoint *) arg;
+    struct extfs *fs = c->fs;
+    if (write_checkpoint(fs, c) != 0 || apply_checkpoint(fs, c) != 0) {
+        c->failed = 1;
+        return c;
+    }
+    unlink(fs->img->old_journal_file);
+    sync_dir(fs);
+    unlink(fs->img->checkpoint_file);
+    sync_dir(fs);
+    return c;
+}
+
+// Puts the chunks of a failed checkpoint back into the dirty set.
+void restore_checkpoint(struct extfs *fs, struct checkpoint *c) {
+    char *p = c->body, *end = c->body + c->header.body_len;
+    while (p < end) {
+        uint64_t range[2];
+        memcpy(range, p, sizeof(range));
+        uint64_t len = range[1] & ~CHECKPOINT_HOLE;
+        if (range[0] + len <= fs->img->image_size) {
+            mark_dirty(fs, (char *) fs->img->fp + range[0], len);
+        }
+        p += sizeof(range) + (range[1] & CHECKPOINT_HOLE ? 0 : len);
+    }
+    if (c->header.flags & CHECKPOINT_TRUNCATE) {
+        fs->img->format_pending = 1;
+    }
+}
+
+// Reaps a background checkpoint. If it failed, its chunks are dirty again
+// and the next checkpoint has to run synchronously.
+int finish_checkpoint(struct extfs *fs, struct checkpoint *c) {
+    int failed = c->failed;
+    if (failed) {
+        STORE(fs->img->io_failed, 1);
+        restore_checkpoint(fs, c);
+        fs->img->checkpoint_failed = 1;
+    }
+    free(c->body);
+    free(c);
+    return failed ? ERROR : 0;
+}
+
+void wait_checkpoint(struct extfs *fs) {
+    if (!fs->img->checkpoint_running)
+        return;
+    void *c;
+    pthread_join(fs->img->checkpoint_thread, &c);
+    fs->img->checkpoint_running = 0;
+    finish_checkpoint(fs, (struct checkpoint *) c);
+}
+
+int checkpoint(struct extfs *fs, int background) {
+    // before waiting, logging the reclaim may start another checkpoint
+    reclaim(fs, UINT32_MAX);
+    wait_checkpoint(fs);
+    if (background && !fs->img->checkpoint_failed) {
+        // rotate the journal so that new records do not depend on this checkpoint
+        pthread_mutex_lock(&fs->img->journal_flush_lock);
+        if (journal_write_pending(fs, 1) != 0 || rename(fs->img->journal_file, fs->img->old_journal_file) != 0) {
+            pthread_mutex_unlock(&fs->img->journal_flush_lock);
+            return ERROR;
+        }
+        sync_dir(fs);
+        close(fs->img->journal_fd);
+        fs->img->journal_fd = open(fs->img->journal_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        fs->img->journal_size = 0;
+        pthread_mutex_unlock(&fs->img->journal_flush_lock);
+
+        struct checkpoint *c = capture_checkpoint(fs);
+        if (pthread_create(&fs->img->checkpoint_thread, NULL, checkpoint_main, c) == 0) {
+            fs->img->checkpoint_running = 1;
+            return 0;
+        }
+        return finish_checkpoint(fs, (struct checkpoint *) checkpoint_main(c));
+    }
+
+    if (journal_flush(fs, 1) != 0)
+        return ERROR;
+    struct checkpoint *c = capture_checkpoint(fs);
+    int result = 0;
+    if (write_checkpoint(fs, c) != 0 || apply_checkpoint(fs, c) != 0) {
+        result = ERROR;
+    } else {
+        pthread_mutex_lock(&fs->img->journal_flush_lock);
+        if (fs->img->journal_fd >= 0 && (ftruncate(fs->img->journal_fd, 0) != 0 || fsync(fs->img->journal_fd) != 0)) {
+            result = ERROR;
+        }
+        fs->img->journal_size = 0;
+        pthread_mutex_unlock(&fs->img->journal_flush_lock);
+        if (result == 0) {
+            unlink(fs->img->old_journal_file);
+            sync_dir(fs);
+            unlink(fs->img->checkpoint_file);
+            sync_dir(fs);
+            fs->img->checkpoint_failed = 0;
+        }
+    }
+    if (result != 0) {
+        // keep the chunks for the next attempt
+        restore_checkpoint(fs, c);
+    }
+    free(c->body);
+    free(c);
+    return result;
+}
+
+// Writes the dirty chunks back to data_file
+int save_dirty(struct extfs *fs) {
+    reclaim(fs, UINT32_MAX);
+    if (fs->img->fs_fd < 0 || !fs->img->fs_shared) {
+        struct checkpoint *c = capture_checkpoint(fs);
+        int result = apply_checkpoint(fs, c);
+        if (result != 0) {
+            restore_checkpoint(fs, c);
+        }
+        free(c->body);
+        free(c);
+        return result;
+    }
+    update_sums(fs);
+    size_t chunk = 0, offset, len, start = SIZE_MAX, end = 0;
+    int hole;
+    long page = sysconf(_SC_PAGESIZE);
+    while (next_save_range(fs, &chunk, &offset, &len, &hole)) {
+        if (hole) {
+            // drops the pages from the mapping as well
+            fallocate(fs->img->fs_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+            continue;
+        }
+        start = offset < start ? offset : start;
+        end = offset + len;
+    }
+    // one msync over all ranges, the file system commits once per call and
+    // the clean pages in between cost nothing
+    start -= start % page;
+    if (end > 0 && msync((char *) fs->img->fp + start, end - start, MS_SYNC) != 0)
+        return ERROR;
+    clear_dirty(fs);
+    return 0;
+}
+
+// Brings the data blocks in memory back under CACHE_BLOCKS, writing dirty
+// ones back when dropping clean ones is not enough.
+void cache_shrink(struct extfs *fs) {
+    struct image *img = fs->img;
+    uint32_t target = CACHE_BLOCKS / 4 * 3;
+    lock_image_exclusive(fs);
+    pthread_mutex_lock(&img->update_lock);
+    if (img->lazy && img->resident > img->cache_limit) {
+        wait_checkpoint(fs);
+        cache_evict(fs, target);
+        if (img->resident > target) {
+            if (img->journal_policy == EXTFS_JOURNAL_OFF) {
+                if (save_dirty(fs) != 0) {
+                    STORE(img->io_failed, 1);
+                }
+            } else if (checkpoint(fs, 0) != 0) {
+                STORE(img->io_failed, 1);
+            }
+            cache_evict(fs, target);
+        }
+        // if even that did not help, wait for the cache to grow some more
+        STORE(img->cache_limit, img->resident > CACHE_BLOCKS ? img->resident + CACHE_BLOCKS / 4 : CACHE_BLOCKS);
+    }
+    pthread_mutex_unlock(&img->update_lock);
+    unlock_image_exclusive(fs);
+}
+
+void journal_log(struct extfs *fs, uint32_t type, uint32_t dir, uint32_t target, const char *name,
+                 const char *data, uint32_t data_len) {
+    if (fs->img->journal_policy == EXTFS_JOURNAL_OFF || fs->img->replaying)
+        return;
+    struct journal_record r;
+    memset(&r, 0, sizeof(r));
+    r.magic = JOURNAL_MAGIC;
+    r.type = type;
+    r.seq = ++fs->img->journal_seq;
+    r.dir = dir;
+    r.target = target;
+    r.name_len = name == NULL ? 0 : (uint32_t) strlen(name);
+    r.data_len = data_len;
+    r.checksum = checksum(checksum(checksum(CHECKSUM_SEED, &r, sizeof(r)), name, r.name_len),
+                          data, data_len);
+    size_t len = sizeof(r) + r.name_len + data_len;
+
+    pthread_mutex_lock(&fs->img->journal_lock);
+    if (fs->img->journal_len + len > fs->img->journal_cap) {
+        fs->img->journal_cap = (fs->img->journal_len + len) * 2;
+        fs->img->journal_buf = (char *) realloc(fs->img->journal_buf, fs->img->journal_cap);
+    }
+    memcpy(fs->img->journal_buf + fs->img->journal_len, &r, sizeof(r));
+    if (name != NULL)
+        memcpy(fs->img->journal_buf + fs->img->journal_len + sizeof(r), name, r.name_len);
+    if (data != NULL)
+        memcpy(fs->img->journal_buf + fs->img->journal_len + sizeof(r) + r.name_len, data, data_len);
+    fs->img->journal_len += len;
+    fs->img->journal_size += len;
+    uint32_t pending = ++fs->img->journal_pending;
+    pthread_cond_signal(&fs->img->journal_cond);
+    pthread_mutex_unlock(&fs->img->journal_lock);
+
+    if (fs->img->journal_policy == EXTFS_JOURNAL_SYNC || !fs->img->journal_flusher_running) {
+        journal_flush(fs, fs->img->journal_policy != EXTFS_JOURNAL_ASYNC);
+    } else if (pending >= JOURNAL_GROUP_RECORDS) {
+        journal_flush(fs, 1);
+    }
+    if (fs->img->journal_size >= JOURNAL_CHECKPOINT_BYTES && !fs->img->checkpoint_running &&
+        checkpoint(fs, 1) != 0) {
+        STORE(fs->img->io_failed, 1);
+    }
+}
+
+void apply_record(struct extfs *fs, struct journal_record *r, char *name, char *data) {
+    if (r->type == JR_FMT) {
+        // records from before sized formats carry no counts
+        format(fs, r->dir != 0 ? r->dir : DEFAULT_INODES, r->target != 0 ? r->target : DEFAULT_BLOCKS);
+    } else if (r->type == JR_RESIZE) {
+        do_resize(fs, r->target);
+    } else if (r->type == JR_MKDIR) {
+        do_mkdir(fs, r->dir, name);
+    } else if (r->type == JR_ECHO) {
+        do_echo(fs, r->dir, name, data, r->data_len);
+    } else if (r->type == JR_RM) {
+        do_rm(fs, r->dir, name);
+    } else if (r->type == JR_RMDIR) {
+        do_rmdir(fs, r->dir, r->target);
+    } else if (r->type == JR_DETACH) {
+        do_rmdir_lazy(fs, r->dir, r->target);
+    } else if (r->type == JR_RECLAIM) {
+        free_subtrees(fs, &fs->img->orphans, r->target);
+    } else if (r->type == JR_DEFRAG) {
+        // target tells a whole defrag from a repack after an unlink
+        if (r->target != 0) {
+            struct extfs_defrag_stats st;
+            memset(&st, 0, sizeof(st));
+            defrag_tree(fs, r->dir, &st);
+        } else {
+            repack_dir(fs, r->dir);
+        }
+    } else if (r->type == JR_SNAPSHOT && r->data_len == sizeof(uint64_t)) {
+        uint64_t taken;
+        memcpy(&taken, data, sizeof(taken));
+        do_snapshot(fs, name, taken);
+    } else if (r->type == JR_ROLLBACK) {
+        do_rollback(fs, name);
+    } else if (r->type == JR_DROP_SNAPSHOT) {
+        do_drop_snapshot(fs, name);
+    }
+}
+
+// Replays the records of file newer than after and stores the length of its
+// valid prefix in *valid. Returns ERROR if the file does not exist.
+int replay_journal(struct extfs *fs, const char *file, uint64_t after, uint32_t *replayed, size_t *valid) {
+    size_t len;
+    char *data = read_whole_file(file, &len);
+    if (data == NULL)
+        return ERROR;
+    size_t pos = 0;
+    char name[MAX_FILENAME];
+    while (pos + sizeof(struct journal_record) <= len) {
+        struct journal_record r;
+        memcpy(&r, data + pos, sizeof(r));
+        // a header whose payload was never written all the way is a torn tail
+        if (r.magic != JOURNAL_MAGIC || r.name_len >= MAX_FILENAME ||
+            (uint64_t) r.name_len + r.data_len > len - pos - sizeof(r))
+            break;
+        char *payload = data + pos + sizeof(r);
+        uint32_t expected = r.checksum;
+        r.checksum = 0;
+        if (checksum(checksum(checksum(CHECKSUM_SEED, &r, sizeof(r)), payload, r.name_len),
+                     payload + r.name_len, r.data_len) != expected)
+            break; // torn tail
+        if (r.seq > after) {
+            memcpy(name, payload, r.name_len);
+            name[r.name_len] = '\0';
+            apply_record(fs, &r, name, payload + r.name_len);
+            (*replayed)++;
+        }
+        if (r.seq > fs->img->journal_seq) {
+            fs->img->journal_seq = r.seq;
+        }
+        pos += sizeof(r) + r.name_len + r.data_len;
+    }
+    free(data);
+    *valid = pos;
+    return 0;
+}
+
+// Applies a complete checkpoint left behind by a crash, if there is one.
+// Returns 1 and sets *seq when it did.
+int recover_checkpoint(struct extfs *fs, uint64_t *seq) {
+    size_t len;
+    unlink(fs->img->checkpoint_temp_file);
+    unlink(fs->img->pack_temp_file);
+    char *data = read_whole_file(fs->img->checkpoint_file, &len);
+    if (data == NULL)
+        return 0;
+    struct checkpoint c;
+    memset(&c, 0, sizeof(c));
+    int valid = 0;
+    if (len >= sizeof(c.header)) {
+        memcpy(&c.header, data, sizeof(c.header));
+        c.body = data + sizeof(c.header);
+        valid = c.header.magic == CHECKPOINT_MAGIC && c.header.body_len == len - sizeof(c.header) &&
+                c.header.checksum == checksum(CHECKSUM_SEED, c.body, c.header.body_len);
+    }
+    if (!valid) {
+        // torn before it was renamed into place, the image was never touched
+        unlink(fs->img->checkpoint_file);
+    } else if (apply_checkpoint(fs, &c) == 0) {
+        *seq = c.header.seq;
+        free(data);
+        return 1;
+    } else {
+        STORE(fs->img->io_failed, 1);
+    }
+    free(data);
+    return 0;
+}
+
+void journal_close(struct extfs *fs) {
+    if (fs->img->journal_policy == EXTFS_JOURNAL_OFF)
+        return;
+    wait_checkpoint(fs);
+    journal_flush(fs, 1);
+    pthread_mutex_lock(&fs->img->journal_flush_lock);
+    if (fs->img->journal_fd >= 0) {
+        close(fs->img->journal_fd);
+        fs->img->journal_fd = -1;
+    }
+    pthread_mutex_unlock(&fs->img->journal_flush_lock);
+}
+
+// Brings the freshly loaded image up to date with the journal.
+void journal_recover(struct extfs *fs, uint64_t after, int recovered) {
+    uint32_t replayed = 0;
+    size_t valid = 0;
+    fs->img->journal_seq = after;
+    fs->img->replaying = 1;
+    int had_old = replay_journal(fs, fs->img->old_journal_file, after, &replayed, &valid) == 0;
+    valid = 0;
+    replay_journal(fs, fs->img->journal_file, after, &replayed, &valid);
+    fs->img->replaying = 0;
+    if (replayed > 0) {
+        info(fs, "Replayed %u journal records.\n", replayed);
+    }
+    if (fs->img->journal_policy == EXTFS_JOURNAL_OFF) {
+        // left over from a journaled session, fold it into the image for good
+        if ((replayed > 0 || recovered) && save_dirty(fs) != 0) {
+            STORE(fs->img->io_failed, 1);
+            return;
+        }
+        unlink(fs->img->journal_file);
+        unlink(fs->img->old_journal_file);
+        sync_dir(fs);
+        unlink(fs->img->checkpoint_file);
+        return;
+    }
+
+    pthread_mutex_lock(&fs->img->journal_flush_lock);
+    fs->img->journal_fd = open(fs->img->journal_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fs->img->journal_fd < 0 || ftruncate(fs->img->journal_fd, valid) != 0) {
+        // changes are only kept in memory
+        STORE(fs->img->io_failed, 1);
+    }
+    fs->img->journal_size = valid;
+    pthread_mutex_unlock(&fs->img->journal_flush_lock);
+
+    int result = 0;
+    if (recovered || had_old) {
+        // leftovers of an interrupted checkpoint, fold everything in now
+        result = checkpoint(fs, 0);
+    } else if (valid > 0) {
+        result = checkpoint(fs, 1);
+    }
+    if (result != 0) {
+        STORE(fs->img->io_failed, 1);
+    }
+}
+
+void unmap_fs(struct extfs *fs) {
+    if (fs->img->fs_fd >= 0) {
+        munmap(fs->img->fp, fs->img->image_size);
+        close(fs->img->fs_fd);
+        fs->img->fs_fd = -1;
+        fs->img->fp = NULL;
+    }
+}
+
+// Map data_file so that fp refers to the image itself. With journaling on the
+// mapping is private and the file is only written by checkpoints.
+// Returns 1 if the file was just created, 0 if it existed, ERROR on failure.
+int map_fs(struct extfs *fs) {
+    struct stat st;
+    struct super_block header;
+    int fd = open(fs->img->data_file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return ERROR;
+    memset(&header, 0, sizeof(header));
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) < 0) {
+        close(fd);
+        return ERROR;
+    }
+    // an image we do not know is formatted right away
+    size_t size = header_image_size(&header);
+    if (size == 0) {
+        size = BLOCK_SIZE;
+    }
+    if (st.st_size < (off_t) size && ftruncate(fd, size) != 0) {
+        close(fd);
+        return ERROR;
+    }
+    int shared = fs->img->journal_policy == EXTFS_JOURNAL_OFF;
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return ERROR;
+    }
+    free(fs->img->fp);
+    fs->img->fp = (struct super_block *) addr;
+    fs->img->image_size = size;
+    resize_dirty_chunks(fs, size);
+    fs->img->fs_fd = fd;
+    fs->img->fs_shared = shared;
+    return st.st_size == 0;
+}
+
+void load_fs(struct extfs *fs) {
+    int created = fs->img->packed ? load_pack(fs) : map_fs(fs);
+    if (created == ERROR) {
+        // fall back to keeping a private copy of the image in memory
+        struct super_block header;
+        memset(&header, 0, sizeof(header));
+        FILE *FP = fopen(fs->img->data_file, "rb");
+        if (FP == NULL) {
+            info(fs, "File not found -- creating a new disk.\n");
+            format(fs, DEFAULT_INODES, DEFAULT_BLOCKS);
+            return;
+        }
+        size_t size = fread(&header, sizeof(header), 1, FP) == 1 ? header_image_size(&header) : 0;
+        if (size == 0) {
+            size = BLOCK_SIZE;
+        }
+        free(fs->img->fp);
+        fs->img->fp = (struct super_block *) calloc(1, size);
+        fs->img->image_size = size;
+        resize_dirty_chunks(fs, size);
+        rewind(FP);
+        if (fread(fs->img->fp, size, 1, FP) != 1 || fs->img->packed) {
+            // short image or one to pack, the next save has to write all of it
+            mark_all_dirty(fs);
+        }
+        fclose(FP);
+    } else if (created) {
+        info(fs, "File not found -- creating a new disk.\n");
+        format(fs, DEFAULT_INODES, DEFAULT_BLOCKS);
+        return;
+    }
+    info(fs, "Reading done.\n");
+    uint32_t version = fs->img->fp->version;
+    size_t size = header_image_size(fs->img->fp);
+    if (size == 0 || (!fixed_version(version) && size != fs->img->image_size)) {
+        info(fs, "ERR: disk version mismatch -- creating a new disk.\n");
+        format(fs, DEFAULT_INODES, DEFAULT_BLOCKS);
+        return;
+    }
+    if (version == CURRENT_VERSION) {
+        verify_sums(fs);
+        return;
+    }
+    info(fs, "Upgrading disk from version %u.\n", version);
+    if (fixed_version(version)) {
+        upgrade_fs(fs);
+    } else if (version == GROUP_VERSION || version == INLINE_VERSION) {
+        // GROUP_VERSION only lacks inline files, which are flagged
+        upgrade_inline_fs(fs);
+    }
+    // RECORD_VERSION only lacks snapshots, and its snapshot_table is zero.
+    // SNAPSHOT_VERSION only lacks checksums.
+    upgrade_sums_fs(fs);
+}
+
+#ifdef EXTFS_STATS
+// Bytes the next save writes.
+uint64_t dirty_bytes(struct extfs *fs) {
+    size_t chunk = 0, offset, len;
+    uint64_t bytes = 0;
+    while (next_dirty_range(fs, &chunk, &offset, &len)) {
+        bytes += len;
+    }
+    return bytes;
+}
+#endif
+
+int read_fs(struct extfs *fs) {
+    info(fs, "Reading fs from %s ...\n", fs->img->data_file);
+    journal_close(fs);
+    cache_drop(fs);
+    unmap_fs(fs);
+    dcache_clear(fs);
+    drop_subtrees(fs);
+    clear_dirty(fs);
+    fs->img->orphans.count = 0;
+    fs->img->format_pending = 0;
+    fs->img->bad_blocks = 0;
+    STORE(fs->img->io_failed, 0);
+    fs->img->packed = fs->img->pack_wanted || is_pack(fs->img->data_file);
+    uint64_t after = 0;
+    int recovered = recover_checkpoint(fs, &after);
+    reset_cwds(fs);
+    load_fs(fs);
+    load_refs(fs);
+    journal_recover(fs, after, recovered);
+    // the blocks of a lazily read pack are counted as cache_fault brings them in
+    STAT_ADD(fs, bytes_read, fs->img->lazy ? 0 : fs->img->image_size);
+    return EXTFS_OK;
+}
+
+// Its status covers the failures kept for extfs_check_io so far, which it
+// clears.
+int write_fs(struct extfs *fs) {
+    info(fs, "Now saving data to disk..\n");
+    STAT_ADD(fs, bytes_written, dirty_bytes(fs));
+    int failed = fs->img->journal_policy != EXTFS_JOURNAL_OFF ? checkpoint(fs, 0) != 0 : save_dirty(fs) != 0;
+    STORE(fs->img->io_failed, 0);
+    if (failed)
+        return EXTFS_IO;
+    info(fs, "Saving done.\n");
+    return EXTFS_OK;
+}
+
+int extfs_parse_journal_policy(const char *name) {
+    const char *names[] = {"off", "async", "group", "sync"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    }
+    return ERROR;
+}
+
+// Public interface
+
+const char *extfs_strerror(int status) {
+    const char *messages[] = {
+        "Success",
+        "Path not found",
+        "File not found",
+        "Bad path",
+        "Path length exceed limit",
+        "Name already occupied",
+        "Name length exceed limit",
+        "Name cannot be empty",
+        "Name cannot contain invalid char",
+        "Name cannot be \"..\" or \".\"",
+        "Already at root",
+        "Cannot use root",
+        "Is a dir",
+        "Not a dir",
+        "No inode left",
+        "No block left",
+        "No contiguous space left",
+        "Bad inode or block count",
+        "Disk too large",
+        "Disk can only grow",
+        "Cannot resize the disk",
+        "Cannot save the disk",
+        "Too many snapshots",
+        "Statistics are compiled out",
+        "Cannot access the host files",
+    };
+    if (status < 0 || status >= (int) (sizeof(messages) / sizeof(messages[0])))
+        return "Unknown error";
+    return messages[status];
+}
+
+// Copies path so that it can be split, ERROR if it is too long.
+int copy_path(struct extfs *fs, char *copy, const char *path) {
+    size_t len = strlen(path);
+    if (len >= MAX_PATH)
+        return fail(fs, EXTFS_PATH_TOO_LONG);
+    memcpy(copy, path, len + 1);
+    return 0;
+}
+
+// Finds the dir that should hold the last component of path and checks the
+// component, which *name is pointed at. Splits path in place.
+uint32_t find_parent(struct extfs *fs, char *path, char **name) {
+    split_path(&path, name);
+    uint32_t dir = find_path_inode(fs, path);
+    if (dir == ERROR || check_filename_valid(fs, *name) == ERROR)
+        return ERROR;
+    if (get_inode(fs, dir)->mode != MODE_DIR)
+        return fail(fs, EXTFS_BAD_PATH);
+    return dir;
+}
+
+char *suffixed_name(const char *path, const char *suffix) {
+    char *name = (char *) malloc(strlen(path) + strlen(suffix) + 1);
+    strcpy(name, path);
+    strcat(name, suffix);
+    return name;
+}
+
+struct extfs *extfs_open(const char *path, int journal_policy, int flags) {
+    struct extfs *fs = (struct extfs *) calloc(1, sizeof(struct extfs));
+    struct image *img = (struct image *) calloc(1, sizeof(struct image));
+    if (fs == NULL || img == NULL) {
+        free(fs);
+        free(img);
+        return NULL;
+    }
+    fs->img = img;
+    img->handles = fs;
+    img->self.img = img;
+    const char *slash = strrchr(path, '/');
+    img->data_file = suffixed_name(path, "");
+    img->journal_file = suffixed_name(path, JOURNAL_SUFFIX);
+    img->old_journal_file = suffixed_name(path, OLD_JOURNAL_SUFFIX);
+    img->checkpoint_file = suffixed_name(path, CHECKPOINT_SUFFIX);
+    img->checkpoint_temp_file = suffixed_name(path, CHECKPOINT_TEMP_SUFFIX);
+    img->pack_temp_file = suffixed_name(path, PACK_TEMP_SUFFIX);
+    img->dir_name = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : (size_t) (slash - path));
+    img->quiet = flags & EXTFS_QUIET;
+    img->pack_wanted = (flags & EXTFS_PACKED) != 0;
+    img->lazy_free = (flags & EXTFS_LAZY_FREE) != 0;
+    img->fs_fd = -1;
+    img->journal_fd = -1;
+    img->pack_fd = -1;
+    img->journal_policy = journal_policy;
+    img->dcache_epoch = 1;
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_rwlock_init(&img->self.lock, NULL);
+    pthread_mutex_init(&img->handles_lock, NULL);
+    pthread_mutex_init(&img->update_lock, NULL);
+    for (int i = 0; i < DIR_LOCKS; i++) {
+        pthread_rwlock_init(&img->dir_locks[i], NULL);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&img->dcache_locks[i], NULL);
+    }
+    pthread_mutex_init(&img->cache_lock, NULL);
+    pthread_mutex_init(&img->journal_lock, NULL);
+    pthread_mutex_init(&img->journal_flush_lock, NULL);
+    pthread_cond_init(&img->journal_cond, NULL);
+    pthread_mutex_init(&img->reclaim_lock, NULL);
+    pthread_cond_init(&img->reclaim_cond, NULL);
+    journal_start(fs);
+    read_fs(fs);
+    reclaim_start(fs);
+    return fs;
+}
+
+struct extfs *extfs_dup(struct extfs *fs) {
+    struct extfs *dup = (struct extfs *) calloc(1, sizeof(struct extfs));
+    if (dup == NULL)
+        return NULL;
+    dup->img = fs->img;
+    dup->cur_dir = fs->cur_dir;
+    pthread_rwlock_init(&dup->lock, NULL);
+    pthread_mutex_lock(&fs->img->handles_lock);
+    dup->next = fs->img->handles;
+    fs->img->handles = dup;
+    pthread_mutex_unlock(&fs->img->handles_lock);
+    return dup;
+}
+
+int extfs_close(struct extfs *fs) {
+    struct image *img = fs->img;
+    pthread_mutex_lock(&img->handles_lock);
+    struct extfs **link = &img->handles;
+    while (*link != fs) link = &(*link)->next;
+    *link = fs->next;
+    img->dcache_hits += fs->dcache_hits;
+    img->dcache_negative_hits += fs->dcache_negative_hits;
+    img->dcache_misses += fs->dcache_misses;
+    img->dcache_invalidations += fs->dcache_invalidations;
+#ifdef EXTFS_STATS
+    add_counters(&img->counters, &fs->counters);
+#endif
+    int last = img->handles == NULL;
+    pthread_mutex_unlock(&img->handles_lock);
+    pthread_rwlock_destroy(&fs->lock);
+    if (!last) {
+        free(fs);
+        return EXTFS_OK;
+    }
+
+    // the last handle takes the image down
+    reclaim_shutdown(fs);
+    int status = write_fs(fs);
+    journal_close(fs);
+    journal_shutdown(fs);
+    cache_drop(fs);
+    unmap_fs(fs);
+    free(img->fp);
+    free(img->dirty_chunks);
+    free(img->journal_buf);
+    free(img->journal_spare);
+    free(img->orphans.dirs);
+    free(img->refs);
+    free(img->subtrees);
+    pthread_rwlock_destroy(&img->self.lock);
+    pthread_mutex_destroy(&img->handles_lock);
+    pthread_mutex_destroy(&img->update_lock);
+    for (int i = 0; i < DIR_LOCKS; i++) {
+        pthread_rwlock_destroy(&img->dir_locks[i]);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&img->dcache_locks[i]);
+    }
+    pthread_mutex_destroy(&img->cache_lock);
+    pthread_mutex_destroy(&img->journal_lock);
+    pthread_mutex_destroy(&img->journal_flush_lock);
+    pthread_cond_destroy(&img->journal_cond);
+    pthread_mutex_destroy(&img->reclaim_lock);
+    pthread_cond_destroy(&img->reclaim_cond);
+    free(img->data_file);
+    free(img->journal_file);
+    free(img->old_journal_file);
+    free(img->checkpoint_file);
+    free(img->checkpoint_temp_file);
+    free(img->pack_temp_file);
+    free(img->dir_name);
+    free(img);
+    free(fs);
+    return status;
+}
+
+int extfs_sync(struct extfs *fs) {
+    STAT_BEGIN(start);
+    begin_update(fs);
+    int status = write_fs(fs);
+    end_update(fs);
+    STAT_END(fs, EXTFS_OP_SYNC, start);
+    return status;
+}
+
+int extfs_check_io(struct extfs *fs) {
+    return __atomic_exchange_n(&fs->img->io_failed, 0, __ATOMIC_RELAXED) ? EXTFS_IO : EXTFS_OK;
+}
+
+int extfs_reload(struct extfs *fs) {
+    lock_image_exclusive(fs);
+    int status = read_fs(fs);
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_format(struct extfs *fs, uint32_t inodes, uint32_t blocks) {
+    lock_image_exclusive(fs);
+    int status = EXTFS_OK;
+    if (format(fs, inodes, blocks) == ERROR) {
+        status = fs->error;
+    } else {
+        journal_log(fs, JR_FMT, inodes, blocks, NULL, NULL, 0);
+    }
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_resize(struct extfs *fs, uint32_t blocks) {
+    lock_image_exclusive(fs);
+    int status = EXTFS_OK;
+    if (do_resize(fs, blocks) == ERROR) {
+        status = fs->error;
+    } else {
+        journal_log(fs, JR_RESIZE, 0, blocks, NULL, NULL, 0);
+    }
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_trim(struct extfs *fs) {
+    begin_update(fs);
+    for (uint32_t b = 0; b < fs->img->fp->blocks_count; b++) {
+        if (block_unused(fs, b)) {
+            mark_block_dirty(fs, b);
+        }
+    }
+    int status = write_fs(fs);
+    end_update(fs);
+    return status;
+}
+
+int extfs_defrag(struct extfs *fs, struct extfs_defrag_stats *st) {
+    memset(st, 0, sizeof(*st));
+    lock_image_exclusive(fs);
+    defrag_tree(fs, ROOT_INODE, st);
+    journal_log(fs, JR_DEFRAG, ROOT_INODE, 1, NULL, NULL, 0);
+    unlock_image_exclusive(fs);
+    return EXTFS_OK;
+}
+
+int extfs_fsck(struct extfs *fs, int repair, extfs_fsck_fn fn, void *arg, struct extfs_fsck_stats *st) {
+    memset(st, 0, sizeof(*st));
+    if (!repair) {
+        begin_update(fs);
+        do_fsck(fs, 0, fn, arg, st);
+        end_update(fs);
+        return EXTFS_OK;
+    }
+    lock_image_exclusive(fs);
+    int status = do_fsck(fs, 1, fn, arg, st) > 0 ? write_fs(fs) : EXTFS_OK;
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_set_defrag_threshold(struct extfs *fs, uint32_t percent) {
+    lock_image_exclusive(fs);
+    fs->img->defrag_threshold = percent < 100 ? percent : 100;
+    unlock_image_exclusive(fs);
+    return EXTFS_OK;
+}
+
+int extfs_snapshot_create(struct extfs *fs, const char *name) {
+    if (name[0] == '\0')
+        return EXTFS_NAME_EMPTY;
+    if (strlen(name) >= SNAPSHOT_NAME)
+        return EXTFS_NAME_TOO_LONG;
+    uint64_t now = time(NULL);
+    lock_image_exclusive(fs);
+    int status = EXTFS_OK;
+    if (do_snapshot(fs, name, now) == ERROR) {
+        status = fs->error;
+    } else {
+        journal_log(fs, JR_SNAPSHOT, 0, 0, name, (const char *) &now, sizeof(now));
+    }
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_snapshot_list(struct extfs *fs, extfs_snapshot_fn fn, void *arg) {
+    lock_image(fs);
+    struct snapshot_table *t = snapshot_table(fs);
+    for (uint32_t i = 0; t != NULL && i < t->count; i++) {
+        fn(arg, t->snapshots[i].name, t->snapshots[i].time);
+    }
+    unlock_image(fs);
+    return EXTFS_OK;
+}
+
+int extfs_snapshot_rollback(struct extfs *fs, const char *name) {
+    lock_image_exclusive(fs);
+    int status = EXTFS_OK;
+    if (do_rollback(fs, name) == ERROR) {
+        status = fs->error;
+    } else {
+        journal_log(fs, JR_ROLLBACK, 0, 0, name, NULL, 0);
+    }
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_snapshot_delete(struct extfs *fs, const char *name) {
+    lock_image_exclusive(fs);
+    int status = EXTFS_OK;
+    if (do_drop_snapshot(fs, name) == ERROR) {
+        status = fs->error;
+    } else {
+        journal_log(fs, JR_DROP_SNAPSHOT, 0, 0, name, NULL, 0);
+    }
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int do_extfs_mkdir(struct extfs *fs, char *path) {
+    char *name;
+    remove_ending_slash(path);
+    uint32_t dir = find_parent(fs, path, &name);
+    if (dir == ERROR)
+        return fs->error;
+    lock_dir(fs, dir, 1);
+    int status = EXTFS_OK;
+    if (dir_lookup(fs, dir, name, NULL, NULL) != ERROR) {
+        status = EXTFS_EXISTS;
+    } else {
+        begin_change(fs);
+        if (do_mkdir(fs, dir, name) == ERROR) {
+            status = fs->error;
+        } else {
+            journal_log(fs, JR_MKDIR, dir, 0, name, NULL, 0);
+        }
+        end_change(fs);
+    }
+    unlock_dir(fs, dir);
+    return status;
+}
+
+int extfs_mkdir(struct extfs *fs, const char *path) {
+    char copy[MAX_PATH];
+    if (strcmp(path, "/") == 0)
+        return EXTFS_IS_ROOT;
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = do_extfs_mkdir(fs, copy);
+    unlock_image(fs);
+    STAT_END(fs, EXTFS_OP_MKDIR, start);
+    return status;
+}
+
+int do_extfs_rmdir(struct extfs *fs, char *path) {
+    uint32_t inode = find_path_inode(fs, path);
+    if (inode == ERROR)
+        return fs->error;
+    if (inode == ROOT_INODE) {
+        uint32_t inodes = fs->img->fp->inodes_count, blocks = fs->img->fp->blocks_count;
+        if (format(fs, inodes, blocks) == ERROR)
+            return fs->error;
+        journal_log(fs, JR_FMT, inodes, blocks, NULL, NULL, 0);
+        return EXTFS_OK;
+    }
+    if (get_inode(fs, inode)->mode != MODE_DIR)
+        return EXTFS_NOT_DIR;
+
+    // copy what parent shares with a snapshot first, so that unlinking the
+    // subtree cannot fail any more
+    uint32_t parent = get_inode(fs, inode)->parent;
+    if (own_dir(fs, parent) == ERROR)
+        return fs->error;
+    // working dirs inside the removed subtree move up out of it
+    for (struct extfs *h = fs->img->handles; h != NULL; h = h->next) {
+        for (uint32_t dir = h->cur_dir; dir != ROOT_INODE; dir = get_inode(fs, dir)->parent) {
+            if (dir == inode) {
+                h->cur_dir = parent;
+                break;
+            }
+        }
+    }
+    if (fs->img->lazy_free) {
+        if (do_rmdir_lazy(fs, parent, inode) == ERROR)
+            return EXTFS_BAD_PATH;
+        journal_log(fs, JR_DETACH, parent, inode, NULL, NULL, 0);
+        reclaim_wake(fs);
+    } else {
+        if (do_rmdir(fs, parent, inode) == ERROR)
+            return EXTFS_BAD_PATH;
+        journal_log(fs, JR_RMDIR, parent, inode, NULL, NULL, 0);
+    }
+    defrag_sparse(fs, parent);
+    return EXTFS_OK;
+}
+
+int extfs_rmdir(struct extfs *fs, const char *path) {
+    char copy[MAX_PATH];
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image_exclusive(fs);
+    int status = do_extfs_rmdir(fs, copy);
+    unlock_image_exclusive(fs);
+    STAT_END(fs, EXTFS_OP_RMDIR, start);
+    return status;
+}
+
+int do_extfs_create(struct extfs *fs, char *path, const char *data, uint32_t len) {
+    char *name;
+    uint32_t dir = find_parent(fs, path, &name);
+    if (dir == ERROR)
+        return fs->error;
+    lock_dir(fs, dir, 1);
+    int status = EXTFS_OK;
+    if (dir_lookup(fs, dir, name, NULL, NULL) != ERROR) {
+        status = EXTFS_EXISTS;
+    } else {
+        begin_change(fs);
+        if (do_echo(fs, dir, name, data, len) == ERROR) {
+            status = fs->error;
+        } else {
+            journal_log(fs, JR_ECHO, dir, 0, name, data, len);
+        }
+        end_change(fs);
+    }
+    unlock_dir(fs, dir);
+    return status;
+}
+
+int extfs_create(struct extfs *fs, const char *path, const char *data, uint32_t len) {
+    char copy[MAX_PATH];
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = do_extfs_create(fs, copy, data, len);
+    unlock_image(fs);
+    STAT_END(fs, EXTFS_OP_CREATE, start);
+    return status;
+}
+
+int do_extfs_unlink(struct extfs *fs, char *path) {
+    char *name;
+    fs->sparse_dir = INVALID_INODE;
+    uint32_t dir = find_parent(fs, path, &name);
+    if (dir == ERROR)
+        return fs->error;
+    lock_dir(fs, dir, 1);
+    int status = EXTFS_OK;
+    uint32_t inode = dir_lookup(fs, dir, name, NULL, NULL);
+    if (inode == ERROR) {
+        status = EXTFS_NOT_FOUND;
+    } else if (get_inode(fs, inode)->mode == MODE_DIR) {
+        status = EXTFS_IS_DIR;
+    } else {
+        begin_change(fs);
+        if (do_rm(fs, dir, name) == ERROR) {
+            status = fs->error;
+        } else {
+            journal_log(fs, JR_RM, dir, 0, name, NULL, 0);
+            if (fs->img->defrag_threshold != 0 && dir_sparse(fs, dir)) {
+                fs->sparse_dir = dir;
+            }
+        }
+        end_change(fs);
+    }
+    unlock_dir(fs, dir);
+    return status;
+}
+
+int extfs_unlink(struct extfs *fs, const char *path) {
+    char copy[MAX_PATH];
+    size_t len = strlen(path);
+    if (len > 0 && path[len - 1] == '/')
+        return EXTFS_IS_DIR;
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = do_extfs_unlink(fs, copy);
+    unlock_image(fs);
+    if (status == EXTFS_OK && fs->sparse_dir != INVALID_INODE) {
+        lock_image_exclusive(fs);
+        defrag_sparse(fs, fs->sparse_dir);
+        unlock_image_exclusive(fs);
+    }
+    STAT_END(fs, EXTFS_OP_UNLINK, start);
+    return status;
+}
+
+int do_extfs_read(struct extfs *fs, char *path, extfs_data_fn fn, void *arg) {
+    char *name;
+    uint32_t dir = find_parent(fs, path, &name);
+    if (dir == ERROR)
+        return fs->error;
+    // the file cannot be removed while its dir is locked
+    lock_dir(fs, dir, 0);
+    int status = EXTFS_OK;
+    uint32_t inode = dir_lookup(fs, dir, name, NULL, NULL);
+    if (inode == ERROR) {
+        status = EXTFS_NOT_FOUND;
+    } else if (get_inode(fs, inode)->mode == MODE_DIR) {
+        status = EXTFS_IS_DIR;
+    } else {
+        file_read(fs, inode, fn, arg);
+    }
+    unlock_dir(fs, dir);
+    return status;
+}
+
+int extfs_read(struct extfs *fs, const char *path, extfs_data_fn fn, void *arg) {
+    char copy[MAX_PATH];
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = do_extfs_read(fs, copy, fn, arg);
+    unlock_image(fs);
+    STAT_END(fs, EXTFS_OP_READ, start);
+    return status;
+}
+
+void list_dir(struct extfs *fs, uint32_t inode, extfs_dir_fn fn, void *arg) {
+    if (inode != ROOT_INODE) {
+        fn(arg, "..", 1);
+    }
+    fn(arg, ".", 1);
+    uint32_t temp_inode = inode;
+    do {
+        // the record knows the mode, the inodes are left alone
+        for (int i = next_record(fs, temp_inode, -1); i >= 0; i = next_record(fs, temp_inode, i)) {
+            struct entry *entry = chain_entry(fs, temp_inode, i);
+            if (entry->type == MODE_DIR || entry->type == MODE_FILE) {
+                fn(arg, entry->name, entry->type == MODE_DIR);
+            }
+        }
+        temp_inode = get_inode(fs, temp_inode)->next_inode;
+    } while (temp_inode != INVALID_INODE);
+}
+
+// Reports the names a file has in the dir it was found in.
+void list_file(struct extfs *fs, uint32_t inode, extfs_dir_fn fn, void *arg) {
+    uint32_t temp_inode = fs->temp_parent;
+    do {
+        for (int i = next_record(fs, temp_inode, -1); i >= 0; i = next_record(fs, temp_inode, i)) {
+            if (chain_entry(fs, temp_inode, i)->id == inode) {
+                fn(arg, chain_entry(fs, temp_inode, i)->name, 0);
+            }
+        }
+        temp_inode = get_inode(fs, temp_inode)->next_inode;
+    } while (temp_inode != INVALID_INODE);
+}
+
+int do_extfs_readdir(struct extfs *fs, char *path, extfs_dir_fn fn, void *arg) {
+    uint32_t held;
+    uint32_t inode = walk_path(fs, path, &held);
+    if (inode == ERROR)
+        return fs->error;
+    if (get_inode(fs, inode)->mode == MODE_FILE) {
+        list_file(fs, inode, fn, arg);
+        release_path(fs, held);
+        return EXTFS_OK;
+    }
+    // only rmdir removes dirs, and it waits for the image lock
+    release_path(fs, held);
+    lock_dir(fs, inode, 0);
+    list_dir(fs, inode, fn, arg);
+    unlock_dir(fs, inode);
+    return EXTFS_OK;
+}
+
+int extfs_readdir(struct extfs *fs, const char *path, extfs_dir_fn fn, void *arg) {
+    char copy[MAX_PATH];
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = do_extfs_readdir(fs, copy, fn, arg);
+    unlock_image(fs);
+    STAT_END(fs, EXTFS_OP_READDIR, start);
+    return status;
+}
+
+int extfs_stat(struct extfs *fs, const char *path, struct extfs_stat *st) {
+    char copy[MAX_PATH];
+    uint32_t held;
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = EXTFS_OK;
+    uint32_t inode = walk_path(fs, copy, &held);
+    if (inode == ERROR) {
+        status = fs->error;
+    } else {
+        st->inode = inode;
+        st->is_dir = get_inode(fs, inode)->mode == MODE_DIR;
+        st->size = st->is_dir ? 0 : get_inode(fs, inode)->file_size;
+        release_path(fs, held);
+    }
+    unlock_image(fs);
+    STAT_END(fs, EXTFS_OP_STAT, start);
+    return status;
+}
+
+int extfs_chdir(struct extfs *fs, const char *path) {
+    char copy[MAX_PATH];
+    uint32_t held;
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    STAT_BEGIN(start);
+    lock_image(fs);
+    int status = EXTFS_OK;
+    uint32_t inode = walk_path(fs, copy, &held);
+    if (inode == ERROR) {
+        status = fs->error;
+    } else if (get_inode(fs, inode)->mode != MODE_DIR) {
+        status = EXTFS_BAD_PATH;
+    } else {
+        fs->cur_dir = inode;
+    }
+    if (inode != ERROR) {
+        release_path(fs, held);
+    }
+    unlock_image(fs);
+    STAT_END(fs, EXTFS_OP_CHDIR, start);
+    return status;
+}
+
+// Builds the path of the working directory, following parent pointers up to
+// the root. The entry naming a dir stays put until rmdir removes it.
+char *extfs_getcwd(struct extfs *fs) {
+    size_t len = 0, pos;
+    lock_image(fs);
+    for (uint32_t dir = fs->cur_dir; dir != ROOT_INODE; dir = get_inode(fs, dir)->parent) {
+        len += 1 + strlen(chain_entry(fs, get_inode(fs, dir)->parent_chain, get_inode(fs, dir)->parent_slot)->name);
+    }
+    char *path = (char *) malloc(len + 2);
+    pos = len;
+    path[len] = '\0';
+    for (uint32_t dir = fs->cur_dir; dir != ROOT_INODE; dir = get_inode(fs, dir)->parent) {
+        const char *name = chain_entry(fs, get_inode(fs, dir)->parent_chain, get_inode(fs, dir)->parent_slot)->name;
+        size_t name_len = strlen(name);
+        pos -= name_len;
+        memcpy(path + pos, name, name_len);
+        path[--pos] = '/';
+    }
+    unlock_image(fs);
+    if (len == 0) {
+        strcpy(path, "/");
+    }
+    return path;
+}
+
+int extfs_du(struct extfs *fs, const char *path, struct extfs_usage *usage) {
+    char copy[MAX_PATH];
+    memset(usage, 0, sizeof(*usage));
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    lock_image(fs);
+    while (!LOAD(fs->img->subtrees_valid)) {
+        // no update may run while the totals are worked out, and the scan
+        // takes dir stripes, which the update lock must not be held over
+        unlock_image(fs);
+        lock_image_exclusive(fs);
+        if (!fs->img->subtrees_valid) {
+            count_subtrees(fs, ROOT_INODE);
+            STORE(fs->img->subtrees_valid, 1);
+        }
+        unlock_image_exclusive(fs);
+        lock_image(fs);
+    }
+    int status = EXTFS_OK;
+    uint32_t held, inode = walk_path(fs, copy, &held);
+    if (inode == ERROR) {
+        status = fs->error;
+    } else if (get_inode(fs, inode)->mode == MODE_DIR) {
+        usage->bytes = LOAD(fs->img->subtrees[inode].bytes);
+        usage->inodes = LOAD(fs->img->subtrees[inode].inodes);
+        release_path(fs, held);
+    } else {
+        usage->bytes = get_inode(fs, inode)->file_size;
+        usage->inodes = 1;
+        release_path(fs, held);
+    }
+    unlock_image(fs);
+    return status;
+}
+
+int extfs_find(struct extfs *fs, const char *path, const char *pattern, extfs_dir_fn fn, void *arg) {
+    char copy[MAX_PATH];
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    lock_image(fs);
+    uint32_t inode = find_path_inode(fs, copy);
+    if (inode == ERROR) {
+        unlock_image(fs);
+        return fs->error;
+    }
+    if (get_inode(fs, inode)->mode != MODE_DIR) {
+        unlock_image(fs);
+        return EXTFS_NOT_DIR;
+    }
+    struct find f;
+    memset(&f, 0, sizeof(f));
+    f.fs = fs;
+    f.root = inode;
+    f.prefix = path;
+    f.pattern = pattern;
+    pthread_mutex_init(&f.lock, NULL);
+    scan_tree(fs, inode, find_entry, &f, NULL);
+    unlock_image(fs);
+    pthread_mutex_destroy(&f.lock);
+    qsort(f.paths, f.count, sizeof(char *), compare_paths);
+    for (uint32_t i = 0; i < f.count; i++) {
+        size_t len = strlen(f.paths[i]);
+        int is_dir = f.paths[i][len - 1] == '/';
+        if (is_dir) {
+            f.paths[i][len - 1] = '\0';
+        }
+        fn(arg, f.paths[i], is_dir);
+        free(f.paths[i]);
+    }
+    free(f.paths);
+    return EXTFS_OK;
+}
+
+int extfs_statfs(struct extfs *fs, struct extfs_statfs *st) {
+    begin_update(fs);
+    st->inodes = fs->img->fp->inodes_count;
+    st->free_inodes = fs->img->fp->free_inodes;
+    st->blocks = fs->img->fp->blocks_count;
+    st->free_blocks = fs->img->fp->free_blocks;
+    st->groups = fs->img->fp->group_count;
+    st->group_blocks = GROUP_BLOCKS;
+    st->inodes_per_group = fs->img->fp->inodes_per_group;
+    st->bad_blocks = LOAD(fs->img->bad_blocks);
+    end_update(fs);
+    return EXTFS_OK;
+}
+
+int extfs_dcache_stats(struct extfs *fs, struct extfs_dcache_stats *st) {
+    struct image *img = fs->img;
+    pthread_mutex_lock(&img->handles_lock);
+    st->size = DCACHE_SIZE;
+    st->hits = img->dcache_hits;
+    st->negative_hits = img->dcache_negative_hits;
+    st->misses = img->dcache_misses;
+    st->invalidations = img->dcache_invalidations;
+    for (struct extfs *h = img->handles; h != NULL; h = h->next) {
+        st->hits += LOAD(h->dcache_hits);
+        st->negative_hits += LOAD(h->dcache_negative_hits);
+        st->misses += LOAD(h->dcache_misses);
+        st->invalidations += LOAD(h->dcache_invalidations);
+    }
+    pthread_mutex_unlock(&img->handles_lock);
+    return EXTFS_OK;
+}
+
+int extfs_stats(struct extfs *fs, struct extfs_stats *st) {
+    memset(st, 0, sizeof(*st));
+#ifdef EXTFS_STATS
+    const char *names[EXTFS_OPS] = {"mkdir", "rmdir", "create", "unlink", "read", "readdir", "stat", "chdir", "sync"};
+    struct image *img = fs->img;
+    struct counters sum;
+    memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&img->handles_lock);
+    add_counters(&sum, &img->counters);
+    add_counters(&sum, &img->self.counters);
+    for (struct extfs *h = img->handles; h != NULL; h = h->next) {
+        add_counters(&sum, &h->counters);
+    }
+    pthread_mutex_unlock(&img->handles_lock);
+    st->path_components = sum.path_components;
+    st->dir_scans = sum.dir_scans;
+    st->records_scanned = sum.records_scanned;
+    st->chain_links = sum.chain_links;
+    st->name_compares = sum.name_compares;
+    st->inode_allocs = sum.inode_allocs;
+    st->inode_scan_bits = sum.inode_scan_bits;
+    st->inode_groups_skipped = sum.inode_groups_skipped;
+    st->bytes_read = sum.bytes_read;
+    st->bytes_written = sum.bytes_written;
+    for (int op = 0; op < EXTFS_OPS; op++) {
+        st->ops[op].name = names[op];
+        st->ops[op].calls = sum.op_calls[op];
+        st->ops[op].total_ns = sum.op_ns[op];
+        memcpy(st->ops[op].buckets, sum.op_buckets[op], sizeof(st->ops[op].buckets));
+    }
+    return EXTFS_OK;
+#else
+    (void) fs;
+    return EXTFS_NO_STATS;
+#endif
+}
+
+int extfs_stats_reset(struct extfs *fs) {
+#ifdef EXTFS_STATS
+    struct image *img = fs->img;
+    pthread_mutex_lock(&img->handles_lock);
+    clear_counters(&img->counters);
+    clear_counters(&img->self.counters);
+    for (struct extfs *h = img->handles; h != NULL; h = h->next) {
+        clear_counters(&h->counters);
+    }
+    pthread_mutex_unlock(&img->handles_lock);
+    return EXTFS_OK;
+#else
+    (void) fs;
+    return EXTFS_NO_STATS;
+#endif
+}
+
+int extfs_import(struct extfs *fs, const char *hostdir, const char *path, struct extfs_transfer_stats *st) {
+    char copy[MAX_PATH], *name;
+    memset(st, 0, sizeof(*st));
+    if (strcmp(path, "/") == 0)
+        return EXTFS_IS_ROOT;
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    remove_ending_slash(copy);
+    lock_image_exclusive(fs);
+    int status = EXTFS_OK;
+    uint32_t dir = find_parent(fs, copy, &name);
+    if (dir == ERROR) {
+        status = fs->error;
+    } else if (dir_lookup(fs, dir, name, NULL, NULL) != ERROR) {
+        status = EXTFS_EXISTS;
+    } else {
+        // the journal cannot replay what was read from the host, so the
+        // import goes straight into the image, whatever part of it was done
+        if (do_import(fs, hostdir, dir, name, st) == ERROR) {
+            status = fs->error;
+        }
+        if (st->dirs > 0) {
+            int saved = write_fs(fs);
+            status = status == EXTFS_OK ? saved : status;
+        }
+    }
+    unlock_image_exclusive(fs);
+    return status;
+}
+
+int extfs_export(struct extfs *fs, const char *path, const char *hostdir, struct extfs_transfer_stats *st) {
+    char copy[MAX_PATH];
+    memset(st, 0, sizeof(*st));
+    if (copy_path(fs, copy, path) == ERROR)
+        return fs->error;
+    lock_image(fs);
+    int status = EXTFS_OK;
+    uint32_t inode = find_path_inode(fs, copy);
+    if (inode == ERROR) {
+        status = fs->error;
+    } else if (get_inode(fs, inode)->mode != MODE_DIR) {
+        status = EXTFS_NOT_DIR;
+    } else if (do_export(fs, inode, hostdir, st) == ERROR) {
+        status = fs->error;
+    }
+    unlock_image(fs);
+    return status;
+}
+
+void write_to_file(void *arg, const char *data, size_t len) {
+    fwrite(data, 1, len, (FILE *) arg);
+}
+
+int extfs_dump(struct extfs *fs, FILE *out) {
+    begin_update(fs);
+    for (uint32_t i = 0; i < fs->img->fp->inodes_count; i++) {
+        if (!inode_used(fs, i))
+            continue;
+        if (get_inode(fs, i)->mode == MODE_DIR || get_inode(fs, i)->mode == MODE_CONT) {
+            if (get_inode(fs, i)->mode == MODE_DIR) {
+                fprintf(out, "Inode #%d: dir\n", i);
+            } else {
+                fprintf(out, "Inode #%d: cont\n", i);
+            }
+
+            int temp_inode = i;
+            do {
+                uint32_t block = get_inode(fs, temp_inode)->blocks[0];
+                fprintf(out, "Block #%d:\n", block);
+                for (int j = next_record(fs, temp_inode, -1); j >= 0; j = next_record(fs, temp_inode, j)) {
+                    fprintf(out, "Item #%d: Id: %d Name: %s\n", j, chain_entry(fs, temp_inode, j)->id,
+                           chain_entry(fs, temp_inode, j)->name);
+                }
+                temp_inode = get_inode(fs, temp_inode)->next_inode;
+                if (temp_inode != INVALID_INODE) {
+                    fprintf(out, "Going to next:%d\n", temp_inode);
+                }
+            } while (temp_inode != INVALID_INODE);
+        } else if (get_inode(fs, i)->mode == MODE_FILE) {
+            fprintf(out, "Inode #%d: file\n", i);
+            if (get_inode(fs, i)->file_flags & FILE_INLINE) {
+                fprintf(out, "Inline: Block: %u\n", get_inode(fs, i)->inline_block);
+            }
+            for (uint32_t k = 0; k < get_inode(fs, i)->extent_count; k++) {
+                struct extent *e = file_extent(fs, i, k);
+                fprintf(out, "Extent #%u: Block: %u Length: %u\n", k, e->start, e->len);
+            }
+            fprintf(out, "Size: %u Content: ", get_inode(fs, i)->file_size);
+            file_read(fs, i, write_to_file, out);
+            fprintf(out, "\n");
+        } else if (get_inode(fs, i)->mode == MODE_INDEX) {
+            fprintf(out, "Inode #%d: index\n", i);
+        }
+    }
+    end_update(fs);
+    return EXTFS_OK;
+}
@@ -0,0 +1,265 @@
+/*
+ *  This file is part of extfs
+ *  Copyright (c) 2017 extfs's authors
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef EXTFS_H
+#define EXTFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// libextfs: an image file opened through a handle. Every call on a handle
+// returns EXTFS_OK or one of the status codes below and prints nothing, apart
+// from progress messages of open, sync and format without EXTFS_QUIET. I/O
+// failures no call can return, like those of journal writes, are kept for
+// extfs_check_io.
+// Paths are relative to the handle's working dir. Handles on one image made
+// by extfs_dup may be used from different threads at the same time: lookups
+// and reads run in parallel, and so do updates until they change the image,
+// which they do one at a time. A single handle must not be used by two
+// threads at once.
+
+#define ERROR 0x7FFFFFFF
+
+// status codes
+enum {
+    EXTFS_OK,
+    EXTFS_PATH_NOT_FOUND,
+    EXTFS_NOT_FOUND,
+    EXTFS_BAD_PATH,
+    EXTFS_PATH_TOO_LONG,
+    EXTFS_EXISTS,
+    EXTFS_NAME_TOO_LONG,
+    EXTFS_NAME_EMPTY,
+    EXTFS_NAME_INVALID,
+    EXTFS_NAME_RESERVED,
+    EXTFS_AT_ROOT,
+    EXTFS_IS_ROOT,
+    EXTFS_IS_DIR,
+    EXTFS_NOT_DIR,
+    EXTFS_NO_INODE,
+    EXTFS_NO_BLOCK,
+    EXTFS_NO_CONTIGUOUS,
+    EXTFS_BAD_COUNT,
+    EXTFS_TOO_LARGE,
+    EXTFS_CANNOT_SHRINK,
+    EXTFS_RESIZE_FAILED,
+    EXTFS_IO,
+    EXTFS_TOO_MANY_SNAPSHOTS,
+    EXTFS_NO_STATS,
+    EXTFS_HOST_IO
+};
+
+// when to fsync the journal
+enum {
+    EXTFS_JOURNAL_OFF,   // no journal, the image is mapped shared
+    EXTFS_JOURNAL_ASYNC, // write every record, leave fsync to the OS
+    EXTFS_JOURNAL_GROUP, // fsync batches of records
+    EXTFS_JOURNAL_SYNC   // fsync every record
+};
+
+// flags of extfs_open
+#define EXTFS_QUIET 1
+// Keep the image file as a pack: its blocks compressed one by one, behind an
+// index. A raw image becomes a pack with its next save. Packs are opened as
+// packs without the flag as well, and read block by block as they are used.
+#define EXTFS_PACKED 2
+// Let rmdir return once the subtree is unlinked and free it in the
+// background. Syncs free whatever is still left.
+#define EXTFS_LAZY_FREE 4
+
+struct extfs;
+
+struct extfs_stat {
+    uint32_t inode;
+    int is_dir;
+    uint32_t size; // bytes of a file, 0 for a dir
+};
+
+struct extfs_statfs {
+    uint32_t inodes, free_inodes;
+    uint32_t blocks, free_blocks;
+    uint32_t groups, group_blocks, inodes_per_group;
+    uint32_t bad_blocks; // blocks that failed their checksum or a read since the image was read
+};
+
+struct extfs_defrag_stats {
+    uint32_t dirs;
+    uint32_t chain_before, chain_after; // chain inodes of all dirs
+    uint32_t blocks_freed; // net
+    uint32_t files_moved, blocks_moved;
+};
+
+struct extfs_fsck_stats {
+    uint32_t dirs, files; // reached by the last pass
+    uint32_t problems; // found by the first pass
+    uint32_t left; // found by the last pass, after the repairs
+    uint32_t threads;
+};
+
+struct extfs_usage {
+    uint64_t bytes; // of the files
+    uint32_t inodes; // files and dirs, a dir counting itself
+};
+
+struct extfs_transfer_stats {
+    uint32_t dirs, files;
+    uint64_t bytes;
+    uint32_t skipped; // host entries left out: neither files nor dirs, too large or badly named
+};
+
+// calls timed by extfs_stats
+enum {
+    EXTFS_OP_MKDIR,
+    EXTFS_OP_RMDIR,
+    EXTFS_OP_CREATE,
+    EXTFS_OP_UNLINK,
+    EXTFS_OP_READ,
+    EXTFS_OP_READDIR,
+    EXTFS_OP_STAT,
+    EXTFS_OP_CHDIR,
+    EXTFS_OP_SYNC,
+    EXTFS_OPS
+};
+
+#define EXTFS_STATS_BUCKETS 32
+
+struct extfs_op_stats {
+    const char *name;
+    uint64_t calls, total_ns;
+    // calls that took from 2^k up to 2^(k+1) ns, the last bucket takes the longer ones too
+    uint64_t buckets[EXTFS_STATS_BUCKETS];
+};
+
+struct extfs_stats {
+    uint64_t path_components; // resolved by path walks
+    uint64_t dir_scans, records_scanned, chain_links; // linear searches of dir chains
+    uint64_t name_compares;
+    uint64_t inode_allocs, inode_scan_bits, inode_groups_skipped; // bits allocate_inode passed over from its hint
+    uint64_t bytes_read, bytes_written; // between the image file and memory, by reads and saves
+    struct extfs_op_stats ops[EXTFS_OPS];
+};
+
+struct extfs_dcache_stats {
+    uint32_t size;
+    uint64_t hits, negative_hits, misses, invalidations;
+};
+
+// gets the entries of a dir, "." and ".." included, or the name of a file
+typedef void (*extfs_dir_fn)(void *arg, const char *name, int is_dir);
+// gets the contents of a file, in pieces
+typedef void (*extfs_data_fn)(void *arg, const char *data, size_t len);
+// gets a snapshot and when it was taken, in seconds since the epoch
+typedef void (*extfs_snapshot_fn)(void *arg, const char *name, uint64_t time);
+// gets a problem fsck found, as a sentence without its period
+typedef void (*extfs_fsck_fn)(void *arg, const char *problem);
+
+const char *extfs_strerror(int status);
+// Returns the policy called name, ERROR if there is none.
+int extfs_parse_journal_policy(const char *name);
+
+// Opens the image at path, creating it if needed, and replays its journal.
+// Returns NULL if out of memory.
+struct extfs *extfs_open(const char *path, int journal_policy, int flags);
+// Returns another handle on the image of fs, starting in the same working
+// dir, or NULL if out of memory.
+struct extfs *extfs_dup(struct extfs *fs);
+// Frees the handle. Closing the last handle on an image saves and closes it.
+int extfs_close(struct extfs *fs);
+// Writes all changes back to the image file.
+int extfs_sync(struct extfs *fs);
+// Returns EXTFS_IO if, since the image was read or the last check or sync,
+// the journal could not be opened or written or a checkpoint failed, so that
+// changes may only be kept in memory until a sync succeeds. Clears the
+// condition.
+int extfs_check_io(struct extfs *fs);
+// Drops all changes since the last sync, then reads the image and journal
+// again.
+int extfs_reload(struct extfs *fs);
+// Formats the image with room for about inodes inodes in blocks blocks.
+int extfs_format(struct extfs *fs, uint32_t inodes, uint32_t blocks);
+// Grows the image to blocks blocks.
+int extfs_resize(struct extfs *fs, uint32_t blocks);
+// Syncs, leaving holes in the image file for all unused blocks. Blocks freed
+// later become holes with each sync anyway.
+int extfs_trim(struct extfs *fs);
+// Repacks the entries of every dir to the front of its chain, freeing the
+// cont inodes left empty, and moves dir chains and files split over several
+// extents into single runs where there is room.
+int extfs_defrag(struct extfs *fs, struct extfs_defrag_stats *st);
+// Walks the tree from the root on several threads and checks the chains,
+// entries, indexes and files it reaches, then the bitmaps and counters
+// against what it reached and the blocks against their checksums. With
+// repair, drops whatever entries are broken, frees whatever is unreachable
+// and saves the image. Other handles may read meanwhile unless repairing.
+int extfs_fsck(struct extfs *fs, int repair, extfs_fsck_fn fn, void *arg, struct extfs_fsck_stats *st);
+// From now on, unlink and rmdir repack a dir they leave with fewer than
+// percent of its entry slots used. 0, the default, turns this off.
+int extfs_set_defrag_threshold(struct extfs *fs, uint32_t percent);
+// Snapshots share the inodes and blocks of the tree they were taken of with
+// it, so taking one costs a copy of the inode tables, and blocks the live
+// tree changes later are copied first. Rolling back replaces the whole tree
+// with the one of the snapshot, which is kept, and moves all working dirs to
+// the root.
+int extfs_snapshot_create(struct extfs *fs, const char *name);
+int extfs_snapshot_list(struct extfs *fs, extfs_snapshot_fn fn, void *arg);
+int extfs_snapshot_rollback(struct extfs *fs, const char *name);
+int extfs_snapshot_delete(struct extfs *fs, const char *name);
+
+int extfs_mkdir(struct extfs *fs, const char *path);
+// Removes a dir and everything below it. Removing the root formats the
+// image. Working dirs of all handles move up out of the removed subtree.
+// With EXTFS_LAZY_FREE, statfs counts its space as used until it is freed.
+int extfs_rmdir(struct extfs *fs, const char *path);
+// Creates a file holding len bytes of data.
+int extfs_create(struct extfs *fs, const char *path, const char *data, uint32_t len);
+int extfs_unlink(struct extfs *fs, const char *path);
+int extfs_read(struct extfs *fs, const char *path, extfs_data_fn fn, void *arg);
+int extfs_readdir(struct extfs *fs, const char *path, extfs_dir_fn fn, void *arg);
+int extfs_stat(struct extfs *fs, const char *path, struct extfs_stat *st);
+int extfs_chdir(struct extfs *fs, const char *path);
+// Returns the path of the working dir, which the caller frees.
+char *extfs_getcwd(struct extfs *fs);
+
+// Copies the tree under the host dir hostdir into a new dir at path and saves
+// the image. Whatever was copied before a failure is kept. Other handles wait
+// meanwhile.
+int extfs_import(struct extfs *fs, const char *hostdir, const char *path, struct extfs_transfer_stats *st);
+// Copies the tree under the dir at path into the host dir hostdir, creating
+// it if needed and overwriting the files there.
+int extfs_export(struct extfs *fs, const char *path, const char *hostdir, struct extfs_transfer_stats *st);
+
+// Bytes and inodes of the subtree at path, or of the file. Updates keep the
+// totals of every dir, so only the first call, and the first after a reload,
+// rollback or fsck repair, walks the tree.
+int extfs_du(struct extfs *fs, const char *path, struct extfs_usage *usage);
+// Hands fn the paths below the dir at path whose last component matches the
+// shell pattern, in order, each starting with path.
+int extfs_find(struct extfs *fs, const char *path, const char *pattern, extfs_dir_fn fn, void *arg);
+
+int extfs_statfs(struct extfs *fs, struct extfs_statfs *st);
+int extfs_dcache_stats(struct extfs *fs, struct extfs_dcache_stats *st);
+// Adds up the counters of all handles since the image was opened or the
+// last reset. Both return EXTFS_NO_STATS if the library was built without
+// EXTFS_STATS, which leaves the counting out altogether.
+int extfs_stats(struct extfs *fs, struct extfs_stats *st);
+int extfs_stats_reset(struct extfs *fs);
+// Prints every inode in use, for debugging.
+int extfs_dump(struct extfs *fs, FILE *out);
+
+#endif
@@ -15,690 +15,429 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-#include <stdint.h>
-
-#define MAX_INODE 4096
-#define MAX_BLOCK 4096
-#define MAX_BLOCKS_PER_INODE 1
-#define MAX_FILENAME 252
-#define MAX_DIRENTRY_PER_BLOCK 16
-#define ERROR 0x7FFFFFFF
-#define BUFFER_LEN 4096
-#define CURRENT_VERSION 20171213
-#define INVALID_INODE UINT16_MAX
-const char *DATA_FILE = "data.dsk";
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "extfs.h"
 
-const int MODE_DIR = 1;
-const int MODE_FILE = 2;
-const int MODE_CONT = 3;
+#define OUTPUT_BUFFER (1 << 20) // stdout buffer in batch mode
 
-const int BLOCK_DATA = 1;
-const int BLOCK_DIR_ENTRY = 2;
+const char *DATA_FILE = "data.dsk";
 
-// 8 kb
-struct super_block {
-    uint8_t inode_bitmap[MAX_INODE];
-    uint8_t block_bitmap[MAX_BLOCK];
+// One stream of commands: the terminal, a script or a server client.
+struct session {
+    struct extfs *fs;
+    FILE *out;
+    int batch; // no prompt or progress messages
+    char *cur_cmd, *cmd_end;
 };
 
-// 32 bytes
-struct inode {
-    uint32_t mode;
-    uint32_t file_size;
-    uint16_t entry_count;
-    uint16_t next_inode; // for dir with more than 16 dir entries
-    uint8_t bitmap[16];
-    uint32_t blocks[MAX_BLOCKS_PER_INODE];
-};
+char output_buffer[OUTPUT_BUFFER];
 
-struct entry {
-    uint32_t id;
-    char name[MAX_FILENAME];
-};
+char *extract_argument(struct session *s) {
+    while (*s->cur_cmd == '\0' && s->cur_cmd < s->cmd_end) s->cur_cmd++;
+    if (s->cur_cmd == s->cmd_end)
+        return NULL;
+    char *result = s->cur_cmd;
+    s->cur_cmd += strlen(s->cur_cmd);
+    return result;
+}
 
-union data {
-    char data[4096];
-    struct entry entries[MAX_DIRENTRY_PER_BLOCK];
-};
+// Prints the message of a failed call, ERR if status is one.
+int check(struct session *s, int status) {
+    if (status != EXTFS_OK)
+        fprintf(s->out, "ERR: %s.\n", extfs_strerror(status));
+    return status;
+}
 
-struct file {
-    uint32_t version;
-    struct super_block sb;
-    struct inode nodes[4096];
-    union data blocks[4096];
-} *fp;
-
-char cmd[BUFFER_LEN], buffer[BUFFER_LEN];
-char *cur_cmd, *cmd_end;
-uint32_t cur_depth = 0, temp_cur_depth = 0;
-uint32_t dir_inodes[256];
-uint32_t temp_dir_inodes[256];
-
-// Utility
-uint32_t allocate_inode(uint32_t mode, uint8_t block) {
-    for (uint32_t i = 0; i < MAX_INODE; i++) {
-        if (fp->sb.inode_bitmap[i] == 0) {
-            fp->sb.inode_bitmap[i] = 1;
-            for (uint32_t j = 0; j < MAX_BLOCK; j++) {
-                if (fp->sb.block_bitmap[j] == 0) {
-                    fp->sb.block_bitmap[j] = block;
-                    memset(fp->nodes[i].bitmap, 0, sizeof(fp->nodes[i].bitmap));
-                    fp->nodes[i].blocks[0] = j;
-                    fp->nodes[i].mode = mode;
-                    fp->nodes[i].next_inode = INVALID_INODE;
-                    return i;
-                }
-            }
-            printf("ERR: No block left.\n");
-            return ERROR;
-        }
-    }
-    printf("ERR: No inode left.\n");
-    return ERROR;
+// Parses a positive count, ERROR if s is none.
+uint32_t parse_count(const char *s) {
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (!isdigit((unsigned char) *s) || *end != '\0' || n == 0 || n >= ERROR)
+        return ERROR;
+    return (uint32_t) n;
 }
 
+void print_data(void *arg, const char *data, size_t len) {
+    fwrite(data, 1, len, (FILE *) arg);
+}
 
-char *extract_argument() {
-    while (*cur_cmd == '\0' && cur_cmd < cmd_end) cur_cmd++;
-    if (cur_cmd == cmd_end)
-        return NULL;
-    char *result = cur_cmd;
-    cur_cmd += strlen(cur_cmd);
-    return result;
+void print_entry(void *arg, const char *name, int is_dir) {
+    fprintf((FILE *) arg, is_dir ? "%s/\n" : "%s\n", name);
 }
 
-void remove_ending_slash(char *path) {
-    size_t len = strlen(path);
-    if (len > 1 && path[len - 1] == '/') {
-        path[len - 1] = '\0';
-    }
+void pwd(struct session *s) {
+    char *path = extfs_getcwd(s->fs);
+    fprintf(s->out, "%s\n", path);
+    free(path);
 }
 
-int check_filename_valid(char *path) {
-    size_t len = strlen(path);
-    if (len >= MAX_FILENAME - 1) {
-        printf("ERR: Name length exceed limit.\n");
-        return ERROR;
-    } else if (len == 0) {
-        printf("ERR: Name cannot be empty.\n");
-        return ERROR;
+void fmt(struct session *s) {
+    char *inodes = extract_argument(s), *blocks = extract_argument(s);
+    struct extfs_statfs st;
+    extfs_statfs(s->fs, &st);
+    uint32_t inode_count = st.inodes, block_count = st.blocks;
+    if (inodes != NULL && ((inode_count = parse_count(inodes)) == ERROR || blocks == NULL ||
+                           (block_count = parse_count(blocks)) == ERROR)) {
+        fprintf(s->out, "ERR: Please input inode and block counts.\n");
+        return;
     }
-    for (size_t i = 0; i < len; i++) {
-        if (!(isalnum(path[i]) || path[i] == '.' || path[i] == '_')) {
-            printf("ERR: Name cannot contain invalid char.\n");
-            return ERROR;
-        }
+    check(s, extfs_format(s->fs, inode_count, block_count));
+}
+
+void resize(struct session *s) {
+    char *blocks = extract_argument(s);
+    uint32_t block_count;
+    if (blocks == NULL || (block_count = parse_count(blocks)) == ERROR) {
+        fprintf(s->out, "ERR: Please input the new block count.\n");
+        return;
     }
-    if (strcmp(path, ".") == 0 || strcmp(path, "..") == 0) {
-        printf("ERR: Name cannot be \"..\" or \".\".\n");
-        return ERROR;
+    if (check(s, extfs_resize(s->fs, block_count)) == EXTFS_OK) {
+        struct extfs_statfs st;
+        extfs_statfs(s->fs, &st);
+        fprintf(s->out, "Disk resized to %u blocks.\n", st.blocks);
     }
-    return 0;
 }
 
-void split_path(char **path, char **file_name) {
-    char *rev_slash = strrchr(*path, '/');
-    if (rev_slash == NULL) {
-        *file_name = *path;
-        *path += strlen(*path);
-    } else {
-        if (rev_slash == *path) {
-            *file_name = *path + 1;
-            *path = "/";
-        } else {
-            *file_name = rev_slash + 1;
-            *rev_slash = '\0';
+void defrag(struct session *s) {
+    char *mode = extract_argument(s);
+    if (mode != NULL) {
+        char *percent = extract_argument(s), *end = NULL;
+        unsigned long n = percent == NULL ? 0 : strtoul(percent, &end, 10);
+        if (strcmp(mode, "auto") != 0 || percent == NULL || !isdigit((unsigned char) *percent) || *end != '\0' ||
+            n > 100) {
+            fprintf(s->out, "ERR: Please input auto and a percentage.\n");
+            return;
         }
+        check(s, extfs_set_defrag_threshold(s->fs, (uint32_t) n));
+        return;
     }
+    struct extfs_defrag_stats st;
+    if (check(s, extfs_defrag(s->fs, &st)) != EXTFS_OK)
+        return;
+    fprintf(s->out, "Defragmented %u dirs: %u blocks freed, average chain %.2f -> %.2f inodes, %u blocks moved, %u files made contiguous.\n",
+            st.dirs, st.blocks_freed, st.dirs == 0 ? 0.0 : (double) st.chain_before / st.dirs,
+            st.dirs == 0 ? 0.0 : (double) st.chain_after / st.dirs, st.blocks_moved, st.files_moved);
 }
 
-uint32_t find_path_inode(char *path) {
-    size_t len = strlen(path);
-    uint32_t cur_inode;
-    memcpy(temp_dir_inodes, dir_inodes, sizeof(dir_inodes));
-    if (len == 0) {
-        temp_cur_depth = cur_depth;
-        return temp_dir_inodes[temp_cur_depth];
-    }
-    if (path[0] == '/') { // absolute
-        cur_inode = temp_dir_inodes[0];
-        temp_cur_depth = 0;
-    } else { // relative
-        cur_inode = temp_dir_inodes[cur_depth];
-        temp_cur_depth = cur_depth;
-    }
-    char *temp = (char *) malloc((len + 1) * sizeof(char));
-    strcpy(temp, path);
-    char *name = strtok(temp, "/");
-    int found;
-    uint32_t block;
-    while (name != NULL) {
-        if (strcmp(name, "") == 0 || strcmp(name, ".") == 0) {
-            goto next;
-        } else if (strcmp(name, "..") == 0) {
-            if (temp_cur_depth == 0) {
-                printf("ERR: Already at root.\n");
-                free(temp);
-                return ERROR;
-            }
-            cur_inode = temp_dir_inodes[--temp_cur_depth];
-            goto next;
-        }
-
-        found = 0;
-        int temp_inode = cur_inode;
-        do {
-            block = fp->nodes[temp_inode].blocks[0];
-            for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-                if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                    uint32_t id = fp->blocks[block].entries[i].id;
-                    if (strcmp(name, fp->blocks[block].entries[i].name) == 0) {
-                        found = 1;
-                        cur_inode = id;
-                        temp_dir_inodes[++temp_cur_depth] = cur_inode;
-                        break;
-                    }
-                }
-            }
-            temp_inode = fp->nodes[temp_inode].next_inode;
-        } while (temp_inode != INVALID_INODE);
+void print_problem(void *arg, const char *problem) {
+    fprintf((FILE *) arg, "%s.\n", problem);
+}
 
-        if (!found) {
-            free(temp);
-            printf("ERR: Path not found.\n");
-            return ERROR;
-        }
-    next:
-        name = strtok(NULL, "/");
-    }
-    free(temp);
-    return cur_inode;
-}
-
-void pwd(int output) {
-    uint32_t i, block;
-    if (cur_depth > 0) {
-        buffer[0] = '\0';
-        for (i = 0; i < cur_depth; i++) {
-            strcat(buffer, "/");
-
-            int temp_inode = dir_inodes[i];
-            do {
-                block = fp->nodes[temp_inode].blocks[0];
-                for (int j = 0; j < MAX_DIRENTRY_PER_BLOCK; j++) {
-                    if (fp->nodes[temp_inode].bitmap[j] != 0) {
-                        if (dir_inodes[i + 1] == fp->blocks[block].entries[j].id) {
-                            strcat(buffer, fp->blocks[block].entries[j].name);
-                            break;
-                        }
-                    }
-                }
-                temp_inode = fp->nodes[temp_inode].next_inode;
-            } while (temp_inode != INVALID_INODE);
-        }
+// Checks the image, repairing it if asked to. Returns the number of problems
+// left, ERROR if the check failed.
+uint32_t run_fsck(struct session *s, int repair) {
+    struct extfs_fsck_stats st;
+    if (check(s, extfs_fsck(s->fs, repair, print_problem, s->out, &st)) != EXTFS_OK)
+        return ERROR;
+    if (repair) {
+        fprintf(s->out, "Checked %u dirs and %u files: %u problems, %u left after repair.\n", st.dirs, st.files,
+                st.problems, st.left);
     } else {
-        strcpy(buffer, "/");
+        fprintf(s->out, "Checked %u dirs and %u files: %u problems.\n", st.dirs, st.files, st.problems);
     }
-    if (output) {
-        printf("%s\n", buffer);
+    return st.left;
+}
+
+void fsck(struct session *s) {
+    char *mode = extract_argument(s);
+    if (mode != NULL && strcmp(mode, "repair") != 0) {
+        fprintf(s->out, "ERR: Please input repair or nothing.\n");
+        return;
     }
+    run_fsck(s, mode != NULL);
 }
 
-void format() {
-    printf("Formatting disk...\n");
-    memset(fp, 0, sizeof(struct file));
-    fp->version = CURRENT_VERSION;
-    cur_depth = 0;
-    uint32_t root_inode = allocate_inode(MODE_DIR, BLOCK_DIR_ENTRY);
-    dir_inodes[cur_depth] = root_inode;
-    printf("Formatting done...\n");
+void print_snapshot(void *arg, const char *name, uint64_t taken) {
+    time_t t = (time_t) taken;
+    struct tm tm;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    fprintf((FILE *) arg, "%s\t%s\n", name, when);
 }
 
-void read_fs() {
-    printf("Reading fs from %s ...\n", DATA_FILE);
-    FILE *FP = fopen(DATA_FILE, "rb");
-    if (FP == NULL) {
-        printf("File not found -- creating a new disk.\n");
-        format();
+void snapshot(struct session *s) {
+    char *op = extract_argument(s), *name = extract_argument(s);
+    if (op != NULL && strcmp(op, "list") == 0) {
+        check(s, extfs_snapshot_list(s->fs, print_snapshot, s->out));
+    } else if (op != NULL && name != NULL && strcmp(op, "create") == 0) {
+        check(s, extfs_snapshot_create(s->fs, name));
+    } else if (op != NULL && name != NULL && strcmp(op, "rollback") == 0) {
+        check(s, extfs_snapshot_rollback(s->fs, name));
+    } else if (op != NULL && name != NULL && strcmp(op, "delete") == 0) {
+        check(s, extfs_snapshot_delete(s->fs, name));
     } else {
-        fread(fp, sizeof(struct file), 1, FP);
-        fclose(FP);
-        printf("Reading done.\n");
-        if (fp->version != CURRENT_VERSION) {
-            printf("ERR: disk version mismatch -- creating a new disk.\n");
-            format();
-        }
+        fprintf(s->out, "ERR: Please input create, rollback or delete and a name, or list.\n");
     }
 }
 
-void write_fs() {
-    printf("Now saving data to disk..\n");
-    FILE *FP = fopen(DATA_FILE, "wb");
-    if (FP == NULL) {
-        fprintf(stderr, "Open %s failed. Will lose all changes.\n", DATA_FILE);
-    } else {
-        fwrite(fp, sizeof(struct file), 1, FP);
-        fclose(FP);
-        printf("Saving done.\n");
+void cd(struct session *s) {
+    char *path = extract_argument(s);
+    if (path == NULL) {
+        fprintf(s->out, "ERR: Path cannot be empty.\n");
+        return;
     }
+    check(s, extfs_chdir(s->fs, path));
 }
 
-void cd() {
-    char *path;
-    temp_cur_depth = cur_depth;
-    memcpy(temp_dir_inodes, dir_inodes, sizeof(dir_inodes));
-    path = extract_argument();
+void ls(struct session *s) {
+    char *path = extract_argument(s);
     if (path == NULL) {
-        printf("ERR: Path cannot be empty.\n");
-        return;
+        path = ".";
     }
+    check(s, extfs_readdir(s->fs, path, print_entry, s->out));
+}
 
-    int new_inode;
-    if ((new_inode = find_path_inode(path)) == ERROR) {
+void fs_mkdir(struct session *s) {
+    char *path = extract_argument(s);
+    if (path == NULL) {
+        fprintf(s->out, "ERR: Path cannot be empty.\n");
         return;
     }
-    if (fp->nodes[new_inode].mode != MODE_DIR) {
-        printf("ERR: Bad path.\n");
+    int status = extfs_mkdir(s->fs, path);
+    if (status == EXTFS_IS_ROOT) {
+        fprintf(s->out, "ERR: Cannot mkdir root.\n");
         return;
     }
-    cur_depth = temp_cur_depth;
-    memcpy(dir_inodes, temp_dir_inodes, sizeof(dir_inodes));
+    check(s, status);
 }
 
-void ls() {
-    char *path;
-    path = extract_argument();
+void fs_rmdir(struct session *s) {
+    char *path = extract_argument(s);
     if (path == NULL) {
-        path = ".";
+        fprintf(s->out, "ERR: Path cannot be empty.\n");
+        return;
     }
-
-    uint32_t cur_inode;
-    if ((cur_inode = find_path_inode(path)) == ERROR)
+    struct extfs_stat st, root;
+    if (check(s, extfs_stat(s->fs, path, &st)) != EXTFS_OK)
         return;
+    if (!st.is_dir) {
+        fprintf(s->out, "ERR: Cannot rmdir a file.\n");
+        return;
+    }
+    if (check(s, extfs_rmdir(s->fs, path)) != EXTFS_OK)
+        return;
+    // removing the root formats the disk instead
+    extfs_stat(s->fs, "/", &root);
+    if (st.inode != root.inode) {
+        fprintf(s->out, "Changing dir to: ");
+        pwd(s);
+    }
+}
 
-    if (fp->nodes[cur_inode].mode == MODE_FILE) {
-        uint32_t id = temp_dir_inodes[temp_cur_depth-1];
-        uint32_t block;
-        int temp_inode = id;
-        do {
-            block = fp->nodes[temp_inode].blocks[0];
-            for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-                if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                    if (fp->blocks[block].entries[i].id == cur_inode) {
-                        printf("%s\n", fp->blocks[block].entries[i].name);
-                    }
-                }
-            }
-            temp_inode = fp->nodes[temp_inode].next_inode;
-        } while (temp_inode != INVALID_INODE);
-        return ;
-    }
-
-    if (temp_cur_depth > 0) {
-        printf("../\n");
-    }
-    printf("./\n");
-
-    uint32_t id = cur_inode;
-    uint32_t block;
-    int temp_inode = id;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                uint32_t id = fp->blocks[block].entries[i].id;
-                if (fp->nodes[id].mode == MODE_DIR) {
-                    printf("%s/\n", fp->blocks[block].entries[i].name);
-                } else if (fp->nodes[id].mode == MODE_FILE) {
-                    printf("%s\n", fp->blocks[block].entries[i].name);
-                }
-            }
-        }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
-
+void echo(struct session *s) {
+    char *str = extract_argument(s);
+    char *path = extract_argument(s);
+    if (str == NULL || path == NULL) {
+        fprintf(s->out, "ERR: Please input str and path.\n");
+        return;
+    }
+    check(s, extfs_create(s->fs, path, str, (uint32_t) strlen(str)));
 }
 
-void mkdir() {
-    char *path = extract_argument();
+void cat(struct session *s) {
+    char *path = extract_argument(s);
     if (path == NULL) {
-        printf("ERR: Path cannot be empty.\n");
+        fprintf(s->out, "ERR: Please specify file path.\n");
         return;
     }
-    if (strcmp(path, "/") == 0) {
-        printf("ERR: Cannot mkdir root.\n");
-        return;
+    int status = extfs_read(s->fs, path, print_data, s->out);
+    if (status == EXTFS_IS_DIR) {
+        fprintf(s->out, "ERR: Cannot cat a dir.\n");
+    } else if (check(s, status) == EXTFS_OK) {
+        fprintf(s->out, "\n");
     }
+}
 
-    remove_ending_slash(path);
-    temp_cur_depth = cur_depth;
-    memcpy(temp_dir_inodes, dir_inodes, sizeof(dir_inodes));
-    char *file_name;
-    split_path(&path, &file_name);
-    if (find_path_inode(path) == ERROR || check_filename_valid(file_name) == ERROR)
+void rm(struct session *s) {
+    char *path = extract_argument(s);
+    if (path == NULL) {
+        fprintf(s->out, "ERR: Please specify file path.\n");
         return;
+    }
+    int status = extfs_unlink(s->fs, path);
+    if (status == EXTFS_IS_DIR) {
+        fprintf(s->out, "ERR: Use rmdir to remove dir.\n");
+    } else if (check(s, status) == EXTFS_OK) {
+        fprintf(s->out, "File removed.\n");
+    }
+}
 
+void df(struct session *s) {
+    struct extfs_statfs st;
+    extfs_statfs(s->fs, &st);
+    fprintf(s->out, "Inodes: %u used, %u free, %u total\n", st.inodes - st.free_inodes, st.free_inodes, st.inodes);
+    fprintf(s->out, "Blocks: %u used, %u free, %u total\n", st.blocks - st.free_blocks, st.free_blocks, st.blocks);
+    fprintf(s->out, "Groups: %u of %u blocks, %u inodes each\n", st.groups, st.group_blocks, st.inodes_per_group);
+    if (st.bad_blocks > 0) {
+        fprintf(s->out, "Bad blocks: %u failed their checksums or reads\n", st.bad_blocks);
+    }
+}
 
-    uint32_t cur_inode = temp_dir_inodes[temp_cur_depth];
-    if (fp->nodes[cur_inode].mode != MODE_DIR) {
-        printf("ERR: Bad path.\n");
+void dcache_stats(struct session *s) {
+    struct extfs_dcache_stats st;
+    extfs_dcache_stats(s->fs, &st);
+    uint64_t lookups = st.hits + st.negative_hits + st.misses;
+    fprintf(s->out, "Dentry cache: %u entries\n", st.size);
+    fprintf(s->out, "Hits: %llu (%llu negative)\n", (unsigned long long) (st.hits + st.negative_hits),
+           (unsigned long long) st.negative_hits);
+    fprintf(s->out, "Misses: %llu\n", (unsigned long long) st.misses);
+    fprintf(s->out, "Invalidations: %llu\n", (unsigned long long) st.invalidations);
+    fprintf(s->out, "Hit rate: %.1f%%\n", lookups == 0 ? 0.0 : 100.0 * (lookups - st.misses) / lookups);
+}
+
+// Upper bound in microseconds of the bucket that holds the call at fraction q
+// of the calls of op, counting from the fastest.
+double percentile(const struct extfs_op_stats *op, double q) {
+    uint64_t seen = 0;
+    for (int k = 0; k < EXTFS_STATS_BUCKETS; k++) {
+        seen += op->buckets[k];
+        if (seen >= q * op->calls)
+            return (double) (2ULL << k) / 1000;
     }
+    return (double) (2ULL << (EXTFS_STATS_BUCKETS - 1)) / 1000;
+}
 
-    uint32_t temp_inode = cur_inode;
-    uint32_t block;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                if (strcmp(file_name, fp->blocks[block].entries[i].name) == 0) {
-                    printf("ERR: Name already occupied.\n");
-                    return;
-                }
-            }
-        }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
-
-    uint32_t new_inode = allocate_inode(MODE_DIR, BLOCK_DIR_ENTRY);
-    if (new_inode != ERROR) {
-        uint32_t prev_inode = INVALID_INODE;
-        temp_inode = cur_inode;
-        do {
-            block = fp->nodes[temp_inode].blocks[0];
-            for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-                if (fp->nodes[temp_inode].bitmap[i] == 0) {
-                    fp->nodes[temp_inode].entry_count++;
-                    fp->nodes[temp_inode].bitmap[i] = 1;
-                    strcpy(fp->blocks[block].entries[i].name, file_name);
-                    fp->blocks[block].entries[i].id = new_inode;
-                    return ;
-                }
-            }
-            prev_inode = temp_inode;
-            temp_inode = fp->nodes[temp_inode].next_inode;
-        } while (temp_inode != INVALID_INODE);
-
-        printf("INFO: Dir entry limit exceeded and creating a new inode for it.\n");
-        uint32_t new_cont = allocate_inode(MODE_CONT, BLOCK_DIR_ENTRY);
-        if (new_cont != ERROR) {
-            block = fp->nodes[new_cont].blocks[0];
-            fp->nodes[new_cont].entry_count++;
-            fp->nodes[new_cont].bitmap[0] = 1;
-            strcpy(fp->blocks[block].entries[0].name, file_name);
-            fp->blocks[block].entries[0].id = new_inode;
-            fp->nodes[prev_inode].next_inode = new_cont;
-        }
+void print_stats(struct session *s, const struct extfs_stats *st) {
+    fprintf(s->out, "Path components: %llu\n", (unsigned long long) st->path_components);
+    fprintf(s->out, "Dir scans: %llu, %llu records, %llu chain links\n", (unsigned long long) st->dir_scans,
+            (unsigned long long) st->records_scanned, (unsigned long long) st->chain_links);
+    fprintf(s->out, "Name compares: %llu\n", (unsigned long long) st->name_compares);
+    fprintf(s->out, "Inode allocs: %llu, %llu bits scanned, %llu full groups skipped\n",
+            (unsigned long long) st->inode_allocs, (unsigned long long) st->inode_scan_bits,
+            (unsigned long long) st->inode_groups_skipped);
+    fprintf(s->out, "Bytes: %llu read, %llu written\n", (unsigned long long) st->bytes_read,
+            (unsigned long long) st->bytes_written);
+    for (int i = 0; i < EXTFS_OPS; i++) {
+        const struct extfs_op_stats *op = &st->ops[i];
+        if (op->calls == 0)
+            continue;
+        fprintf(s->out, "%s: %llu calls, mean %.1f us, p50 < %.1f us, p99 < %.1f us\n", op->name,
+                (unsigned long long) op->calls, (double) op->total_ns / op->calls / 1000, percentile(op, 0.5),
+                percentile(op, 0.99));
     }
 }
 
-void rmdir_recursively(uint32_t inode) {
-    uint32_t temp_inode = inode;
-    uint32_t block;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                uint32_t cur_id = fp->blocks[block].entries[i].id;
-                if (fp->nodes[cur_id].mode == MODE_DIR) {
-                    rmdir_recursively(cur_id);
-                }
-                fp->nodes[temp_inode].entry_count--;
-                fp->nodes[temp_inode].bitmap[i] = 0;
-                uint32_t temp_sub_inode = cur_id;
-                do {
-                    fp->sb.block_bitmap[fp->nodes[temp_sub_inode].blocks[0]] = 0;
-                    fp->sb.inode_bitmap[temp_sub_inode] = 0;
-                    temp_sub_inode = fp->nodes[temp_sub_inode].next_inode;
-                } while (temp_sub_inode != INVALID_INODE);
-            }
+void print_stats_json(struct session *s, const struct extfs_stats *st) {
+    fprintf(s->out, "{\"path_components\":%llu,\"dir_scans\":%llu,\"records_scanned\":%llu,\"chain_links\":%llu,"
+            "\"name_compares\":%llu,\"inode_allocs\":%llu,\"inode_scan_bits\":%llu,\"inode_groups_skipped\":%llu,"
+            "\"bytes_read\":%llu,\"bytes_written\":%llu,\"ops\":{",
+            (unsigned long long) st->path_components, (unsigned long long) st->dir_scans,
+            (unsigned long long) st->records_scanned, (unsigned long long) st->chain_links,
+            (unsigned long long) st->name_compares, (unsigned long long) st->inode_allocs,
+            (unsigned long long) st->inode_scan_bits, (unsigned long long) st->inode_groups_skipped,
+            (unsigned long long) st->bytes_read, (unsigned long long) st->bytes_written);
+    for (int i = 0; i < EXTFS_OPS; i++) {
+        const struct extfs_op_stats *op = &st->ops[i];
+        fprintf(s->out, "%s\"%s\":{\"calls\":%llu,\"total_ns\":%llu,\"buckets\":[", i == 0 ? "" : ",", op->name,
+                (unsigned long long) op->calls, (unsigned long long) op->total_ns);
+        for (int k = 0; k < EXTFS_STATS_BUCKETS; k++) {
+            fprintf(s->out, "%s%llu", k == 0 ? "" : ",", (unsigned long long) op->buckets[k]);
         }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
+        fprintf(s->out, "]}");
+    }
+    fprintf(s->out, "}}\n");
 }
 
-void rmdir() {
-    char *path = extract_argument();
-
-    uint32_t cur_inode;
-    if ((cur_inode = find_path_inode(path)) == ERROR) {
+void stats(struct session *s) {
+    char *mode = extract_argument(s);
+    if (mode != NULL && strcmp(mode, "reset") == 0) {
+        check(s, extfs_stats_reset(s->fs));
         return;
     }
-
-    if (cur_inode == dir_inodes[0]) {
-        format();
+    if (mode != NULL && strcmp(mode, "json") != 0) {
+        fprintf(s->out, "ERR: Use stats, stats json or stats reset.\n");
         return;
     }
-
-    if (fp->nodes[cur_inode].mode != MODE_DIR) {
-        printf("ERR: Cannot rmdir a file.\n");
+    struct extfs_stats st;
+    if (check(s, extfs_stats(s->fs, &st)) != EXTFS_OK)
         return;
+    if (mode == NULL) {
+        print_stats(s, &st);
+    } else {
+        print_stats_json(s, &st);
     }
-
-    uint32_t temp_inode = temp_dir_inodes[temp_cur_depth-1];
-    uint32_t block;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                if (fp->blocks[block].entries[i].id == cur_inode) {
-                    rmdir_recursively(cur_inode);
-                    fp->nodes[temp_inode].entry_count--;
-                    fp->nodes[temp_inode].bitmap[i] = 0;
-
-                    uint32_t temp_sub_inode = cur_inode;
-                    do {
-                        fp->sb.block_bitmap[fp->nodes[temp_sub_inode].blocks[0]] = 0;
-                        fp->sb.inode_bitmap[temp_sub_inode] = 0;
-                        temp_sub_inode = fp->nodes[temp_sub_inode].next_inode;
-                    } while (temp_sub_inode != INVALID_INODE);
-
-                    while (fp->sb.inode_bitmap[dir_inodes[cur_depth]] == 0) {
-                        cur_depth--;
-                    }
-                    printf("Changing dir to: ");
-                    pwd(1);
-                    return;
-                }
-            }
-        }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
 }
 
-void dump_inode() {
-    for (int i = 0; i < MAX_INODE; i++) {
-        if (fp->sb.inode_bitmap[i] == 0)
-            continue;
-        if (fp->nodes[i].mode == MODE_DIR || fp->nodes[i].mode == MODE_CONT) {
-            if (fp->nodes[i].mode == MODE_DIR) {
-                printf("Inode #%d: dir\n", i);
-            } else {
-                printf("Inode #%d: cont\n", i);
-            }
-
-            int temp_inode = i;
-            do {
-                uint32_t block = fp->nodes[temp_inode].blocks[0];
-                printf("Block #%d:\n", block);
-                for (int j = 0; j < MAX_DIRENTRY_PER_BLOCK; j++) {
-                    if (fp->nodes[temp_inode].bitmap[j] != 0) {
-                        printf("Item #%d: Id: %d Name: %s\n", j, fp->blocks[block].entries[j].id,
-                               fp->blocks[block].entries[j].name);
-                    }
-                }
-                temp_inode = fp->nodes[temp_inode].next_inode;
-                if (temp_inode != INVALID_INODE) {
-                    printf("Going to next:%d\n", temp_inode);
-                }
-            } while (temp_inode != INVALID_INODE);
-        } else if (fp->nodes[i].mode == MODE_FILE) {
-            printf("Inode #%d: file\n", i);
-            uint32_t block = fp->nodes[i].blocks[0];
-            printf("Block: %d Content: %s\n", fp->nodes[i].blocks[0], fp->blocks[block].data);
-        } else if (fp->nodes[i].mode == MODE_CONT) {
-            printf("Inode #%d: cont\n", i);
-            printf("Next is: %d\n", fp->nodes[i].next_inode);
-        }
+void print_transfer(struct session *s, const char *done, const struct extfs_transfer_stats *st) {
+    fprintf(s->out, "%s %u dirs and %u files, %llu bytes", done, st->dirs, st->files, (unsigned long long) st->bytes);
+    if (st->skipped > 0) {
+        fprintf(s->out, ", skipped %u entries", st->skipped);
     }
+    fprintf(s->out, ".\n");
 }
 
-void echo() {
-    char *str = extract_argument();
-    char *path = extract_argument(), *file_name;
-    if (str == NULL || path == NULL) {
-        printf("ERR: Please input str and path.\n");
+void import(struct session *s) {
+    char *hostdir = extract_argument(s);
+    char *path = extract_argument(s);
+    if (hostdir == NULL || path == NULL) {
+        fprintf(s->out, "ERR: Please input host dir and path.\n");
         return;
     }
-
-    temp_cur_depth = cur_depth;
-    memcpy(temp_dir_inodes, dir_inodes, sizeof(dir_inodes));
-    split_path(&path, &file_name);
-    if (find_path_inode(path) == ERROR || check_filename_valid(file_name) == ERROR)
-        return;
-
-    uint32_t id = temp_dir_inodes[temp_cur_depth];
-    uint32_t block;
-    uint32_t temp_inode = id;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                if (strcmp(file_name, fp->blocks[block].entries[i].name) == 0) {
-                    printf("ERR: Name already occupied.\n");
-                    return;
-                }
-            }
-        }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
-
-    uint32_t new_inode = allocate_inode(MODE_FILE, BLOCK_DATA);
-    if (new_inode != ERROR) {
-        temp_inode = id;
-        uint32_t prev_inode = INVALID_INODE;
-        do {
-            block = fp->nodes[temp_inode].blocks[0];
-            for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-                if (fp->nodes[temp_inode].bitmap[i] == 0) {
-                    fp->nodes[temp_inode].entry_count++;
-                    fp->nodes[temp_inode].bitmap[i] = 1;
-                    strcpy(fp->blocks[block].entries[i].name, file_name);
-                    fp->blocks[block].entries[i].id = new_inode;
-                    uint32_t len = (uint32_t) strlen(str);
-                    fp->nodes[new_inode].file_size = len;
-                    memcpy(fp->blocks[fp->nodes[new_inode].blocks[0]].data, str, len);
-                    return ;
-                }
-            }
-            prev_inode = temp_inode;
-            temp_inode = fp->nodes[temp_inode].next_inode;
-        } while (temp_inode != INVALID_INODE);
-
-        printf("INFO: Dir entry limit exceeded and creating a new inode for it.\n");
-        uint32_t new_cont = allocate_inode(MODE_CONT, BLOCK_DIR_ENTRY);
-        if (new_cont != ERROR) {
-            block = fp->nodes[new_cont].blocks[0];
-            fp->nodes[new_cont].entry_count++;
-            fp->nodes[new_cont].bitmap[0] = 1;
-            uint32_t len = (uint32_t) strlen(str);
-            fp->nodes[new_inode].file_size = len;
-            memcpy(fp->blocks[fp->nodes[new_inode].blocks[0]].data, str, len);
-            fp->blocks[block].entries[0].id = new_inode;
-            fp->nodes[prev_inode].next_inode = new_cont;
-        }
+    struct extfs_transfer_stats st;
+    int status = extfs_import(s->fs, hostdir, path, &st);
+    if (st.dirs > 0) {
+        print_transfer(s, "Imported", &st);
     }
+    check(s, status);
 }
 
-void cat() {
-    char *path = extract_argument(), *file_name;
-    if (path == NULL) {
-        printf("ERR: Please specify file path.\n");
+void export(struct session *s) {
+    char *path = extract_argument(s);
+    char *hostdir = extract_argument(s);
+    if (path == NULL || hostdir == NULL) {
+        fprintf(s->out, "ERR: Please input path and host dir.\n");
         return;
     }
+    struct extfs_transfer_stats st;
+    int status = extfs_export(s->fs, path, hostdir, &st);
+    if (st.dirs > 0) {
+        print_transfer(s, "Exported", &st);
+    }
+    check(s, status);
+}
 
-    temp_cur_depth = cur_depth;
-    memcpy(temp_dir_inodes, dir_inodes, sizeof(dir_inodes));
-    split_path(&path, &file_name);
-    if (find_path_inode(path) == ERROR || check_filename_valid(file_name) == ERROR)
+void du(struct session *s) {
+    char *path = extract_argument(s);
+    struct extfs_usage usage;
+    if (check(s, extfs_du(s->fs, path == NULL ? "." : path, &usage)) != EXTFS_OK)
         return;
+    fprintf(s->out, "%llu bytes in %u inodes\n", (unsigned long long) usage.bytes, usage.inodes);
+}
 
-    uint32_t id = temp_dir_inodes[temp_cur_depth];
-    uint32_t temp_inode = id;
-    uint32_t block;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                if (strcmp(file_name, fp->blocks[block].entries[i].name) == 0) {
-                    uint32_t index = fp->blocks[block].entries[i].id;
-                    if (fp->nodes[index].mode == MODE_DIR) {
-                        printf("ERR: Cannot cat a dir.\n");
-                        return;
-                    }
-                    memcpy(buffer, fp->blocks[fp->nodes[index].blocks[0]].data, fp->nodes[index].file_size);
-                    buffer[fp->nodes[index].file_size] = '\0';
-                    printf("%s\n", buffer);
-                    return;
-                }
-            }
-        }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
-    printf("ERR: File not found.\n");
+void print_found(void *arg, const char *path, int is_dir) {
+    fprintf((FILE *) arg, "%s%s\n", path, is_dir ? "/" : "");
 }
 
-void rm() {
-    char *path = extract_argument(), *file_name;
+void find(struct session *s) {
+    char *path = extract_argument(s);
+    char *pattern = extract_argument(s);
     if (path == NULL) {
-        printf("ERR: Please specify file path.\n");
+        fprintf(s->out, "ERR: Please input a name pattern.\n");
         return;
     }
-
-    size_t len = strlen(path);
-    if (len > 0 && path[len - 1] == '/') {
-        printf("ERR: Use rmdir to remove dir.\n");
-        return;
+    if (pattern == NULL) {
+        pattern = path;
+        path = ".";
     }
-    temp_cur_depth = cur_depth;
-    memcpy(temp_dir_inodes, dir_inodes, sizeof(dir_inodes));
-    split_path(&path, &file_name);
-    if (find_path_inode(path) == ERROR || check_filename_valid(file_name) == ERROR)
-        return;
-
-    uint32_t id = temp_dir_inodes[temp_cur_depth];
-    uint32_t temp_inode = id;
-    uint32_t block;
-    do {
-        block = fp->nodes[temp_inode].blocks[0];
-        for (int i = 0; i < MAX_DIRENTRY_PER_BLOCK; i++) {
-            if (fp->nodes[temp_inode].bitmap[i] != 0) {
-                if (strcmp(file_name, fp->blocks[block].entries[i].name) == 0) {
-                    uint32_t index = fp->blocks[block].entries[i].id;
-                    if (fp->nodes[index].mode == MODE_DIR) {
-                        printf("ERR: Use mkdir to remove dir.\n");
-                        return;
-                    } else {
-                        fp->nodes[temp_inode].entry_count--;
-                        fp->nodes[temp_inode].bitmap[i] = 0;
-                        fp->sb.inode_bitmap[index] = 0;
-                        fp->sb.block_bitmap[fp->nodes[index].blocks[0]] = 0;
-                        printf("File removed.\n");
-                    }
-                    return;
-                }
-            }
-        }
-        temp_inode = fp->nodes[temp_inode].next_inode;
-    } while (temp_inode != INVALID_INODE);
-    printf("ERR: File not found.\n");
+    check(s, extfs_find(s->fs, path, pattern, print_found, s->out));
 }
 
-void usage() {
-    printf("extfs: A persistent in-memory fs.\n"
+void usage(struct session *s) {
+    fprintf(s->out, "extfs: A persistent in-memory fs.\n"
            "commands:\n"
            "\tq: quit extfs.\n"
            "\tread: read from %s.\n"
@@ -710,81 +449,337 @@ void usage() {
            "\techo: write to file.\n"
            "\tcat: show file.\n"
            "\trm: remove file.\n"
-           "\tfmt: format disk.\n"
+           "\tfmt: format disk, optionally with inode and block counts.\n"
+           "\tresize: grow disk to a block count.\n"
+           "\ttrim: write disk, leaving holes for unused blocks.\n"
+           "\tdefrag: repack directories and move blocks together, or with auto and a\n"
+           "\t        percentage, repack directories left less full than it.\n"
+           "\tsnapshot: create, rollback to or delete a named snapshot of the whole\n"
+           "\t          disk, or list them.\n"
+           "\tfsck: check the disk, or with repair, also fix the problems found.\n"
+           "\timport: copy a host dir into a new dir.\n"
+           "\texport: copy a dir into a host dir.\n"
+           "\tdu: show bytes and inodes below a dir.\n"
+           "\tfind: list the paths below a dir whose names match a pattern like f*.txt.\n"
+           "\tdf: show free inodes and blocks.\n"
+           "\tdcache: show dentry cache statistics.\n"
+           "\tstats: show lookup, scan and I/O counters and call latencies, with json\n"
+           "\t       as JSON, or with reset, start them over.\n"
            "\tdmp: dump internal presentation.\n",
            DATA_FILE, DATA_FILE);
 }
 
-int run_command() {
-    char *f = extract_argument();
+int run_command(struct session *s) {
+    char *f = extract_argument(s);
     if (strcmp(f, "q") == 0) {
-        printf("Now quitting...\n");
+        if (!s->batch)
+            fprintf(s->out, "Now quitting...\n");
         return 1;
     } else if (strcmp(f, "read") == 0) {
-        read_fs();
+        check(s, extfs_reload(s->fs));
     } else if (strcmp(f, "write") == 0) {
-        write_fs();
+        check(s, extfs_sync(s->fs));
     } else if (strcmp(f, "pwd") == 0) {
-        pwd(1);
+        pwd(s);
     } else if (strcmp(f, "cd") == 0) {
-        cd();
+        cd(s);
     } else if (strcmp(f, "mkdir") == 0) {
-        mkdir();
+        fs_mkdir(s);
     } else if (strcmp(f, "ls") == 0) {
-        ls();
+        ls(s);
     } else if (strcmp(f, "rmdir") == 0) {
-        rmdir();
+        fs_rmdir(s);
     } else if (strcmp(f, "echo") == 0) {
-        echo();
+        echo(s);
     } else if (strcmp(f, "cat") == 0) {
-        cat();
+        cat(s);
     } else if (strcmp(f, "rm") == 0) {
-        rm();
+        rm(s);
     } else if (strcmp(f, "fmt") == 0) {
-        format();
+        fmt(s);
+    } else if (strcmp(f, "resize") == 0) {
+        resize(s);
+    } else if (strcmp(f, "trim") == 0) {
+        check(s, extfs_trim(s->fs));
+    } else if (strcmp(f, "defrag") == 0) {
+        defrag(s);
+    } else if (strcmp(f, "snapshot") == 0) {
+        snapshot(s);
+    } else if (strcmp(f, "fsck") == 0) {
+        fsck(s);
+    } else if (strcmp(f, "import") == 0) {
+        import(s);
+    } else if (strcmp(f, "export") == 0) {
+        export(s);
+    } else if (strcmp(f, "du") == 0) {
+        du(s);
+    } else if (strcmp(f, "find") == 0) {
+        find(s);
+    } else if (strcmp(f, "df") == 0) {
+        df(s);
+    } else if (strcmp(f, "dcache") == 0) {
+        dcache_stats(s);
+    } else if (strcmp(f, "stats") == 0) {
+        stats(s);
     } else if (strcmp(f, "dmp") == 0) {
-        dump_inode();
+        extfs_dump(s->fs, s->out);
     } else {
-        usage();
+        usage(s);
     }
     return 0;
 }
 
-int main() {
-    fp = (struct file *) malloc(sizeof(struct file));
-    read_fs();
-    printf(">> ");
-    fflush(stdout);
-    while (fgets(cmd, BUFFER_LEN, stdin) != NULL) {
-        size_t len = strlen(cmd);
-        if (len > 0 && cmd[len - 1] == '\n') {
-            cmd[--len] = '\0';
-        }
-        if (len == 0)
-            goto next;
-        cur_cmd = cmd;
-        cmd_end = cmd + len;
-        char *p = cur_cmd;
-        for (; p < cmd_end; p++) {
-            if (*p == ' ') {
-                *p = '\0';
-            } else if (*p == '"') {
-                *(p++) = '\0';
-                while (p < cmd_end && *p != '"') p++;
-                if (p == cmd_end) {
-                    printf("ERR: Quotes not balanced.\n");
-                    goto next;
-                }
-                *p = '\0';
+void prompt(struct session *s) {
+    if (s->batch)
+        return;
+    fprintf(s->out, ">> ");
+    fflush(s->out);
+}
+
+// Splits a command line of len bytes into arguments in place and runs it.
+// Returns 1 if it asks to quit.
+int run_line(struct session *s, char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\n') {
+        line[--len] = '\0';
+    }
+    if (len == 0)
+        return 0;
+    s->cur_cmd = line;
+    s->cmd_end = line + len;
+    char *p = s->cur_cmd;
+    for (; p < s->cmd_end; p++) {
+        if (*p == ' ') {
+            *p = '\0';
+        } else if (*p == '"') {
+            *(p++) = '\0';
+            while (p < s->cmd_end && *p != '"') p++;
+            if (p == s->cmd_end) {
+                fprintf(s->out, "ERR: Quotes not balanced.\n");
+                return 0;
             }
+            *p = '\0';
         }
+    }
+    int result = run_command(s);
+    // failures in the background, like those of journal writes, show up
+    // after the command
+    check(s, extfs_check_io(s->fs));
+    return result;
+}
 
-        if (run_command() == 1)
+// Runs commands from in until it ends or one asks to quit.
+void run_session(struct session *s, FILE *in) {
+    char *cmd = NULL;
+    size_t cmd_cap = 0;
+    ssize_t read_len;
+    prompt(s);
+    while ((read_len = getline(&cmd, &cmd_cap, in)) != -1) {
+        if (run_line(s, cmd, (size_t) read_len) == 1)
             break;
+        prompt(s);
+    }
+    free(cmd);
+}
+
+// Server mode: each client connected to the socket runs a batch session of
+// its own, on its own handle and thread, until it quits or hangs up.
+
+struct client {
+    int fd; // -1 once the client is gone
+    pthread_t thread;
+    struct extfs *fs;
+    struct client *next;
+};
 
-    next:
-        printf(">> ");
-        fflush(stdout);
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+struct client *clients;
+
+void *client_main(void *arg) {
+    struct client *c = (struct client *) arg;
+    FILE *in = fdopen(c->fd, "r");
+    struct session s = {c->fs, fdopen(dup(c->fd), "w"), 1, NULL, NULL};
+    if (in != NULL && s.out != NULL) {
+        // the client sees each result as soon as it is printed
+        setvbuf(s.out, NULL, _IOLBF, 0);
+        run_session(&s, in);
+    }
+    pthread_mutex_lock(&clients_lock);
+    int fd = c->fd;
+    c->fd = -1;
+    pthread_mutex_unlock(&clients_lock);
+    if (s.out != NULL)
+        fclose(s.out);
+    if (in != NULL) {
+        fclose(in);
+    } else {
+        close(fd);
+    }
+    return NULL;
+}
+
+// Joins the threads of clients that are gone, or of all clients.
+void reap_clients(int all) {
+    struct client **link = &clients;
+    pthread_mutex_lock(&clients_lock);
+    while (*link != NULL) {
+        struct client *c = *link;
+        if (c->fd >= 0 && !all) {
+            link = &c->next;
+            continue;
+        }
+        if (c->fd >= 0) {
+            // ends the session at its next read
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        *link = c->next;
+        pthread_mutex_unlock(&clients_lock);
+        pthread_join(c->thread, NULL);
+        extfs_close(c->fs);
+        free(c);
+        pthread_mutex_lock(&clients_lock);
+    }
+    pthread_mutex_unlock(&clients_lock);
+}
+
+void stop_server(int sig) {
+    (void) sig;
+}
+
+int serve(struct extfs *fs, const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long.\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    // a socket left behind by a server that died is taken over
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(server_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Cannot listen on %s.\n", path);
+        return 1;
+    }
+
+    // SIGINT and SIGTERM only get through while waiting for a client
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd pfd = {server_fd, POLLIN, 0};
+    while (ppoll(&pfd, 1, NULL, &wait_mask) >= 0 || errno != EINTR) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        reap_clients(0);
+        struct client *c = (struct client *) calloc(1, sizeof(struct client));
+        c->fd = fd;
+        if ((c->fs = extfs_dup(fs)) == NULL) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_mutex_lock(&clients_lock);
+        if (pthread_create(&c->thread, NULL, client_main, c) != 0) {
+            pthread_mutex_unlock(&clients_lock);
+            extfs_close(c->fs);
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->next = clients;
+        clients = c;
+        pthread_mutex_unlock(&clients_lock);
     }
-    write_fs();
+    close(server_fd);
+    unlink(path);
+    reap_clients(1);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int interactive = isatty(STDIN_FILENO);
+    int journal_policy = EXTFS_JOURNAL_GROUP;
+    const char *socket_path = NULL;
+    int flags = 0, fsck_mode = -1;
+    while ((opt = getopt(argc, argv, "bdf:ij:s:z")) != -1) {
+        if (opt == 'b') {
+            interactive = 0;
+            continue;
+        } else if (opt == 'd') {
+            flags |= EXTFS_LAZY_FREE;
+            continue;
+        } else if (opt == 'f' && (strcmp(optarg, "check") == 0 || strcmp(optarg, "repair") == 0)) {
+            fsck_mode = strcmp(optarg, "repair") == 0;
+            continue;
+        } else if (opt == 'i') {
+            interactive = 1;
+            continue;
+        } else if (opt == 'j' && (journal_policy = extfs_parse_journal_policy(optarg)) != ERROR) {
+            continue;
+        } else if (opt == 's') {
+            socket_path = optarg;
+            continue;
+        } else if (opt == 'z') {
+            flags |= EXTFS_PACKED;
+            continue;
+        }
+        fprintf(stderr, "usage: %s [-b|-i] [-d] [-j off|async|group|sync] [-z] [-f check|repair | -s socket | script]\n"
+                        "\t-b: batch mode, the default when stdin is not a terminal.\n"
+                        "\t-i: interactive mode, with a prompt after each command.\n"
+                        "\t-d: free the subtrees rmdir removes in the background.\n"
+                        "\t-j: journal fsync policy, group by default.\n"
+                        "\t-z: keep %s compressed, packing it if it is not.\n"
+                        "\t-f: check, or repair, %s and exit, with status 1 if problems are left.\n"
+                        "\t-s: serve clients connecting to this Unix socket, each in batch mode.\n"
+                        "\tscript: read commands from this file in batch mode.\n", argv[0], DATA_FILE, DATA_FILE);
+        return 1;
+    }
+    FILE *input = stdin;
+    if (fsck_mode >= 0 || socket_path != NULL) {
+        interactive = 0;
+    } else if (optind < argc) {
+        if ((input = fopen(argv[optind], "r")) == NULL) {
+            fprintf(stderr, "Cannot open %s.\n", argv[optind]);
+            return 1;
+        }
+        interactive = 0;
+    }
+    struct session s = {NULL, stdout, !interactive, NULL, NULL};
+    if (s.batch) {
+        setvbuf(stdout, output_buffer, _IOFBF, OUTPUT_BUFFER);
+    }
+    if ((s.fs = extfs_open(DATA_FILE, journal_policy, flags | (s.batch ? EXTFS_QUIET : 0))) == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", DATA_FILE);
+        return 1;
+    }
+    check(&s, extfs_check_io(s.fs));
+    int result = 0;
+    if (fsck_mode >= 0) {
+        result = run_fsck(&s, fsck_mode) != 0;
+    } else if (socket_path != NULL) {
+        result = serve(s.fs, socket_path);
+    } else {
+        run_session(&s, input);
+    }
+    if (input != stdin)
+        fclose(input);
+    if (check(&s, extfs_close(s.fs)) != EXTFS_OK)
+        result = 1;
+    return result;
 }
@@ -0,0 +1,31 @@
+# Writes an image with the 20171213 shell and checks that the current one
+# upgrades it with every dir and file in place. Run by ctest with LEGACY and
+# EXTFS set to the two shells and DIR to a scratch dir.
+file(REMOVE_RECURSE ${DIR})
+file(MAKE_DIRECTORY ${DIR})
+
+# 16 more dirs take a past the 16 entries of a block, into a second inode,
+# which then gets files. Dirs open it, as the 20171213 echo leaves the name
+# of the entry starting a new block empty.
+set(script "mkdir a\nmkdir a/b\necho hello a/b/f\necho \"top level\" g\n")
+set(expected "hello\ntop level\n")
+foreach(i RANGE 1 16)
+    string(APPEND script "mkdir a/d${i}\n")
+endforeach()
+foreach(i RANGE 1 4)
+    string(APPEND script "echo x${i} a/f${i}\n")
+endforeach()
+file(WRITE ${DIR}/legacy.txt "${script}q\n")
+execute_process(COMMAND ${LEGACY} INPUT_FILE ${DIR}/legacy.txt OUTPUT_QUIET
+                WORKING_DIRECTORY ${DIR} RESULT_VARIABLE status)
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "The legacy shell failed: ${status}")
+endif()
+
+file(WRITE ${DIR}/check.txt "cat /a/b/f\ncat /g\ncat /a/f4\nfsck\nq\n")
+execute_process(COMMAND ${EXTFS} -b INPUT_FILE ${DIR}/check.txt OUTPUT_VARIABLE output
+                ERROR_VARIABLE output WORKING_DIRECTORY ${DIR})
+string(APPEND expected "x4\nChecked 19 dirs and 6 files: 0 problems.\n")
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "Unexpected output of the upgraded image:\n${output}")
+endif()